@@ -0,0 +1,258 @@
+#include "augmenter.h"
+
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+
+namespace cave
+{
+    Augmenter::Augmenter(Dataset &source, int width, int height, std::uint64_t seed)
+        : source_(source), width_(width), height_(height), seed_(seed)
+    {
+        if (width * height != source.inputSize())
+        {
+            throw std::invalid_argument("Augmented images must be width x height with one channel.");
+        }
+
+        setElastic(0, elasticSigma_);
+    }
+
+    /*
+     * Elastic distortion moves each pixel by a random field smoothed with
+     * a Gaussian of width sigma and scaled by alpha (Simard et al., "Best
+     * Practices for Convolutional Neural Networks Applied to Visual
+     * Document Analysis").
+     */
+    void Augmenter::setElastic(double alpha, double sigma)
+    {
+        if (sigma <= 0)
+        {
+            throw std::invalid_argument("Elastic sigma must be positive.");
+        }
+
+        elasticAlpha_ = alpha;
+        elasticSigma_ = sigma;
+
+        int radius = std::ceil(3 * sigma);
+        kernel_.resize(2 * radius + 1);
+
+        double total = 0;
+
+        for (int i = -radius; i <= radius; ++i)
+        {
+            kernel_[i + radius] = std::exp(-0.5 * i * i / (sigma * sigma));
+            total += kernel_[i + radius];
+        }
+
+        for (double &weight : kernel_)
+        {
+            weight /= total;
+        }
+    }
+
+    void Augmenter::beginEpoch(int epoch)
+    {
+        epoch_ = epoch;
+        source_.beginEpoch(epoch);
+    }
+
+    void Augmenter::displacements(std::uint64_t stream, std::vector<double> &dx, std::vector<double> &dy)
+    {
+        int pixels = width_ * height_;
+        int radius = kernel_.size() / 2;
+
+        Philox philox(seed_);
+        std::vector<double> field(pixels);
+        std::vector<double> blurred(pixels);
+
+        for (int axis = 0; axis < 2; ++axis)
+        {
+            std::vector<double> &out = axis == 0 ? dx : dy;
+
+            philox.fillUniform(field.data(), pixels, Philox::stream(stream, axis));
+
+            // Separable blur with zero padding: along rows, then columns.
+            for (int y = 0; y < height_; ++y)
+            {
+                for (int x = 0; x < width_; ++x)
+                {
+                    double sum = 0;
+
+                    for (int k = std::max(-radius, -x); k <= std::min(radius, width_ - 1 - x); ++k)
+                    {
+                        sum += kernel_[k + radius] * (2 * field[y * width_ + x + k] - 1);
+                    }
+
+                    blurred[y * width_ + x] = sum;
+                }
+            }
+
+            for (int y = 0; y < height_; ++y)
+            {
+                for (int x = 0; x < width_; ++x)
+                {
+                    double sum = 0;
+
+                    for (int k = std::max(-radius, -y); k <= std::min(radius, height_ - 1 - y); ++k)
+                    {
+                        sum += kernel_[k + radius] * blurred[(y + k) * width_ + x];
+                    }
+
+                    out[y * width_ + x] = elasticAlpha_ * sum;
+                }
+            }
+        }
+    }
+
+    /*
+     * Maps every target pixel back through the inverse of a random
+     * rotation about the centre and shift, adds the elastic displacement,
+     * and samples the source bilinearly, treating pixels outside it as 0.
+     * Source coordinates are computed a row at a time in plain loops the
+     * compiler vectorizes, apart from the sampling itself.
+     */
+    void Augmenter::augment(const double *source, double *target, std::uint64_t stream)
+    {
+        const double pi = 3.141592653589793;
+
+        Philox philox(seed_);
+        std::uint32_t words[4];
+        philox.block(Philox::stream(stream, 2), 0, words);
+
+        double angle = rotation_ * pi / 180 * (2 * Philox::toUniform(words[0]) - 1);
+        double shiftX = shift_ * (2 * Philox::toUniform(words[1]) - 1);
+        double shiftY = shift_ * (2 * Philox::toUniform(words[2]) - 1);
+
+        double cosine = std::cos(angle);
+        double sine = std::sin(angle);
+        double centreX = 0.5 * (width_ - 1);
+        double centreY = 0.5 * (height_ - 1);
+
+        int pixels = width_ * height_;
+        std::vector<double> dx;
+        std::vector<double> dy;
+
+        if (elasticAlpha_ != 0)
+        {
+            dx.resize(pixels);
+            dy.resize(pixels);
+            displacements(stream, dx, dy);
+        }
+
+        std::vector<double> sourceX(width_);
+        std::vector<double> sourceY(width_);
+
+        for (int y = 0; y < height_; ++y)
+        {
+            double offsetY = y - centreY - shiftY;
+
+            for (int x = 0; x < width_; ++x)
+            {
+                double offsetX = x - centreX - shiftX;
+
+                sourceX[x] = cosine * offsetX + sine * offsetY + centreX;
+                sourceY[x] = cosine * offsetY - sine * offsetX + centreY;
+            }
+
+            if (elasticAlpha_ != 0)
+            {
+                for (int x = 0; x < width_; ++x)
+                {
+                    sourceX[x] += dx[y * width_ + x];
+                    sourceY[x] += dy[y * width_ + x];
+                }
+            }
+
+            for (int x = 0; x < width_; ++x)
+            {
+                double floorX = std::floor(sourceX[x]);
+                double floorY = std::floor(sourceY[x]);
+                int left = floorX;
+                int top = floorY;
+                double fractionX = sourceX[x] - floorX;
+                double fractionY = sourceY[x] - floorY;
+
+                double value = 0;
+
+                for (int row = 0; row < 2; ++row)
+                {
+                    int sampleY = top + row;
+
+                    if (sampleY < 0 || sampleY >= height_)
+                    {
+                        continue;
+                    }
+
+                    double weightY = row == 0 ? 1 - fractionY : fractionY;
+
+                    for (int col = 0; col < 2; ++col)
+                    {
+                        int sampleX = left + col;
+
+                        if (sampleX < 0 || sampleX >= width_)
+                        {
+                            continue;
+                        }
+
+                        double weightX = col == 0 ? 1 - fractionX : fractionX;
+
+                        value += weightX * weightY * source[sampleY * width_ + sampleX];
+                    }
+                }
+
+                target[y * width_ + x] = value;
+            }
+        }
+
+        if (noise_ != 0)
+        {
+            std::vector<double> noise(pixels);
+            philox.fillNormal(noise.data(), pixels, Philox::stream(stream, 3));
+
+            for (int i = 0; i < pixels; ++i)
+            {
+                target[i] = std::min(1.0, std::max(0.0, target[i] + noise_ * noise[i]));
+            }
+        }
+    }
+
+    Matrix &Augmenter::input(int batch, Matrix &buffer)
+    {
+        Matrix &original = source_.input(batch, buffer);
+
+        if (shift_ == 0 && rotation_ == 0 && elasticAlpha_ == 0 && noise_ == 0)
+        {
+            return original;
+        }
+
+        // Batches the source holds must not be changed.
+        if (&original != &buffer)
+        {
+            buffer = original;
+        }
+
+        int pixels = width_ * height_;
+        int cols = buffer.cols();
+        double *data = buffer.data();
+
+        std::vector<double> image(pixels);
+        std::vector<double> augmented(pixels);
+
+        for (int col = 0; col < cols; ++col)
+        {
+            for (int i = 0; i < pixels; ++i)
+            {
+                image[i] = data[i * cols + col];
+            }
+
+            augment(image.data(), augmented.data(), Philox::stream(epoch_, batch, col));
+
+            for (int i = 0; i < pixels; ++i)
+            {
+                data[i * cols + col] = augmented[i];
+            }
+        }
+
+        return buffer;
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "dataset.h"
+#include "random.h"
+
+namespace cave
+{
+    /*
+     * Applies random shifts, rotations, elastic distortion and noise to
+     * the images of another dataset as batches are asked for, so every
+     * epoch sees new variations without storing any. Each image draws from
+     * its own Philox stream keyed by epoch, batch and column, so results
+     * do not depend on which thread augments it. Images are single-channel
+     * width x height, one per column, with values between 0 and 1.
+     *
+     * Batches are augmented on whichever thread asks for them; wrapping an
+     * Augmenter in a Prefetcher moves the work onto its producer threads.
+     */
+    class Augmenter : public Dataset
+    {
+    private:
+        Dataset &source_;
+        int width_;
+        int height_;
+        std::uint64_t seed_;
+        int epoch_{0};
+
+        double shift_{0};
+        double rotation_{0};
+        double elasticAlpha_{0};
+        double elasticSigma_{4};
+        double noise_{0};
+
+        std::vector<double> kernel_;
+
+    private:
+        void displacements(std::uint64_t stream, std::vector<double> &dx, std::vector<double> &dy);
+        void augment(const double *source, double *target, std::uint64_t stream);
+
+    public:
+        Augmenter(Dataset &source, int width, int height, std::uint64_t seed = Philox::randomSeed());
+
+        void setShift(double pixels) { shift_ = pixels; }
+        void setRotation(double degrees) { rotation_ = degrees; }
+        void setElastic(double alpha, double sigma);
+        void setNoise(double stddev) { noise_ = stddev; }
+
+        int batches() { return source_.batches(); }
+        int inputSize() { return source_.inputSize(); }
+        int items(int batch) { return source_.items(batch); }
+
+        Matrix &input(int batch, Matrix &buffer);
+        Matrix &expected(int batch, Matrix &buffer) { return source_.expected(batch, buffer); }
+
+        void firstTouch(const Topology &topology) { source_.firstTouch(topology); }
+        void beginEpoch(int epoch);
+    };
+}
@@ -3,14 +3,21 @@
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <condition_variable>
 
 namespace cave
 {
+    /*
+     * A bounded queue between threads. Once closed, push() refuses new
+     * items and take() drains what is left, then returns false, so
+     * producers and consumers blocked on either side are released.
+     */
     template <typename E>
     class BlockingQueue
     {
     private:
         int size_;
+        bool closed_{false};
         std::mutex mtx_;
         std::condition_variable cond_;
         std::queue<E> queue_;
@@ -20,17 +27,54 @@ namespace cave
         {
         }
 
-        void push(E e)
+        bool push(E e)
         {
             std::unique_lock<std::mutex> lock(mtx_);
 
             cond_.wait(lock, [this]()
-                       { return queue_.size() < size_; });
+                       { return closed_ || queue_.size() < size_; });
 
-            queue_.push(e);
+            if (closed_)
+            {
+                return false;
+            }
+
+            queue_.push(std::move(e));
 
             lock.unlock();
-            cond_.notify_one();
+            cond_.notify_all();
+
+            return true;
+        }
+
+        bool take(E &e)
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+
+            cond_.wait(lock, [this]()
+                       { return closed_ || !queue_.empty(); });
+
+            if (queue_.empty())
+            {
+                return false;
+            }
+
+            e = std::move(queue_.front());
+            queue_.pop();
+
+            lock.unlock();
+            cond_.notify_all();
+
+            return true;
+        }
+
+        void close()
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            closed_ = true;
+
+            lock.unlock();
+            cond_.notify_all();
         }
 
         E front()
@@ -0,0 +1,325 @@
+#include "datacache.h"
+
+#include <fstream>
+#include <cstring>
+#include <cstddef>
+#include <numeric>
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fileutil.h"
+
+namespace cave
+{
+    namespace
+    {
+        const char magic[8] = {'C', 'A', 'V', 'E', 'D', 'A', 'T', 'A'};
+
+        std::uint64_t pageAligned(std::uint64_t offset)
+        {
+            std::uint64_t page = sysconf(_SC_PAGESIZE);
+
+            return (offset + page - 1) / page * page;
+        }
+
+        void pad(std::ofstream &out, std::uint64_t offset)
+        {
+            std::uint64_t position = out.tellp();
+            std::vector<char> zeros(offset - position);
+            out.write(zeros.data(), zeros.size());
+        }
+    }
+
+    CachedDataset::CachedDataset(std::string file, const std::vector<std::string> &sources) : mapping_(file)
+    {
+        static_assert(sizeof(Header) == 80, "Cache header layout must not change without a version bump.");
+
+        if (mapping_.size() < sizeof(Header))
+        {
+            throw FileException("Not a dataset cache: " + file);
+        }
+
+        std::memcpy(&header_, mapping_.data(), sizeof(Header));
+
+        if (std::memcmp(header_.magic, magic, sizeof(magic)) != 0)
+        {
+            throw FileException("Not a dataset cache: " + file);
+        }
+
+        if (header_.version != version_)
+        {
+            throw FileException("Dataset cache " + file + " was written by another version.");
+        }
+
+        std::uint64_t inputBytes = std::uint64_t(header_.items) * header_.inputSize * sizeof(double);
+
+        if (header_.headerChecksum != checksum(mapping_.data(), offsetof(Header, headerChecksum)) ||
+            header_.fileSize != mapping_.size() ||
+            header_.classes > 256 ||
+            header_.inputOffset + inputBytes > header_.labelOffset ||
+            header_.labelOffset + header_.items > header_.fileSize)
+        {
+            throw FileException("Corrupt dataset cache: " + file);
+        }
+
+        if (!sources.empty() && header_.sourceFingerprint != fingerprint(sources))
+        {
+            throw FileException("Dataset cache " + file + " is older than its source files.");
+        }
+    }
+
+    /*
+     * Word-at-a-time multiplicative hash; any trailing bytes form a last,
+     * zero-padded word. Chunks hashed in turn give the same result as
+     * hashing them together as long as all but the last are whole words.
+     */
+    std::uint64_t CachedDataset::checksum(const std::uint8_t *data, std::size_t bytes, std::uint64_t hash)
+    {
+        std::size_t words = bytes / 8;
+
+        for (std::size_t i = 0; i <= words; ++i)
+        {
+            std::uint64_t word = 0;
+            std::size_t length = i < words ? 8 : bytes % 8;
+
+            if (length == 0)
+            {
+                break;
+            }
+
+            std::memcpy(&word, data + 8 * i, length);
+
+            hash ^= word;
+            hash = (hash << 29) | (hash >> 35);
+            hash *= 0x9E3779B97F4A7C15ULL;
+        }
+
+        return hash;
+    }
+
+    /*
+     * Hashes each file's size, modification time and first bytes; reading
+     * the data itself would cost as much as rebuilding the cache.
+     */
+    std::uint64_t CachedDataset::fingerprint(const std::vector<std::string> &sources)
+    {
+        std::uint64_t hash = 0;
+
+        for (const std::string &source : sources)
+        {
+            struct stat status;
+
+            if (stat(source.c_str(), &status) != 0)
+            {
+                throw FileException("Unable to read " + source);
+            }
+
+            std::uint64_t metadata[] = {
+                std::uint64_t(status.st_size),
+                std::uint64_t(status.st_mtim.tv_sec),
+                std::uint64_t(status.st_mtim.tv_nsec),
+            };
+
+            hash = checksum(reinterpret_cast<const std::uint8_t *>(metadata), sizeof(metadata), hash);
+
+            std::uint8_t leading[16] = {};
+            std::ifstream in(source, std::ios::binary);
+            in.read(reinterpret_cast<char *>(leading), sizeof(leading));
+
+            hash = checksum(leading, sizeof(leading), hash);
+        }
+
+        return hash;
+    }
+
+    /*
+     * Converts source into a cache file. Every batch but the last must be
+     * full. The file is written under a temporary name and renamed, so a
+     * cache that exists is always complete.
+     */
+    void CachedDataset::write(Dataset &source, std::string file, const std::vector<std::string> &sources)
+    {
+        Header header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+
+        header.version = version_;
+        header.sourceFingerprint = fingerprint(sources);
+        header.batches = source.batches();
+        header.inputSize = source.inputSize();
+        header.batchSize = header.batches > 0 ? source.items(0) : 0;
+
+        Matrix input;
+        Matrix expected;
+
+        for (int batch = 0; batch < source.batches(); ++batch)
+        {
+            int items = source.items(batch);
+
+            if (batch < source.batches() - 1 && items != int(header.batchSize))
+            {
+                throw std::invalid_argument("Only the last batch of a cached dataset may be short.");
+            }
+
+            header.items += items;
+        }
+
+        std::uint64_t inputBytes = std::uint64_t(header.items) * header.inputSize * sizeof(double);
+
+        header.inputOffset = pageAligned(sizeof(Header));
+        header.labelOffset = pageAligned(header.inputOffset + inputBytes);
+        header.fileSize = header.labelOffset + header.items;
+
+        std::string temporary = file + ".tmp";
+        std::ofstream out(temporary, std::ios::binary);
+
+        if (!out)
+        {
+            throw FileException("Unable to create " + temporary);
+        }
+
+        out.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+        pad(out, header.inputOffset);
+
+        std::vector<std::uint8_t> labels;
+        labels.reserve(header.items);
+
+        std::uint64_t hash = 0;
+
+        for (int batch = 0; batch < source.batches(); ++batch)
+        {
+            Matrix &batchInput = source.input(batch, input);
+            Matrix &batchExpected = source.expected(batch, expected);
+
+            // Labels are stored as single bytes.
+            if (batchExpected.rows() > 256)
+            {
+                out.close();
+                std::remove(temporary.c_str());
+                throw std::invalid_argument("A cached dataset can hold at most 256 classes.");
+            }
+
+            std::size_t bytes = std::size_t(batchInput.rows()) * batchInput.cols() * sizeof(double);
+            const std::uint8_t *data = reinterpret_cast<const std::uint8_t *>(batchInput.data());
+
+            out.write(reinterpret_cast<const char *>(data), bytes);
+            hash = checksum(data, bytes, hash);
+
+            Matrix indexes = batchExpected.largestRowIndexes();
+
+            for (int item = 0; item < indexes.cols(); ++item)
+            {
+                labels.push_back(indexes.get(0, item));
+            }
+
+            header.classes = batchExpected.rows();
+        }
+
+        pad(out, header.labelOffset);
+        out.write(reinterpret_cast<const char *>(labels.data()), labels.size());
+
+        header.checksum = checksum(labels.data(), labels.size(), hash);
+        header.headerChecksum = checksum(reinterpret_cast<const std::uint8_t *>(&header), offsetof(Header, headerChecksum));
+
+        out.seekp(0);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+        out.close();
+
+        if (!out || std::rename(temporary.c_str(), file.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            throw FileException("Unable to write " + file);
+        }
+    }
+
+    /*
+     * Reads every page of the cache, so it is not done on opening.
+     */
+    bool CachedDataset::verify() const
+    {
+        std::uint64_t inputBytes = std::uint64_t(header_.items) * header_.inputSize * sizeof(double);
+
+        std::uint64_t hash = checksum(mapping_.data() + header_.inputOffset, inputBytes);
+        hash = checksum(mapping_.data() + header_.labelOffset, header_.items, hash);
+
+        return hash == header_.checksum;
+    }
+
+    void CachedDataset::setShuffle(bool shuffle, std::uint64_t seed)
+    {
+        shuffle_ = shuffle;
+        seed_ = seed;
+        order_.clear();
+    }
+
+    void CachedDataset::beginEpoch(int epoch)
+    {
+        if (!shuffle_)
+        {
+            return;
+        }
+
+        order_.resize(header_.batches);
+        std::iota(order_.begin(), order_.end(), 0);
+
+        Philox(seed_).shuffle(order_.data(), order_.size(), Philox::stream(epoch));
+    }
+
+    int CachedDataset::items(int batch)
+    {
+        int first = mapped(batch) * header_.batchSize;
+
+        return std::min(int(header_.batchSize), int(header_.items) - first);
+    }
+
+    Matrix &CachedDataset::input(int batch, Matrix &buffer)
+    {
+        int count = items(batch);
+        int inputSize = header_.inputSize;
+
+        if (buffer.rows() != inputSize || buffer.cols() != count)
+        {
+            buffer = Matrix(inputSize, count);
+        }
+
+        std::size_t first = std::size_t(mapped(batch)) * header_.batchSize;
+        const std::uint8_t *data = mapping_.data() + header_.inputOffset + first * inputSize * sizeof(double);
+
+        std::memcpy(buffer.data(), data, std::size_t(count) * inputSize * sizeof(double));
+
+        return buffer;
+    }
+
+    Matrix &CachedDataset::expected(int batch, Matrix &buffer)
+    {
+        int count = items(batch);
+        int classes = header_.classes;
+
+        if (buffer.rows() != classes || buffer.cols() != count)
+        {
+            buffer = Matrix(classes, count);
+        }
+        else
+        {
+            std::fill(buffer.data(), buffer.data() + classes * count, 0.0);
+        }
+
+        std::size_t first = std::size_t(mapped(batch)) * header_.batchSize;
+        const std::uint8_t *labels = mapping_.data() + header_.labelOffset + first;
+
+        for (int item = 0; item < count; ++item)
+        {
+            if (labels[item] >= classes)
+            {
+                throw FileException("Label out of range in dataset cache.");
+            }
+
+            buffer.set(labels[item], item, 1.0);
+        }
+
+        return buffer;
+    }
+}
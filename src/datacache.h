@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "dataset.h"
+#include "mappedfile.h"
+
+namespace cave
+{
+    /*
+     * A dataset preprocessed once into a binary cache file and mapped
+     * back in on later runs. The file holds a versioned header followed by
+     * page-aligned sections: every batch's inputs, already scaled and in
+     * the column layout a batch Matrix uses, then one byte label per item.
+     * Opening a cache validates only the header, so startup costs the same
+     * whatever the size of the set; batches are read from the page cache
+     * as they are touched. verify() checks the data against the checksum
+     * written with it.
+     *
+     * The header also records a fingerprint of the files the set was read
+     * from: their sizes, modification times and leading bytes, which hold an
+     * IDX file's magic and dimensions. Opening a cache with its source files
+     * refuses it once any of them has changed.
+     *
+     * Items stay in their batches; shuffling reorders whole batches.
+     */
+    class CachedDataset : public Dataset
+    {
+    private:
+        struct Header
+        {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t batchSize;
+            std::uint32_t batches;
+            std::uint32_t inputSize;
+            std::uint32_t classes;
+            std::uint32_t items;
+            std::uint64_t inputOffset;
+            std::uint64_t labelOffset;
+            std::uint64_t fileSize;
+            std::uint64_t checksum;
+            std::uint64_t sourceFingerprint;
+            std::uint64_t headerChecksum;
+        };
+
+        static const std::uint32_t version_ = 2;
+
+        MappedFile mapping_;
+        Header header_;
+
+        bool shuffle_{false};
+        std::uint64_t seed_{0};
+        std::vector<int> order_;
+
+    private:
+        static std::uint64_t checksum(const std::uint8_t *data, std::size_t bytes, std::uint64_t hash = 0);
+        static std::uint64_t fingerprint(const std::vector<std::string> &sources);
+        int mapped(int batch) const { return order_.empty() ? batch : order_[batch]; }
+
+    public:
+        explicit CachedDataset(std::string file, const std::vector<std::string> &sources = {});
+
+        static void write(Dataset &source, std::string file, const std::vector<std::string> &sources = {});
+
+        bool verify() const;
+        void setShuffle(bool shuffle, std::uint64_t seed = Philox::randomSeed());
+
+        int batches() { return header_.batches; }
+        int inputSize() { return header_.inputSize; }
+        int items(int batch);
+
+        Matrix &input(int batch, Matrix &buffer);
+        Matrix &expected(int batch, Matrix &buffer);
+
+        void beginEpoch(int epoch);
+    };
+}
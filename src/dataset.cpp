@@ -0,0 +1,160 @@
+#include "dataset.h"
+
+#include <algorithm>
+#include <sstream>
+#include <numeric>
+
+#include "idxfile.h"
+#include "fileutil.h"
+
+namespace cave
+{
+    ByteDataset::ByteDataset(int inputSize, int classes, int batchSize, double scale)
+        : inputSize_(inputSize), classes_(classes), batchSize_(batchSize), scale_(scale)
+    {
+        if (inputSize < 1 || classes < 1 || batchSize < 1)
+        {
+            throw std::invalid_argument("Dataset sizes must be positive.");
+        }
+    }
+
+    /*
+     * Copies the bytes of an IDX image file and its label file; the files
+     * are not needed afterwards.
+     */
+    ByteDataset::ByteDataset(int batchSize, std::string imageFile, std::string labelFile, int classes)
+        : classes_(classes), batchSize_(batchSize)
+    {
+        IdxFile images(imageFile);
+        IdxFile labels(labelFile);
+
+        if (images.type() != IdxFile::UNSIGNED_BYTE || labels.type() != IdxFile::UNSIGNED_BYTE)
+        {
+            throw FileException("Byte datasets need unsigned byte IDX files: " + imageFile + ", " + labelFile);
+        }
+
+        if (images.items() != labels.items() || labels.itemSize() != 1)
+        {
+            std::stringstream ss;
+            ss << imageFile << " holds " << images.items() << " items but " << labelFile << " holds " << labels.items() << " labels.";
+            throw FileException(ss.str());
+        }
+
+        inputSize_ = images.itemSize();
+
+        // Copied a slice at a time, so compressed files are copied while
+        // they are still being inflated.
+        const int slice = 4096;
+
+        inputs_.reserve(std::size_t(images.items()) * inputSize_);
+
+        for (int first = 0; first < images.items(); first += slice)
+        {
+            int count = std::min(slice, images.items() - first);
+            const std::uint8_t *items = images.range(first, count);
+
+            inputs_.insert(inputs_.end(), items, items + std::size_t(count) * inputSize_);
+        }
+
+        const std::uint8_t *allLabels = labels.range(0, labels.items());
+        labels_.assign(allLabels, allLabels + labels.items());
+
+        for (std::uint8_t label : labels_)
+        {
+            if (label >= classes_)
+            {
+                throw FileException("Label out of range in " + labelFile);
+            }
+        }
+    }
+
+    void ByteDataset::add(const std::uint8_t *input, std::uint8_t label)
+    {
+        if (label >= classes_)
+        {
+            throw std::invalid_argument("Label out of range.");
+        }
+
+        inputs_.insert(inputs_.end(), input, input + inputSize_);
+        labels_.push_back(label);
+        order_.clear();
+    }
+
+    void ByteDataset::setShuffle(bool shuffle, std::uint64_t seed)
+    {
+        shuffle_ = shuffle;
+        seed_ = seed;
+        order_.clear();
+    }
+
+    void ByteDataset::beginEpoch(int epoch)
+    {
+        if (!shuffle_)
+        {
+            return;
+        }
+
+        order_.resize(size());
+        std::iota(order_.begin(), order_.end(), 0);
+
+        Philox(seed_).shuffle(order_.data(), order_.size(), Philox::stream(epoch));
+    }
+
+    int ByteDataset::batches()
+    {
+        return (size() + batchSize_ - 1) / batchSize_;
+    }
+
+    int ByteDataset::items(int batch)
+    {
+        return std::min(batchSize_, size() - batch * batchSize_);
+    }
+
+    Matrix &ByteDataset::input(int batch, Matrix &buffer)
+    {
+        int count = items(batch);
+
+        if (buffer.rows() != inputSize_ || buffer.cols() != count)
+        {
+            buffer = Matrix(inputSize_, count);
+        }
+
+        std::size_t first = std::size_t(batch) * batchSize_;
+
+        if (order_.empty())
+        {
+            decodeColumns(inputs_.data() + first * inputSize_, count, inputSize_, scale_, buffer.data());
+        }
+        else
+        {
+            gatherColumns(inputs_.data(), order_.data() + first, count, inputSize_, scale_, buffer.data());
+        }
+
+        return buffer;
+    }
+
+    Matrix &ByteDataset::expected(int batch, Matrix &buffer)
+    {
+        int count = items(batch);
+
+        if (buffer.rows() != classes_ || buffer.cols() != count)
+        {
+            buffer = Matrix(classes_, count);
+        }
+        else
+        {
+            std::fill(buffer.data(), buffer.data() + classes_ * count, 0.0);
+        }
+
+        std::size_t first = std::size_t(batch) * batchSize_;
+
+        for (int item = 0; item < count; ++item)
+        {
+            int index = order_.empty() ? first + item : order_[first + item];
+
+            buffer.set(labels_[index], item, 1.0);
+        }
+
+        return buffer;
+    }
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "matrix.h"
+#include "topology.h"
+#include "random.h"
+
+namespace cave
+{
+    /*
+     * Training or evaluation data as a sequence of batches, one item per
+     * column. input() and expected() either return a batch the dataset
+     * already holds or build it in the buffer they are given and return
+     * that buffer; callers keep one buffer per thread and reuse it, so
+     * datasets that store items compactly never hold more than a batch per
+     * thread in doubles. Both must be safe to call from several threads.
+     */
+    class Dataset
+    {
+    public:
+        virtual ~Dataset() {}
+
+        virtual int batches() = 0;
+        virtual int inputSize() = 0;
+        virtual int items(int batch) = 0;
+
+        virtual Matrix &input(int batch, Matrix &buffer) = 0;
+        virtual Matrix &expected(int batch, Matrix &buffer) = 0;
+
+        virtual void firstTouch(const Topology &) {}
+
+        /*
+         * Called before each training epoch, so a dataset can change the
+         * batches it gives from one epoch to the next.
+         */
+        virtual void beginEpoch(int /* epoch */) {}
+    };
+
+    /*
+     * Batches already held as matrices, such as a Loader produces. The
+     * vectors are referenced, not copied.
+     */
+    class MatrixDataset : public Dataset
+    {
+    private:
+        std::vector<Matrix> &inputs_;
+        std::vector<Matrix> &expecteds_;
+
+    public:
+        MatrixDataset(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds) : inputs_(inputs), expecteds_(expecteds)
+        {
+        }
+
+        int batches() { return inputs_.size(); }
+        int inputSize() { return inputs_.empty() ? 0 : inputs_[0].rows(); }
+        int items(int batch) { return inputs_[batch].cols(); }
+
+        Matrix &input(int batch, Matrix &) { return inputs_[batch]; }
+        Matrix &expected(int batch, Matrix &) { return expecteds_[batch]; }
+
+        void firstTouch(const Topology &topology)
+        {
+            topology.firstTouch(inputs_);
+            topology.firstTouch(expecteds_);
+        }
+    };
+
+    /*
+     * Every stride'th batch of another dataset, starting from first: one
+     * worker's share of a set that several processes train on. Batches are
+     * read through the source, so a compact dataset stays compact.
+     */
+    class ShardDataset : public Dataset
+    {
+    private:
+        Dataset &source_;
+        int first_{0};
+        int stride_{1};
+
+    public:
+        ShardDataset(Dataset &source, int first, int stride) : source_(source), first_(first), stride_(stride)
+        {
+        }
+
+        int batches() { return first_ < source_.batches() ? (source_.batches() - first_ + stride_ - 1) / stride_ : 0; }
+        int inputSize() { return source_.inputSize(); }
+        int items(int batch) { return source_.items(first_ + batch * stride_); }
+
+        Matrix &input(int batch, Matrix &buffer) { return source_.input(first_ + batch * stride_, buffer); }
+        Matrix &expected(int batch, Matrix &buffer) { return source_.expected(first_ + batch * stride_, buffer); }
+
+        void beginEpoch(int epoch) { source_.beginEpoch(epoch); }
+    };
+
+    /*
+     * Items kept as bytes with one byte class label each, as in MNIST: an
+     * eighth of the memory of holding them as doubles. Batches are decoded
+     * and scaled only when asked for. With shuffling on, every epoch draws
+     * its batches from a new seeded permutation of the items.
+     */
+    class ByteDataset : public Dataset
+    {
+    private:
+        std::vector<std::uint8_t> inputs_;
+        std::vector<std::uint8_t> labels_;
+
+        int inputSize_{0};
+        int classes_{10};
+        int batchSize_{32};
+        double scale_{1.0 / 256.0};
+
+        bool shuffle_{false};
+        std::uint64_t seed_{0};
+        std::vector<int> order_;
+
+    public:
+        ByteDataset(int inputSize, int classes, int batchSize, double scale = 1.0 / 256.0);
+        ByteDataset(int batchSize, std::string imageFile, std::string labelFile, int classes = 10);
+
+        void add(const std::uint8_t *input, std::uint8_t label);
+        void setShuffle(bool shuffle, std::uint64_t seed = Philox::randomSeed());
+
+        int size() const { return labels_.size(); }
+        int classes() const { return classes_; }
+
+        int batches();
+        int inputSize() { return inputSize_; }
+        int items(int batch);
+
+        Matrix &input(int batch, Matrix &buffer);
+        Matrix &expected(int batch, Matrix &buffer);
+
+        void beginEpoch(int epoch);
+    };
+}
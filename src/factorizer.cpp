@@ -0,0 +1,237 @@
+#include "factorizer.h"
+
+#include <cmath>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+
+#include "matrixfunctions.h"
+
+namespace cave
+{
+    Factorizer::Factorizer(NeuralNet &neuralNet) : neuralNet_(neuralNet)
+    {
+    }
+
+    int Factorizer::weightIndex(int layer)
+    {
+        auto &transforms = neuralNet_.transforms_;
+
+        if (layer < 0 || layer >= int(transforms.size()) || transforms[layer] != NeuralNet::DENSE)
+        {
+            std::stringstream ss;
+            ss << "Layer " << layer << " is not a DENSE layer.";
+            throw std::invalid_argument(ss.str());
+        }
+
+        auto &indices = neuralNet_.weightIndices_;
+
+        return std::find(indices.begin(), indices.end(), layer) - indices.begin();
+    }
+
+    /*
+     * All singular values of the layer's weights, largest first.
+     */
+    Matrix Factorizer::singularValues(int layer)
+    {
+        Matrix &weight = neuralNet_.weights_[weightIndex(layer)];
+
+        return svd(weight, std::min(weight.rows(), weight.cols()), Philox::stream(neuralNet_.seed_, layer)).s;
+    }
+
+    /*
+     * The smallest rank whose approximation keeps at least energy of the
+     * squared Frobenius norm of the layer's weights.
+     */
+    int Factorizer::rankForEnergy(int layer, double energy)
+    {
+        Matrix values = singularValues(layer);
+
+        double total = 0;
+
+        for (int i = 0; i < values.rows(); ++i)
+        {
+            total += values[i] * values[i];
+        }
+
+        double kept = 0;
+
+        for (int i = 0; i < values.rows(); ++i)
+        {
+            kept += values[i] * values[i];
+
+            if (kept >= energy * total)
+            {
+                return i + 1;
+            }
+        }
+
+        return values.rows();
+    }
+
+    /*
+     * Replaces layer with two DENSE layers. The singular values are split
+     * evenly between them so both have weights of similar magnitude if the
+     * network is trained further; the original bias stays on the second.
+     */
+    void Factorizer::factorize(int layer, int rank)
+    {
+        int index = weightIndex(layer);
+        Matrix &weight = neuralNet_.weights_[index];
+
+        if (rank < 1 || rank > std::min(weight.rows(), weight.cols()))
+        {
+            std::stringstream ss;
+            ss << "Rank " << rank << " is out of range for a " << weight.rows() << " x " << weight.cols() << " layer.";
+            throw std::invalid_argument(ss.str());
+        }
+
+        SVD decomposition = svd(weight, rank, Philox::stream(neuralNet_.seed_, layer));
+
+        Matrix first(rank, weight.cols());
+        Matrix second(weight.rows(), rank);
+
+        for (int r = 0; r < rank; ++r)
+        {
+            double scale = std::sqrt(decomposition.s[r]);
+
+            for (int col = 0; col < weight.cols(); ++col)
+            {
+                first.set(r, col, scale * decomposition.v.get(col, r));
+            }
+
+            for (int row = 0; row < weight.rows(); ++row)
+            {
+                second.set(row, r, scale * decomposition.u.get(row, r));
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(neuralNet_.mtxWeights_);
+
+        neuralNet_.weights_[index] = second;
+        neuralNet_.weights_.insert(neuralNet_.weights_.begin() + index, first);
+        neuralNet_.biases_.insert(neuralNet_.biases_.begin() + index, Matrix(rank, 1));
+        neuralNet_.runningMeans_.insert(neuralNet_.runningMeans_.begin() + index, Matrix());
+        neuralNet_.runningVariances_.insert(neuralNet_.runningVariances_.begin() + index, Matrix());
+
+        auto &indices = neuralNet_.weightIndices_;
+        indices.insert(indices.begin() + index, layer);
+
+        for (std::size_t j = index + 1; j < indices.size(); ++j)
+        {
+            ++indices[j];
+        }
+
+        // The new layer joins the pipeline stage of the layer it was split from.
+        int stageEnd = 0;
+
+        for (int &stageLayers : neuralNet_.pipelineLayers_)
+        {
+            stageEnd += stageLayers;
+
+            if (layer < stageEnd)
+            {
+                ++stageLayers;
+                break;
+            }
+        }
+
+        neuralNet_.transforms_.insert(neuralNet_.transforms_.begin() + layer, NeuralNet::DENSE);
+        neuralNet_.configs_.insert(neuralNet_.configs_.begin() + layer, NeuralNet::LayerConfig());
+        neuralNet_.invalidate();
+    }
+
+    /*
+     * Factorizes a copy of the network at each rank and measures it on the
+     * evaluation data; the network itself is left unchanged. The first step
+     * is the unfactorized network.
+     */
+    std::vector<Factorizer::Step> Factorizer::compare(int layer, std::vector<int> ranks, Dataset &evalData)
+    {
+        Matrix values = singularValues(layer);
+
+        double total = 0;
+
+        for (int i = 0; i < values.rows(); ++i)
+        {
+            total += values[i] * values[i];
+        }
+
+        std::vector<Step> steps;
+
+        Step original;
+        original.parameters = neuralNet_.parameterCount();
+        original.flops = neuralNet_.flops();
+        original.accuracy = neuralNet_.evaluate(evalData);
+        steps.push_back(original);
+
+        std::sort(ranks.rbegin(), ranks.rend());
+
+        for (int rank : ranks)
+        {
+            std::unique_ptr<NeuralNet> copy = neuralNet_.snapshot();
+            Factorizer(*copy).factorize(layer, rank);
+
+            double kept = 0;
+
+            for (int i = 0; i < rank; ++i)
+            {
+                kept += values[i] * values[i];
+            }
+
+            Step step;
+            step.rank = rank;
+            step.energy = total > 0 ? kept / total : 1;
+            step.parameters = copy->parameterCount();
+            step.flops = copy->flops();
+            step.accuracy = copy->evaluate(evalData);
+            steps.push_back(step);
+        }
+
+        return steps;
+    }
+
+    std::ostream &operator<<(std::ostream &out, const std::vector<Factorizer::Step> &steps)
+    {
+        if (steps.empty())
+        {
+            return out;
+        }
+
+        const Factorizer::Step &full = steps.front();
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+
+        out << std::setw(6) << "Rank" << std::setw(10) << "Energy" << std::setw(12) << "Parameters"
+            << std::setw(14) << "FLOPs/item" << std::setw(10) << "FLOPs" << std::setw(10) << "Accuracy"
+            << std::setw(10) << "Change" << std::endl;
+
+        out << std::fixed;
+
+        for (const Factorizer::Step &step : steps)
+        {
+            if (step.rank == 0)
+            {
+                out << std::setw(6) << "full";
+            }
+            else
+            {
+                out << std::setw(6) << step.rank;
+            }
+
+            out << std::setprecision(2) << std::setw(9) << 100.0 * step.energy << "%"
+                << std::setw(12) << step.parameters
+                << std::setprecision(0) << std::setw(14) << step.flops
+                << std::setprecision(2) << std::setw(9) << 100.0 * step.flops / full.flops << "%"
+                << std::setw(9) << 100.0 * step.accuracy << "%"
+                << std::showpos << std::setw(9) << 100.0 * (step.accuracy - full.accuracy) << "%"
+                << std::noshowpos << std::endl;
+        }
+
+        out.flags(flags);
+        out.precision(precision);
+
+        return out;
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+#include <iostream>
+
+#include "neuralnet.h"
+
+namespace cave
+{
+    /*
+     * Low-rank factorization of DENSE layers for inference. A layer's m x n
+     * weight W is replaced by two DENSE layers, rank x n followed by
+     * m x rank, whose product is the best rank-limited approximation of W.
+     * That costs rank * (m + n) multiply-adds per item instead of m * n,
+     * which pays off whenever rank is well below m * n / (m + n).
+     */
+    class Factorizer
+    {
+    public:
+        /*
+         * One factorization of a layer and what it does to the network.
+         * Rank 0 stands for the layer left as it is.
+         */
+        struct Step
+        {
+            int rank{0};
+            double energy{1};
+            int parameters{0};
+            double flops{0};
+            double accuracy{0};
+        };
+
+    private:
+        NeuralNet &neuralNet_;
+
+    private:
+        int weightIndex(int layer);
+
+    public:
+        Factorizer(NeuralNet &neuralNet);
+
+        Matrix singularValues(int layer);
+        int rankForEnergy(int layer, double energy);
+        void factorize(int layer, int rank);
+        std::vector<Step> compare(int layer, std::vector<int> ranks, Dataset &evalData);
+    };
+
+    std::ostream &operator<<(std::ostream &out, const std::vector<Factorizer::Step> &steps);
+}
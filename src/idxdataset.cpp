@@ -0,0 +1,217 @@
+#include "idxdataset.h"
+
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
+#include "fileutil.h"
+
+namespace cave
+{
+    /*
+     * With classes 0, the number of classes is one more than the largest
+     * label. Windows are rounded up to whole batches so no batch spans two.
+     */
+    IdxDataset::IdxDataset(int batchSize, std::string imageFile, std::string labelFile, int classes, int windowItems)
+        : images_(imageFile), labels_(labelFile), batchSize_(batchSize), classes_(classes)
+    {
+        if (batchSize < 1 || windowItems < 1 || classes < 0)
+        {
+            throw std::invalid_argument("Dataset sizes must be positive.");
+        }
+
+        if (images_.items() != labels_.items() || labels_.itemSize() != 1)
+        {
+            throw FileException(imageFile + " and " + labelFile + " do not hold one label per item.");
+        }
+
+        windowItems_ = (windowItems + batchSize - 1) / batchSize * batchSize;
+
+        if (classes_ == 0)
+        {
+            const int chunk = 65536;
+            std::vector<double> values(chunk);
+
+            for (int first = 0; first < labels_.items(); first += chunk)
+            {
+                int count = std::min(chunk, labels_.items() - first);
+                labels_.decode(first, count, 1, values.data());
+
+                classes_ = std::max(classes_, int(*std::max_element(values.begin(), values.begin() + count)) + 1);
+            }
+        }
+
+        images_.willNeed(0, windowSize(0));
+    }
+
+    void IdxDataset::setShuffle(bool shuffle, std::uint64_t seed)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+
+        shuffle_ = shuffle;
+        seed_ = seed;
+        windowOrder_.clear();
+        itemOrders_.clear();
+    }
+
+    void IdxDataset::beginEpoch(int epoch)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+
+        epoch_ = epoch;
+        itemOrders_.clear();
+        currentSlot_ = -1;
+
+        if (shuffle_)
+        {
+            windowOrder_.resize(size() / windowItems_);
+            std::iota(windowOrder_.begin(), windowOrder_.end(), 0);
+
+            Philox(seed_).shuffle(windowOrder_.data(), windowOrder_.size(), Philox::stream(epoch));
+        }
+
+        images_.willNeed(window(0) * windowItems_, windowSize(0));
+    }
+
+    /*
+     * The window read in the given position of the epoch.
+     */
+    int IdxDataset::window(int slot) const
+    {
+        return slot < int(windowOrder_.size()) ? windowOrder_[slot] : slot;
+    }
+
+    int IdxDataset::windowSize(int slot) const
+    {
+        return std::max(0, std::min(windowItems_, size() - window(slot) * windowItems_));
+    }
+
+    /*
+     * The shuffled order of the items within the window in slot. Reaching
+     * a slot for the first time also reads the next window ahead and
+     * releases the one before the last, which no thread should still need.
+     */
+    std::shared_ptr<const std::vector<int>> IdxDataset::itemOrder(int slot)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+
+        // A slot well before the current one means a new pass began
+        // without a new epoch, as when evaluating again.
+        if (slot > currentSlot_ || slot + 1 < currentSlot_)
+        {
+            int windows = (size() + windowItems_ - 1) / windowItems_;
+
+            if (slot + 1 < windows)
+            {
+                images_.willNeed(window(slot + 1) * windowItems_, windowSize(slot + 1));
+            }
+
+            if (slot >= 2)
+            {
+                images_.dontNeed(window(slot - 2) * windowItems_, windowSize(slot - 2));
+            }
+
+            currentSlot_ = slot;
+        }
+
+        if (!shuffle_)
+        {
+            return nullptr;
+        }
+
+        auto found = itemOrders_.find(slot);
+
+        if (found != itemOrders_.end())
+        {
+            return found->second;
+        }
+
+        auto order = std::make_shared<std::vector<int>>(windowSize(slot));
+        std::iota(order->begin(), order->end(), 0);
+
+        Philox(seed_).shuffle(order->data(), order->size(), Philox::stream(epoch_, slot));
+
+        itemOrders_[slot] = order;
+
+        // Batches arrive roughly in order; only recent windows are kept.
+        itemOrders_.erase(itemOrders_.begin(), itemOrders_.lower_bound(slot - 1));
+
+        return order;
+    }
+
+    std::vector<int> IdxDataset::indices(int batch)
+    {
+        int first = batch * batchSize_;
+        int slot = first / windowItems_;
+        int offset = first % windowItems_;
+
+        std::shared_ptr<const std::vector<int>> order = itemOrder(slot);
+        int start = window(slot) * windowItems_;
+
+        std::vector<int> result(items(batch));
+
+        for (std::size_t i = 0; i < result.size(); ++i)
+        {
+            result[i] = start + (order ? (*order)[offset + i] : offset + i);
+        }
+
+        return result;
+    }
+
+    int IdxDataset::batches()
+    {
+        return (size() + batchSize_ - 1) / batchSize_;
+    }
+
+    int IdxDataset::items(int batch)
+    {
+        return std::min(batchSize_, size() - batch * batchSize_);
+    }
+
+    Matrix &IdxDataset::input(int batch, Matrix &buffer)
+    {
+        std::vector<int> items = indices(batch);
+        int count = items.size();
+
+        if (buffer.rows() != inputSize() || buffer.cols() != count)
+        {
+            buffer = Matrix(inputSize(), count);
+        }
+
+        images_.gather(items.data(), count, scale_, buffer.data());
+
+        return buffer;
+    }
+
+    Matrix &IdxDataset::expected(int batch, Matrix &buffer)
+    {
+        std::vector<int> items = indices(batch);
+        int count = items.size();
+
+        std::vector<double> labels(count);
+        labels_.gather(items.data(), count, 1, labels.data());
+
+        if (buffer.rows() != classes_ || buffer.cols() != count)
+        {
+            buffer = Matrix(classes_, count);
+        }
+        else
+        {
+            std::fill(buffer.data(), buffer.data() + classes_ * count, 0.0);
+        }
+
+        for (int item = 0; item < count; ++item)
+        {
+            int label = labels[item];
+
+            if (label < 0 || label >= classes_)
+            {
+                throw FileException("Label out of range in IDX dataset.");
+            }
+
+            buffer.set(label, item, 1.0);
+        }
+
+        return buffer;
+    }
+}
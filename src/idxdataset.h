@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+
+#include "dataset.h"
+#include "idxfile.h"
+
+namespace cave
+{
+    /*
+     * Reads batches straight out of a pair of IDX files of any element
+     * type, so sets far larger than memory can be trained on. The items
+     * are split into fixed-size windows that are read in turn: while one
+     * window is in use the next is read ahead, and the one before it is
+     * handed back to the kernel. With shuffling on, every epoch visits
+     * the full windows in a new order and shuffles the items within each,
+     * a shuffle buffer the size of a window, so the file is still read a
+     * window at a time. The last, partial window is always read last.
+     */
+    class IdxDataset : public Dataset
+    {
+    private:
+        IdxFile images_;
+        IdxFile labels_;
+
+        int batchSize_;
+        int classes_;
+        int windowItems_;
+        double scale_{1.0 / 256.0};
+
+        bool shuffle_{false};
+        std::uint64_t seed_{0};
+        int epoch_{0};
+        std::vector<int> windowOrder_;
+
+        std::mutex mtx_;
+        std::map<int, std::shared_ptr<const std::vector<int>>> itemOrders_;
+        int currentSlot_{-1};
+
+    private:
+        int window(int slot) const;
+        int windowSize(int slot) const;
+        std::shared_ptr<const std::vector<int>> itemOrder(int slot);
+        std::vector<int> indices(int batch);
+
+    public:
+        IdxDataset(int batchSize, std::string imageFile, std::string labelFile, int classes = 0, int windowItems = 65536);
+
+        void setScale(double scale) { scale_ = scale; }
+        void setShuffle(bool shuffle, std::uint64_t seed = Philox::randomSeed());
+
+        int size() const { return images_.items(); }
+        int classes() const { return classes_; }
+
+        int batches();
+        int inputSize() { return images_.itemSize(); }
+        int items(int batch);
+
+        Matrix &input(int batch, Matrix &buffer);
+        Matrix &expected(int batch, Matrix &buffer);
+
+        void beginEpoch(int epoch);
+    };
+}
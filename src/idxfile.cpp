@@ -0,0 +1,388 @@
+#include "idxfile.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef CAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "fileutil.h"
+
+namespace cave
+{
+    namespace
+    {
+        template <typename E>
+        E readBigEndian(const std::uint8_t *bytes)
+        {
+            std::uint8_t swapped[sizeof(E)];
+            std::reverse_copy(bytes, bytes + sizeof(E), swapped);
+
+            E value;
+            std::memcpy(&value, swapped, sizeof(E));
+
+            return value;
+        }
+    }
+
+    IdxFile::IdxFile(std::string file) : file_(file)
+    {
+        const std::string suffix = ".gz";
+
+        if (file.size() > suffix.size() && file.compare(file.size() - suffix.size(), suffix.size(), suffix) == 0)
+        {
+            openCompressed();
+            return;
+        }
+
+        mapping_ = std::make_unique<MappedFile>(file);
+
+        const std::uint8_t *bytes = mapping_->data();
+        std::size_t size = mapping_->size();
+
+        if (size < 4 || size < 4 + 4 * std::size_t(bytes[3]))
+        {
+            throw FileException("Not an IDX file: " + file);
+        }
+
+        headerBytes_ = 4 + 4 * std::size_t(bytes[3]);
+        std::size_t dataBytes = parseHeader(bytes);
+
+        if (size - headerBytes_ < dataBytes)
+        {
+            throw FileException("Truncated IDX file: " + file);
+        }
+
+        data_ = bytes + headerBytes_;
+        available_ = dataBytes;
+    }
+
+    IdxFile::~IdxFile()
+    {
+        if (inflater_.joinable())
+        {
+            stopping_ = true;
+            inflater_.join();
+        }
+    }
+
+    /*
+     * Checks the magic number, reads the element type and dimensions, and
+     * returns the number of data bytes they describe.
+     */
+    std::size_t IdxFile::parseHeader(const std::uint8_t *bytes)
+    {
+        int rank = bytes[3];
+
+        if (bytes[0] != 0 || bytes[1] != 0 || rank == 0)
+        {
+            throw FileException("Not an IDX file: " + file_);
+        }
+
+        switch (bytes[2])
+        {
+        case UNSIGNED_BYTE:
+        case SIGNED_BYTE:
+            elementSize_ = 1;
+            break;
+        case SHORT:
+            elementSize_ = 2;
+            break;
+        case INT:
+        case FLOAT:
+            elementSize_ = 4;
+            break;
+        case DOUBLE:
+            elementSize_ = 8;
+            break;
+        default:
+            throw FileException("Unknown IDX element type in " + file_);
+        }
+
+        type_ = Type(bytes[2]);
+
+        std::size_t dataBytes = elementSize_;
+
+        for (int i = 0; i < rank; ++i)
+        {
+            std::uint32_t extent = readBigEndian<std::uint32_t>(bytes + 4 + 4 * i);
+            dims_.push_back(extent);
+            dataBytes *= extent;
+
+            if (i > 0)
+            {
+                itemSize_ *= extent;
+            }
+        }
+
+        return dataBytes;
+    }
+
+#ifdef CAVE_ZLIB
+    /*
+     * Reads the header synchronously, then leaves a thread inflating the
+     * data straight into its final place a chunk at a time.
+     */
+    void IdxFile::openCompressed()
+    {
+        gzFile input = gzopen(file_.c_str(), "rb");
+
+        if (input == nullptr)
+        {
+            throw FileException("Unable to open " + file_);
+        }
+
+        gzbuffer(input, 1 << 17);
+
+        std::uint8_t header[4 + 4 * 255];
+
+        if (gzread(input, header, 4) != 4 || gzread(input, header + 4, 4 * header[3]) != 4 * header[3])
+        {
+            gzclose(input);
+            throw FileException("Not an IDX file: " + file_);
+        }
+
+        std::size_t dataBytes;
+
+        try
+        {
+            dataBytes = parseHeader(header);
+        }
+        catch (const FileException &)
+        {
+            gzclose(input);
+            throw;
+        }
+
+        inflated_.resize(dataBytes);
+        data_ = inflated_.data();
+
+        inflater_ = std::thread([this, input, dataBytes]()
+        {
+            const std::size_t chunk = 1 << 20;
+
+            std::size_t done = 0;
+            bool failed = false;
+
+            while (done < dataBytes && !stopping_)
+            {
+                unsigned request = std::min(chunk, dataBytes - done);
+                int read = gzread(input, inflated_.data() + done, request);
+
+                if (read <= 0)
+                {
+                    failed = true;
+                    break;
+                }
+
+                done += read;
+
+                std::lock_guard<std::mutex> lock(mtx_);
+                available_ = done;
+                cond_.notify_all();
+            }
+
+            gzclose(input);
+
+            std::lock_guard<std::mutex> lock(mtx_);
+            failed_ = failed;
+            cond_.notify_all();
+        });
+    }
+#else
+    void IdxFile::openCompressed()
+    {
+        throw FileException("Built without zlib, so cannot read " + file_);
+    }
+#endif
+
+    /*
+     * The first of count consecutive items, once all of them can be read.
+     */
+    const std::uint8_t *IdxFile::range(int first, int count) const
+    {
+        std::size_t needed = std::size_t(first + count) * itemBytes();
+
+        std::unique_lock<std::mutex> lock(mtx_);
+
+        cond_.wait(lock, [&]()
+                   { return available_ >= needed || failed_; });
+
+        if (available_ < needed)
+        {
+            throw FileException("Truncated IDX file: " + file_);
+        }
+
+        return data_ + std::size_t(first) * itemBytes();
+    }
+
+    namespace
+    {
+        /*
+         * Converts count items of itemSize bytes, the ith found at itemAt(i),
+         * into an itemSize x count batch, one item per column, multiplying
+         * by scale. Works in tiles so the source and the transposed target
+         * both stay in cache: each tile's bytes are first widened to doubles
+         * along contiguous rows, a loop the compiler vectorizes, and then
+         * written out transposed. While a tile is widened, the same rows of
+         * the next tile's items are prefetched, since items gathered in a
+         * shuffled order are scattered across the file.
+         */
+        template <typename ItemAt>
+        void decodeTiles(ItemAt itemAt, int count, int itemSize, double scale, double *out)
+        {
+            const int tileItems = 16;
+            const int tileRows = 64;
+
+            double tile[tileItems][tileRows];
+
+            for (int firstItem = 0; firstItem < count; firstItem += tileItems)
+            {
+                int tileCount = std::min(tileItems, count - firstItem);
+                int nextCount = std::min(tileItems, count - firstItem - tileCount);
+
+                for (int firstRow = 0; firstRow < itemSize; firstRow += tileRows)
+                {
+                    int rows = std::min(tileRows, itemSize - firstRow);
+
+                    for (int item = 0; item < nextCount; ++item)
+                    {
+                        __builtin_prefetch(itemAt(firstItem + tileCount + item) + firstRow);
+                    }
+
+                    for (int item = 0; item < tileCount; ++item)
+                    {
+                        const std::uint8_t *source = itemAt(firstItem + item) + firstRow;
+                        double *target = tile[item];
+
+                        for (int row = 0; row < rows; ++row)
+                        {
+                            target[row] = source[row] * scale;
+                        }
+                    }
+
+                    for (int row = 0; row < rows; ++row)
+                    {
+                        double *target = out + std::size_t(firstRow + row) * count + firstItem;
+
+                        for (int item = 0; item < tileCount; ++item)
+                        {
+                            target[item] = tile[item][row];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * Decodes count consecutive items into a batch.
+     */
+    void decodeColumns(const std::uint8_t *items, int count, int itemSize, double scale, double *out)
+    {
+        decodeTiles([=](int item)
+                    { return items + std::size_t(item) * itemSize; },
+                    count, itemSize, scale, out);
+    }
+
+    /*
+     * Decodes the items at indices into a batch, in the order given.
+     */
+    void gatherColumns(const std::uint8_t *items, const int *indices, int count, int itemSize, double scale, double *out)
+    {
+        decodeTiles([=](int item)
+                    { return items + std::size_t(indices[item]) * itemSize; },
+                    count, itemSize, scale, out);
+    }
+
+    namespace
+    {
+        template <typename E, typename ItemAt>
+        void decodeElements(ItemAt itemAt, int count, int itemSize, double scale, double *out)
+        {
+            for (int item = 0; item < count; ++item)
+            {
+                const std::uint8_t *source = itemAt(item);
+
+                for (int row = 0; row < itemSize; ++row)
+                {
+                    out[std::size_t(row) * count + item] = readBigEndian<E>(source + row * sizeof(E)) * scale;
+                }
+            }
+        }
+
+        template <typename ItemAt>
+        void decodeItems(IdxFile::Type type, ItemAt itemAt, int count, int itemSize, double scale, double *out)
+        {
+            switch (type)
+            {
+            case IdxFile::UNSIGNED_BYTE:
+                decodeTiles(itemAt, count, itemSize, scale, out);
+                break;
+            case IdxFile::SIGNED_BYTE:
+                decodeElements<std::int8_t>(itemAt, count, itemSize, scale, out);
+                break;
+            case IdxFile::SHORT:
+                decodeElements<std::int16_t>(itemAt, count, itemSize, scale, out);
+                break;
+            case IdxFile::INT:
+                decodeElements<std::int32_t>(itemAt, count, itemSize, scale, out);
+                break;
+            case IdxFile::FLOAT:
+                decodeElements<float>(itemAt, count, itemSize, scale, out);
+                break;
+            case IdxFile::DOUBLE:
+                decodeElements<double>(itemAt, count, itemSize, scale, out);
+                break;
+            }
+        }
+    }
+
+    /*
+     * Converts count consecutive items into an itemSize x count batch,
+     * one item per column, multiplying by scale.
+     */
+    void IdxFile::decode(int first, int count, double scale, double *out) const
+    {
+        const std::uint8_t *items = range(first, count);
+        std::size_t bytes = itemBytes();
+
+        decodeItems(type_, [=](int item)
+                    { return items + item * bytes; },
+                    count, itemSize_, scale, out);
+    }
+
+    /*
+     * Converts the items at indices into a batch, in the order given.
+     */
+    void IdxFile::gather(const int *indices, int count, double scale, double *out) const
+    {
+        const std::uint8_t *items = range(0, this->items());
+        std::size_t bytes = itemBytes();
+
+        decodeItems(type_, [=](int item)
+                    { return items + indices[item] * bytes; },
+                    count, itemSize_, scale, out);
+    }
+
+    /*
+     * Read-ahead and release of items for readers working through a file
+     * too large to keep in memory. Inflated files are already in memory.
+     */
+    void IdxFile::willNeed(int first, int count) const
+    {
+        if (mapping_)
+        {
+            mapping_->willNeed(headerBytes_ + std::size_t(first) * itemBytes(), std::size_t(count) * itemBytes());
+        }
+    }
+
+    void IdxFile::dontNeed(int first, int count) const
+    {
+        if (mapping_)
+        {
+            mapping_->dontNeed(headerBytes_ + std::size_t(first) * itemBytes(), std::size_t(count) * itemBytes());
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "mappedfile.h"
+
+namespace cave
+{
+    /*
+     * A read-only IDX file, the format MNIST is distributed in: a
+     * big-endian header giving the element type and dimensions, followed
+     * by the data. The first dimension counts items; the rest give each
+     * item's shape. Any element type and rank the format allows can be
+     * read; decode() and gather() convert items to doubles in batch
+     * layout whatever their type.
+     *
+     * Plain files are memory-mapped and their header validated against
+     * the file size once on opening; items are then read straight from
+     * the mapping. Files ending in .gz are inflated with zlib, when built
+     * with it, on a background thread that streams the compressed file
+     * into memory; range() waits only until the items asked for have
+     * arrived, so callers can start on the first items while the rest
+     * are still being decompressed.
+     */
+    class IdxFile
+    {
+    public:
+        enum Type
+        {
+            UNSIGNED_BYTE = 0x08,
+            SIGNED_BYTE = 0x09,
+            SHORT = 0x0B,
+            INT = 0x0C,
+            FLOAT = 0x0D,
+            DOUBLE = 0x0E
+        };
+
+    private:
+        std::string file_;
+        std::unique_ptr<MappedFile> mapping_;
+        const std::uint8_t *data_{nullptr};
+        std::size_t headerBytes_{0};
+
+        Type type_{UNSIGNED_BYTE};
+        int elementSize_{1};
+        std::vector<int> dims_;
+        int itemSize_{1};
+
+        std::vector<std::uint8_t> inflated_;
+        std::thread inflater_;
+        std::atomic<bool> stopping_{false};
+
+        mutable std::mutex mtx_;
+        mutable std::condition_variable cond_;
+        std::size_t available_{0};
+        bool failed_{false};
+
+    private:
+        std::size_t parseHeader(const std::uint8_t *bytes);
+        void openCompressed();
+
+    public:
+        explicit IdxFile(std::string file);
+        ~IdxFile();
+
+        IdxFile(const IdxFile &) = delete;
+        IdxFile &operator=(const IdxFile &) = delete;
+
+        int items() const { return dims_[0]; }
+        int itemSize() const { return itemSize_; }
+        int itemBytes() const { return itemSize_ * elementSize_; }
+        Type type() const { return type_; }
+        const std::vector<int> &dims() const { return dims_; }
+
+        const std::uint8_t *range(int first, int count) const;
+        const std::uint8_t *item(int index) const { return range(index, 1); }
+
+        void decode(int first, int count, double scale, double *out) const;
+        void gather(const int *indices, int count, double scale, double *out) const;
+
+        void willNeed(int first, int count) const;
+        void dontNeed(int first, int count) const;
+    };
+
+    void decodeColumns(const std::uint8_t *items, int count, int itemSize, double scale, double *out);
+    void gatherColumns(const std::uint8_t *items, const int *indices, int count, int itemSize, double scale, double *out);
+}
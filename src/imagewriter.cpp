@@ -4,6 +4,7 @@
 #include <iostream>
 #include <sstream>
 #include <cmath>
+#include <memory>
 #include <assert.h>
 #include "bitmapfileheader.h"
 #include "bitmapinfoheader.h"
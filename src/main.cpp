@@ -4,6 +4,9 @@
 #include <thread>
 #include <future>
 #include <chrono>
+#include <iomanip>
+#include <memory>
+#include <fstream>
 #include "matrix.h"
 #include "matrixfunctions.h"
 #include "neuralnet.h"
@@ -11,13 +14,22 @@
 #include "threadpool.h"
 #include "neuralnettest.h"
 #include "mnistloader.h"
+#include "dataset.h"
+#include "prefetcher.h"
+#include "augmenter.h"
+#include "datacache.h"
+#include "idxdataset.h"
 #include "profiler.h"
+#include "fileutil.h"
 
 using namespace std;
 using namespace cave;
 
 #include "testloader.h"
 #include "imagewriter.h"
+#include "pruner.h"
+#include "factorizer.h"
+#include "multiprocesstrainer.h"
 
 mutex g_mtx;
 int threadCount = 0;
@@ -30,6 +42,17 @@ int work(int id)
     return id;
 }
 
+/*
+ * The IDX file called name in dir, or its gzip-compressed copy if only
+ * that exists.
+ */
+std::string dataFile(std::string dir, std::string name)
+{
+    std::string file = dir + "/" + name;
+
+    return std::ifstream(file) ? file : file + ".gz";
+}
+
 int main(int argc, char *argv[])
 {
     if (argc == 0)
@@ -65,9 +88,6 @@ int main(int argc, char *argv[])
     int outputSize = 10;
     int batchSize = 32;
 
-    MNISTLoader trainingLoader(batchSize, inputDir, "train-images-idx3-ubyte", "train-labels-idx1-ubyte");
-    MNISTLoader evalLoader(batchSize, inputDir, "t10k-images-idx3-ubyte", "t10k-labels-idx1-ubyte");
-
     /*
     ImageWriter imageWriter("../data");
     imageWriter.write("../images");
@@ -80,13 +100,69 @@ int main(int argc, char *argv[])
     return 0;
     */
 
+    // Kept as bytes and decoded a batch at a time while training.
+    std::unique_ptr<Dataset> trainingData;
+    std::unique_ptr<Dataset> evalData;
+
+    try
+    {
+        auto training = std::make_unique<ByteDataset>(batchSize, dataFile(inputDir, "train-images-idx3-ubyte"), dataFile(inputDir, "train-labels-idx1-ubyte"));
+        training->setShuffle(true);
+        trainingData = std::move(training);
+    }
+    catch (const FileException &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 0;
+    }
+
+    // The evaluation set is never shuffled, so it is converted once into
+    // ready-made batches and mapped straight in on later runs, until the
+    // files it came from change.
+    std::string evalCache = inputDir + "/t10k-" + std::to_string(batchSize) + ".cache";
+    std::vector<std::string> evalSources = {dataFile(inputDir, "t10k-images-idx3-ubyte"), dataFile(inputDir, "t10k-labels-idx1-ubyte")};
+
+    try
+    {
+        evalData = std::make_unique<CachedDataset>(evalCache, evalSources);
+    }
+    catch (const FileException &)
+    {
+        try
+        {
+            ByteDataset evalBytes(batchSize, evalSources[0], evalSources[1]);
+
+            try
+            {
+                CachedDataset::write(evalBytes, evalCache, evalSources);
+                evalData = std::make_unique<CachedDataset>(evalCache);
+            }
+            catch (const FileException &e)
+            {
+                std::cerr << e.what() << std::endl;
+                evalData = std::make_unique<ByteDataset>(std::move(evalBytes));
+            }
+        }
+        catch (const FileException &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 0;
+        }
+    }
+
     /*
-    TestLoader trainingLoader(60000, inputSize, outputSize, batchSize);
-    TestLoader evalLoader(10000, inputSize, outputSize, batchSize);
+    // Sets too large for memory, of any IDX element type, read a window at a time.
+    auto training = std::make_unique<IdxDataset>(batchSize, dataFile(inputDir, "train-images-idx3-ubyte"), dataFile(inputDir, "train-labels-idx1-ubyte"));
+    training->setShuffle(true);
+    trainingData = std::move(training);
     */
 
-    TrainingData trainingData = trainingLoader.load();
-    TrainingData evalData = evalLoader.load();
+    /*
+    TrainingData trainingBatches = TestLoader(60000, inputSize, outputSize, batchSize).load();
+    TrainingData evalBatches = TestLoader(10000, inputSize, outputSize, batchSize).load();
+    trainingData = std::make_unique<MatrixDataset>(trainingBatches.input, trainingBatches.expected);
+    evalData = std::make_unique<MatrixDataset>(evalBatches.input, evalBatches.expected);
+    */
 
     NeuralNet neuralNet;
 
@@ -117,14 +193,46 @@ int main(int argc, char *argv[])
     std::cout << "\n"
               << neuralNet << std::endl;
 
-    neuralNet.fit(trainingData.input, trainingData.expected);
+    // Batches are decoded on a background thread while the previous ones train.
+    Prefetcher prefetcher(*trainingData, 1, 16);
+
+    /*
+    Augmenter augmenter(*trainingData, 28, 28);
+    augmenter.setShift(2);
+    augmenter.setRotation(10);
+    augmenter.setElastic(2, 4);
+    augmenter.setNoise(0.02);
+    Prefetcher prefetcher(augmenter, 4, 16);
+    */
 
-    double accuracy = neuralNet.evaluate(evalData.input, evalData.expected);
+    neuralNet.fit(prefetcher);
+
+    /*
+    // Data-parallel over worker processes, each reading its share of the
+    // batches; fit also takes matrices held in memory such as TestLoader gives.
+    MultiProcessTrainer trainer(neuralNet, 2);
+    trainer.setSyncInterval(10);
+    trainer.fit(*trainingData);
+    */
+
+    double accuracy = neuralNet.evaluate(*evalData);
 
     cout << std::fixed << std::setprecision(2) << "\nAccuracy: " << 100.0 * accuracy << " %" << std::endl;
 
     cout << gProfiler << endl;
 
+    /*
+    Pruner pruner(neuralNet, Pruner::ACTIVATION);
+    pruner.setFineTuneEpochs(2);
+    cout << "\n" << pruner.sweep(0, {150, 100, 50, 25}, *trainingData, *evalData) << endl;
+    */
+
+    /*
+    Factorizer factorizer(neuralNet);
+    cout << "\n" << factorizer.compare(0, {100, 50, 25, 10}, *evalData) << endl;
+    factorizer.factorize(0, factorizer.rankForEnergy(0, 0.9));
+    */
+
 
     std::string defaultFile = "default.ann";
 
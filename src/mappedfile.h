@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fileutil.h"
+
+namespace cave
+{
+    /*
+     * A whole file mapped read-only into memory; pages are read from disk
+     * only when first touched. willNeed() and dontNeed() let a reader that
+     * knows its access pattern start reading a region ahead of time, or
+     * give back a region it has finished with, so files far larger than
+     * memory can be read a window at a time.
+     */
+    class MappedFile
+    {
+    private:
+        int fd_{-1};
+        void *mapping_{nullptr};
+        std::size_t size_{0};
+
+        // Advice applies to whole pages; the region is widened to them.
+        template <typename Advise>
+        void advise(std::size_t offset, std::size_t length, Advise advise) const
+        {
+            std::size_t page = sysconf(_SC_PAGESIZE);
+            std::size_t first = offset / page * page;
+            std::size_t last = std::min(size_, offset + length);
+
+            if (first < last)
+            {
+                advise(first, last - first);
+            }
+        }
+
+    public:
+        explicit MappedFile(std::string file)
+        {
+            fd_ = open(file.c_str(), O_RDONLY);
+
+            if (fd_ < 0)
+            {
+                throw FileException("Unable to open " + file + ": " + std::strerror(errno));
+            }
+
+            struct stat status;
+
+            if (fstat(fd_, &status) != 0 || status.st_size == 0)
+            {
+                close(fd_);
+                throw FileException("Empty or unreadable file: " + file);
+            }
+
+            size_ = status.st_size;
+            mapping_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+
+            if (mapping_ == MAP_FAILED)
+            {
+                close(fd_);
+                mapping_ = nullptr;
+                throw FileException("Unable to map " + file + ": " + std::strerror(errno));
+            }
+        }
+
+        ~MappedFile()
+        {
+            if (mapping_ != nullptr)
+            {
+                munmap(mapping_, size_);
+                close(fd_);
+            }
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        const std::uint8_t *data() const { return static_cast<const std::uint8_t *>(mapping_); }
+        std::size_t size() const { return size_; }
+
+        void willNeed(std::size_t offset, std::size_t length) const
+        {
+            advise(offset, length, [this](std::size_t first, std::size_t bytes)
+                   { posix_fadvise(fd_, first, bytes, POSIX_FADV_WILLNEED); });
+        }
+
+        void dontNeed(std::size_t offset, std::size_t length) const
+        {
+            advise(offset, length, [this](std::size_t first, std::size_t bytes)
+                   {
+                       madvise(static_cast<std::uint8_t *>(mapping_) + first, bytes, MADV_DONTNEED);
+                       posix_fadvise(fd_, first, bytes, POSIX_FADV_DONTNEED);
+                   });
+        }
+    };
+}
@@ -6,6 +6,7 @@
 #include <cmath>
 
 #include "fileutil.h"
+#include "matrixfunctions.h"
 
 namespace cave
 {
@@ -56,7 +57,7 @@ namespace cave
             double value1 = v_[i];
             double value2 = other.v_[i];
 
-            if (abs(value2 - value1) > tolerance)
+            if (std::abs(value2 - value1) > tolerance)
             {
                 return false;
             }
@@ -133,6 +134,33 @@ namespace cave
         return result;
     }
 
+    Matrix Matrix::columns(int first, int count) const
+    {
+        assert(first >= 0 && first + count <= cols_ && "Column range out of bounds.");
+
+        Matrix result(rows_, count);
+
+        for (int row = 0; row < rows_; ++row)
+        {
+            for (int col = 0; col < count; ++col)
+            {
+                result.v_[row * count + col] = v_[row * cols_ + first + col];
+            }
+        }
+
+        return result;
+    }
+
+    Matrix &Matrix::reshape(int rows, int cols)
+    {
+        assert(rows * cols == rows_ * cols_ && "Reshape must keep the number of elements.");
+
+        rows_ = rows;
+        cols_ = cols;
+
+        return *this;
+    }
+
     Matrix operator*(const Matrix &m1, const Matrix &m2)
     {
         if (m1.cols_ != m2.rows_)
@@ -144,24 +172,7 @@ namespace cave
         }
 
         Matrix result(m1.rows_, m2.cols_);
-
-        int index = 0;
-
-        int rowCols = 0;
-
-        for (int row = 0; row < result.rows_; ++row)
-        {
-            for (int col = 0; col < result.cols_; ++col)
-            {
-                rowCols = row * m1.cols_;
-
-                for (int n = 0; n < m1.cols_; ++n)
-                {
-                    result.v_[index] += m1.v_[rowCols + n] * m2.v_[col + n * m2.cols_];
-                }
-                ++index;
-            }
-        }
+        multiply(m1.data(), m2.data(), result.data(), m1.rows_, m1.cols_, m2.cols_);
 
         return result;
     }
@@ -58,18 +58,23 @@ namespace cave
         Matrix rowMeans();
         Matrix rowSums();
         Matrix largestRowIndexes() const;
+        Matrix columns(int first, int count) const;
+        Matrix &reshape(int rows, int cols);
         double sum() const;
 
-        int rows()
+        int rows() const
         {
             return rows_;
         }
 
-        int cols()
+        int cols() const
         {
             return cols_;
         }
 
+        double *data() { return v_.data(); }
+        const double *data() const { return v_.data(); }
+
         void forEach(std::function<void(int, int, int, double)> f) const;
         void forEach(std::function<void(int, int, double)> f) const;
         Matrix &modify(std::function<double(int, int, int, double)> f);
@@ -102,6 +107,8 @@ namespace cave
         friend Matrix operator*(double a, Matrix const &m);
         friend Matrix operator-=(Matrix &m1, const Matrix &m2);
 
+        friend class Tensor;
+
         // TODO remove this later.
         Matrix clone() {
             Matrix m(rows_, cols_);
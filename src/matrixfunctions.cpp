@@ -2,9 +2,14 @@
 
 #include <cmath>
 #include <utility>
-#include <random>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <numeric>
+
+#include "random.h"
+#include "tensor.h"
 
 namespace cave
 {
@@ -129,44 +134,503 @@ namespace cave
         return result;
     }
 
-    IO generateTestData(int items, int inputSize, int outputSize)
+    /*
+     * Points on spheres of radius 1 to outputSize around the origin, labelled
+     * by radius. The data is a pure function of seed and stream.
+     */
+    IO generateTestData(int items, int inputSize, int outputSize, std::uint64_t seed, std::uint64_t stream)
     {
-        std::default_random_engine generator;
-        std::random_device rd;
-        generator.seed(rd());
-
-        std::uniform_int_distribution<int> uniform(1, outputSize);
-        std::normal_distribution<double> normal(0, 1);
-
         Matrix input(inputSize, items);
         Matrix output(outputSize, items);
 
+        generateTestData(input, output, seed, stream);
+
+        return IO(input, output);
+    }
+
+    /*
+     * Fills input and output, already sized to inputSize and outputSize
+     * rows by items columns, with what the overload above would return.
+     * Rows are walked contiguously, so no pass strides across the matrix.
+     */
+    void generateTestData(Matrix &input, Matrix &output, std::uint64_t seed, std::uint64_t stream)
+    {
+        Philox philox(seed);
+
+        int items = input.cols();
+        int inputSize = input.rows();
+        int outputSize = output.rows();
+
+        double *values = input.data();
+        double *labels = output.data();
+
+        philox.fillNormal(values, std::size_t(inputSize) * items, Philox::stream(stream, 0));
+        std::fill(labels, labels + std::size_t(outputSize) * items, 0.0);
+
+        std::vector<double> scale(items, 0.0);
+
+        for (int row = 0; row < inputSize; ++row)
+        {
+            const double *rowValues = values + std::size_t(row) * items;
+
+            for (int col = 0; col < items; ++col)
+            {
+                scale[col] += rowValues[col] * rowValues[col];
+            }
+        }
+
         for (int col = 0; col < items; col++)
         {
-            int radius = uniform(generator);
+            int radius = 1 + std::min(outputSize - 1, int(outputSize * philox.uniform(Philox::stream(stream, 1), col)));
+
+            labels[std::size_t(radius - 1) * items + col] = 1.0;
+            scale[col] = radius / std::sqrt(scale[col]);
+        }
+
+        for (int row = 0; row < inputSize; ++row)
+        {
+            double *rowValues = values + std::size_t(row) * items;
+
+            for (int col = 0; col < items; ++col)
+            {
+                rowValues[col] *= scale[col];
+            }
+        }
+    }
+
+    /*
+     * m1 * transpose(m2), without materialising the transpose.
+     */
+    Matrix multiplyTransposed(const Matrix &m1, const Matrix &m2)
+    {
+        if (m1.cols() != m2.cols())
+        {
+            throw std::logic_error("Matrixes cannot be multiplied: " + toString(m1) + " * transpose " + toString(m2));
+        }
+
+        Matrix result(m1.rows(), m2.rows());
+        multiplyTransposed(m1.data(), m2.data(), result.data(), m1.rows(), m1.cols(), m2.rows());
+
+        return result;
+    }
+
+    /*
+     * transpose(m1) * m2, without materialising the transpose.
+     */
+    Matrix transposeMultiply(const Matrix &m1, const Matrix &m2)
+    {
+        if (m1.rows() != m2.rows())
+        {
+            throw std::logic_error("Matrixes cannot be multiplied: transpose " + toString(m1) + " * " + toString(m2));
+        }
+
+        Matrix result(m1.cols(), m2.cols());
+        transposeMultiply(m1.data(), m2.data(), result.data(), m1.cols(), m1.rows(), m2.cols());
+
+        return result;
+    }
 
-            output.set(radius - 1, col, 1.0);
+    /*
+     * The product kernels on raw row-major storage, shared by Matrix and
+     * Tensor. Each writes the rows x cols product of a rows x inner and an
+     * inner x cols operand into result, overwriting it. multiplyTransposed
+     * takes b stored as its cols x inner transpose, transposeMultiply takes
+     * a stored as its inner x rows transpose.
+     */
+    void multiply(const double *a, const double *b, double *result, int rows, int inner, int cols)
+    {
+        std::fill(result, result + std::size_t(rows) * cols, 0.0);
 
-            double sumsquare = 0.0;
+        // Row-by-row accumulation keeps the inner loop on contiguous memory.
+        for (int row = 0; row < rows; ++row)
+        {
+            double *resultRow = result + std::size_t(row) * cols;
 
-            for (int row = 0; row < inputSize; ++row)
+            for (int n = 0; n < inner; ++n)
             {
-                double value = normal(generator);
-                sumsquare += value * value;
+                double value = a[std::size_t(row) * inner + n];
+                const double *bRow = b + std::size_t(n) * cols;
 
-                input.set(row, col, value);
+                for (int col = 0; col < cols; ++col)
+                {
+                    resultRow[col] += value * bRow[col];
+                }
             }
+        }
+    }
+
+    void multiplyTransposed(const double *a, const double *b, double *result, int rows, int inner, int cols)
+    {
+        for (int row = 0; row < rows; ++row)
+        {
+            for (int col = 0; col < cols; ++col)
+            {
+                double sum = 0;
+
+                for (int n = 0; n < inner; ++n)
+                {
+                    sum += a[std::size_t(row) * inner + n] * b[std::size_t(col) * inner + n];
+                }
+
+                result[std::size_t(row) * cols + col] = sum;
+            }
+        }
+    }
+
+    void transposeMultiply(const double *a, const double *b, double *result, int rows, int inner, int cols)
+    {
+        std::fill(result, result + std::size_t(rows) * cols, 0.0);
 
-            double distance = std::sqrt(sumsquare);
+        for (int n = 0; n < inner; ++n)
+        {
+            const double *bRow = b + std::size_t(n) * cols;
 
-            for (int row = 0; row < inputSize; ++row)
+            for (int row = 0; row < rows; ++row)
             {
-                double value = input.get(row, col);
-                input.set(row, col, radius * value / distance);
+                double value = a[std::size_t(n) * rows + row];
+                double *resultRow = result + std::size_t(row) * cols;
+
+                for (int col = 0; col < cols; ++col)
+                {
+                    resultRow[col] += value * bRow[col];
+                }
             }
         }
+    }
 
-        return IO(input, output);
+    /*
+     * m * vector for a single column; each output is one contiguous dot product.
+     */
+    Matrix multiplyVector(const Matrix &m, const Matrix &vector)
+    {
+        if (m.cols() != vector.rows() || vector.cols() != 1)
+        {
+            throw std::logic_error("Matrix cannot be multiplied by vector: " + toString(m) + " * " + toString(vector));
+        }
+
+        Matrix result(m.rows(), 1);
+
+        const double *a = m.data();
+        const double *x = vector.data();
+
+        for (int row = 0; row < m.rows(); ++row)
+        {
+            double sum = 0;
+
+            for (int n = 0; n < m.cols(); ++n)
+            {
+                sum += a[row * m.cols() + n] * x[n];
+            }
+
+            result[row] = sum;
+        }
+
+        return result;
+    }
+
+    /*
+     * Unrolls the kernel-sized patches of a batch of channels x height x width
+     * samples (one sample per column) into a (channels * kernel * kernel) x
+     * (outputPixels * items) matrix. Column p * items + n holds patch p of
+     * sample n, so a convolution becomes one matrix product whose result is
+     * already laid out as (outputChannels * outputPixels) x items.
+     */
+    Matrix im2col(const Matrix &input, int channels, int height, int width, int kernel, int stride, int padding)
+    {
+        int items = input.cols();
+        int outHeight = (height + 2 * padding - kernel) / stride + 1;
+        int outWidth = (width + 2 * padding - kernel) / stride + 1;
+
+        Matrix columns(channels * kernel * kernel, outHeight * outWidth * items);
+
+        const Tensor image = Tensor::view(input, {channels, height, width, items});
+        Tensor patches = Tensor::view(columns, {channels, kernel, kernel, outHeight, outWidth, items});
+
+        for (int channel = 0; channel < channels; ++channel)
+        {
+            for (int ky = 0; ky < kernel; ++ky)
+            {
+                for (int kx = 0; kx < kernel; ++kx)
+                {
+                    for (int oy = 0; oy < outHeight; ++oy)
+                    {
+                        int iy = oy * stride - padding + ky;
+
+                        if (iy < 0 || iy >= height)
+                        {
+                            continue;
+                        }
+
+                        for (int ox = 0; ox < outWidth; ++ox)
+                        {
+                            int ix = ox * stride - padding + kx;
+
+                            if (ix < 0 || ix >= width)
+                            {
+                                continue;
+                            }
+
+                            const double *from = image.address(channel, iy, ix, 0);
+                            std::copy(from, from + items, patches.address(channel, ky, kx, oy, ox, 0));
+                        }
+                    }
+                }
+            }
+        }
+
+        return columns;
+    }
+
+    /*
+     * The adjoint of im2col: accumulates each patch column back onto the
+     * pixels it was read from.
+     */
+    Matrix col2im(const Matrix &columns, int items, int channels, int height, int width, int kernel, int stride, int padding)
+    {
+        int outHeight = (height + 2 * padding - kernel) / stride + 1;
+        int outWidth = (width + 2 * padding - kernel) / stride + 1;
+
+        Matrix image(channels * height * width, items);
+
+        const Tensor patches = Tensor::view(columns, {channels, kernel, kernel, outHeight, outWidth, items});
+        Tensor pixels = Tensor::view(image, {channels, height, width, items});
+
+        for (int channel = 0; channel < channels; ++channel)
+        {
+            for (int ky = 0; ky < kernel; ++ky)
+            {
+                for (int kx = 0; kx < kernel; ++kx)
+                {
+                    for (int oy = 0; oy < outHeight; ++oy)
+                    {
+                        int iy = oy * stride - padding + ky;
+
+                        if (iy < 0 || iy >= height)
+                        {
+                            continue;
+                        }
+
+                        for (int ox = 0; ox < outWidth; ++ox)
+                        {
+                            int ix = ox * stride - padding + kx;
+
+                            if (ix < 0 || ix >= width)
+                            {
+                                continue;
+                            }
+
+                            const double *from = patches.address(channel, ky, kx, oy, ox, 0);
+                            double *to = pixels.address(channel, iy, ix, 0);
+
+                            for (int n = 0; n < items; ++n)
+                            {
+                                to[n] += from[n];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        return image;
+    }
+
+    /*
+     * Turns a batch of sequences, steps x features rows per column with each
+     * step a contiguous block of rows, into features x (steps * items) with
+     * step t in columns t * items onwards, so one product covers every step.
+     * Both are views of steps x features x items data; only the first two
+     * axes swap.
+     */
+    Matrix sequenceToColumns(const Matrix &sequence, int steps)
+    {
+        int items = sequence.cols();
+        int features = sequence.rows() / steps;
+
+        Matrix columns(features, steps * items);
+
+        Tensor::view(columns, {features, steps, items}).copy(Tensor::view(sequence, {steps, features, items}).permute({1, 0, 2}));
+
+        return columns;
+    }
+
+    Matrix columnsToSequence(const Matrix &columns, int steps)
+    {
+        int items = columns.cols() / steps;
+        int features = columns.rows();
+
+        Matrix sequence(steps * features, items);
+
+        Tensor::view(sequence, {steps, features, items}).copy(Tensor::view(columns, {features, steps, items}).permute({1, 0, 2}));
+
+        return sequence;
+    }
+
+    /*
+     * Modified Gram-Schmidt, applied twice for numerical stability. Columns
+     * that are linearly dependent on earlier ones come out as zero.
+     */
+    Matrix orthonormalColumns(const Matrix &m)
+    {
+        Matrix vectors = m.transpose();
+
+        int count = vectors.rows();
+        int length = vectors.cols();
+        double *values = vectors.data();
+
+        for (int i = 0; i < count; ++i)
+        {
+            double *vector = values + std::size_t(i) * length;
+            double original = std::sqrt(std::inner_product(vector, vector + length, vector, 0.0));
+
+            for (int pass = 0; pass < 2; ++pass)
+            {
+                for (int j = 0; j < i; ++j)
+                {
+                    const double *previous = values + std::size_t(j) * length;
+                    double projection = std::inner_product(vector, vector + length, previous, 0.0);
+
+                    for (int k = 0; k < length; ++k)
+                    {
+                        vector[k] -= projection * previous[k];
+                    }
+                }
+            }
+
+            double norm = std::sqrt(std::inner_product(vector, vector + length, vector, 0.0));
+            double scale = norm > 1e-10 * original ? 1.0 / norm : 0.0;
+
+            for (int k = 0; k < length; ++k)
+            {
+                vector[k] *= scale;
+            }
+        }
+
+        return vectors.transpose();
+    }
+
+    /*
+     * Truncated SVD by randomized range finding (Halko, Martinsson and Tropp):
+     * m is multiplied by a Gaussian test matrix with a few extra columns,
+     * sharpened by power iterations, and the small projection onto that
+     * range is decomposed exactly with one-sided Jacobi rotations. With rank
+     * at least min(rows, cols) the decomposition is exact.
+     */
+    SVD svd(const Matrix &m, int rank, std::uint64_t seed, int powerIterations)
+    {
+        int limit = std::min(m.rows(), m.cols());
+        rank = std::max(1, std::min(rank, limit));
+
+        int samples = std::min(limit, rank + 10);
+
+        Matrix omega(m.cols(), samples);
+        Philox(seed).fillNormal(omega.data(), std::size_t(m.cols()) * samples, Philox::stream(m.rows(), m.cols()));
+
+        Matrix transposed = m.transpose();
+        Matrix q = orthonormalColumns(m * omega);
+
+        for (int i = 0; i < powerIterations; ++i)
+        {
+            q = orthonormalColumns(m * orthonormalColumns(transposed * q));
+        }
+
+        // Rotate the rows of b = transpose(q) * m until they are orthogonal;
+        // rotation accumulates the same rotations, starting from identity.
+        Matrix b = transposeMultiply(q, m);
+        Matrix rotation(samples, samples, [](int row, int col, int index)
+                        { return row == col ? 1.0 : 0.0; });
+
+        int length = b.cols();
+        double *rows = b.data();
+        double *rotated = rotation.data();
+
+        auto rotate = [](double *x, double *y, int length, double c, double s)
+        {
+            for (int k = 0; k < length; ++k)
+            {
+                double xk = x[k];
+                double yk = y[k];
+
+                x[k] = c * xk - s * yk;
+                y[k] = s * xk + c * yk;
+            }
+        };
+
+        for (int sweep = 0; sweep < 60; ++sweep)
+        {
+            bool changed = false;
+
+            for (int i = 0; i < samples; ++i)
+            {
+                for (int j = i + 1; j < samples; ++j)
+                {
+                    double *x = rows + std::size_t(i) * length;
+                    double *y = rows + std::size_t(j) * length;
+
+                    double alpha = std::inner_product(x, x + length, x, 0.0);
+                    double beta = std::inner_product(y, y + length, y, 0.0);
+                    double gamma = std::inner_product(x, x + length, y, 0.0);
+
+                    if (std::abs(gamma) <= 1e-15 * std::sqrt(alpha * beta) || gamma == 0)
+                    {
+                        continue;
+                    }
+
+                    changed = true;
+
+                    double zeta = (beta - alpha) / (2 * gamma);
+                    double t = (zeta >= 0 ? 1.0 : -1.0) / (std::abs(zeta) + std::sqrt(1 + zeta * zeta));
+                    double c = 1 / std::sqrt(1 + t * t);
+
+                    rotate(x, y, length, c, c * t);
+                    rotate(rotated + i * samples, rotated + j * samples, samples, c, c * t);
+                }
+            }
+
+            if (!changed)
+            {
+                break;
+            }
+        }
+
+        std::vector<double> norms(samples);
+        std::vector<int> order(samples);
+
+        for (int i = 0; i < samples; ++i)
+        {
+            double *x = rows + std::size_t(i) * length;
+            norms[i] = std::sqrt(std::inner_product(x, x + length, x, 0.0));
+            order[i] = i;
+        }
+
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+                         { return norms[a] > norms[b]; });
+
+        // m ~ q * b = (q * transpose(rotation)) * (rotation * b), and the
+        // rows of rotation * b are the singular values times the rows of v.
+        Matrix left = multiplyTransposed(q, rotation);
+
+        SVD result{Matrix(m.rows(), rank), Matrix(rank, 1), Matrix(m.cols(), rank)};
+
+        for (int r = 0; r < rank; ++r)
+        {
+            int source = order[r];
+            double sigma = norms[source];
+
+            result.s[r] = sigma;
+
+            for (int row = 0; row < m.rows(); ++row)
+            {
+                result.u.set(row, r, left.get(row, source));
+            }
+
+            for (int col = 0; col < m.cols(); ++col)
+            {
+                result.v.set(col, r, sigma > 0 ? rows[std::size_t(source) * length + col] / sigma : 0.0);
+            }
+        }
+
+        return result;
     }
 
     Matrix relu(Matrix &input)
@@ -190,7 +654,7 @@ namespace cave
         return result;
     }
 
-    std::string toString(Matrix &m)
+    std::string toString(const Matrix &m)
     {
         std::stringstream ss;
 
@@ -1,7 +1,10 @@
+#pragma once
+
 #include "matrix.h"
 #include <utility>
 #include <functional>
 #include <string>
+#include <cstdint>
 
 namespace cave
 {
@@ -17,9 +20,33 @@ namespace cave
         Matrix output;
     };
 
+    /*
+     * m is approximately u * diag(s) * transpose(v), with u and v holding
+     * singular vectors as columns and s the singular values, largest first.
+     */
+    struct SVD
+    {
+        Matrix u;
+        Matrix s;
+        Matrix v;
+    };
+
+    Matrix multiplyTransposed(const Matrix &m1, const Matrix &m2);
+    Matrix transposeMultiply(const Matrix &m1, const Matrix &m2);
+    void multiply(const double *a, const double *b, double *result, int rows, int inner, int cols);
+    void multiplyTransposed(const double *a, const double *b, double *result, int rows, int inner, int cols);
+    void transposeMultiply(const double *a, const double *b, double *result, int rows, int inner, int cols);
+    Matrix multiplyVector(const Matrix &m, const Matrix &vector);
+    Matrix im2col(const Matrix &input, int channels, int height, int width, int kernel, int stride, int padding);
+    Matrix col2im(const Matrix &columns, int items, int channels, int height, int width, int kernel, int stride, int padding);
+    Matrix sequenceToColumns(const Matrix &sequence, int steps);
+    Matrix columnsToSequence(const Matrix &columns, int steps);
+    Matrix orthonormalColumns(const Matrix &m);
+    SVD svd(const Matrix &m, int rank, std::uint64_t seed = 0, int powerIterations = 2);
     Matrix relu(Matrix &input);
     Matrix softmax(Matrix &input);
-    IO generateTestData(int items, int inputSize, int outputSize);
+    IO generateTestData(int items, int inputSize, int outputSize, std::uint64_t seed, std::uint64_t stream);
+    void generateTestData(Matrix &input, Matrix &output, std::uint64_t seed, std::uint64_t stream);
     Matrix crossEntropy(Matrix &actual, Matrix &expected);
     Matrix square(Matrix input);
     Matrix getGreatestRowNumbers(Matrix &input);
@@ -27,5 +54,5 @@ namespace cave
     Matrix incrementElement(const Matrix &m, int row, int col, double value);
     double numberCorrect(const Matrix &actual, Matrix &expected);
     std::vector<bool> getCorrect(const Matrix &actual, Matrix &expected);
-    std::string toString(Matrix &m);
+    std::string toString(const Matrix &m);
 }
\ No newline at end of file
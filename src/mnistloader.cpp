@@ -3,7 +3,12 @@
 #include <iostream>
 #include <sstream>
 #include <cmath>
+#include <memory>
+#include <algorithm>
 #include "matrix.h"
+#include "idxfile.h"
+#include "threadpool.h"
+#include "fileutil.h"
 
 namespace cave
 {
@@ -33,57 +38,55 @@ namespace cave
     {
         std::vector<Matrix> images;
 
-        imageStream_.open(imageFile_, std::ios::binary);
-
-        if (!imageStream_.is_open())
-        {
-            std::cerr << "Unable to open " << imageFile_ << std::endl;
-            return images;
-        }
-
-        if (readInt(imageStream_) != 2051)
+        try
         {
-            std::cerr << "Not an MNIST image file: " << labelFile_ << std::endl;
-            return images;
-        }
-
-        int items = readInt(imageStream_);
-        imageHeight_ = readInt(imageStream_);
-        imageWidth_ = readInt(imageStream_);
-        int inputSize = imageHeight_ * imageWidth_;
-        int numberBatches = std::ceil(double(items) / batchSize_);
+            IdxFile file(imageFile_);
 
-        int totalItemsRead = 0;
-
-        int maxReadSize = batchSize_ * inputSize;
+            if (file.dims().size() != 3)
+            {
+                std::cerr << "Not an MNIST image file: " << imageFile_ << std::endl;
+                return images;
+            }
 
-        auto imageData = std::make_unique<char[]>(maxReadSize);
+            int items = file.items();
+            imageHeight_ = file.dims()[1];
+            imageWidth_ = file.dims()[2];
+            int inputSize = file.itemSize();
+            int numberBatches = std::ceil(double(items) / batchSize_);
 
-        for (int i = 0; i < numberBatches; ++i)
-        {
-            int itemsToRead = std::min(batchSize_, items - totalItemsRead);
+            images.resize(numberBatches);
 
-            int bytesToRead = itemsToRead * inputSize;
+            ThreadPool<int> threadPool(threads_);
 
-            imageStream_.read(imageData.get(), bytesToRead);
-
-            if (!imageStream_)
+            for (int i = 0; i < numberBatches; ++i)
             {
-                std::cerr << "Unable to fully read " << imageFile_ << std::endl;
-                return images;
+                // clang-format off
+                threadPool.submit([&, i]()
+                {
+                    int first = i * batchSize_;
+                    int count = std::min(batchSize_, items - first);
+
+                    Matrix batch(inputSize, count);
+                    file.decode(first, count, 1.0 / 256.0, batch.data());
+                    images[i] = std::move(batch);
+
+                    return count;
+                });
+                // clang-format on
             }
-            cave::Matrix batch(inputSize, itemsToRead, [&](int row, int col, int index){
-                int dataIndex = col * inputSize + row;
-                uint8_t byte = imageData[dataIndex];
-                return byte / 256.0;;
-            });
 
-            images.push_back(batch);
+            threadPool.start();
 
-            totalItemsRead += itemsToRead;
+            for (int i = 0; i < numberBatches; ++i)
+            {
+                threadPool.get();
+            }
+        }
+        catch (const FileException &e)
+        {
+            std::cerr << e.what() << std::endl;
+            images.clear();
         }
-
-        imageStream_.close();
 
         return images;
     }
@@ -91,76 +94,52 @@ namespace cave
     std::vector<Matrix> MNISTLoader::loadLabels()
     {
         std::vector<Matrix> labels;
-        
-        labelStream_.open(labelFile_, std::ios::binary);
 
-        if (!labelStream_.is_open())
+        try
         {
-            std::cerr << "Unable to open " << labelFile_ << std::endl;
-            return labels;
-        }
+            IdxFile file(labelFile_);
 
-        if (readInt(labelStream_) != 2049)
-        {
-            std::cerr << "Not an MNIST label file: " << labelFile_ << std::endl;
-            return labels;
-        }
-
-        int items = readInt(labelStream_);
-        int numberBatches = std::ceil(double(items) / batchSize_);
-  
-        int labelSize = 10;
-
-        auto labelData = std::make_unique<char[]>(batchSize_);
-
-        int totalItemsRead = 0;
-
-        for (int i = 0; i < numberBatches; ++i)
-        {
-            int itemsToRead = std::min(batchSize_, items - totalItemsRead);
-
-            int bytesToRead = itemsToRead;
-
-            labelStream_.read(labelData.get(), bytesToRead);
-
-            if (!imageStream_)
+            if (file.dims().size() != 1)
             {
-                std::cerr << "Unable to fully read " << labelFile_ << std::endl;
+                std::cerr << "Not an MNIST label file: " << labelFile_ << std::endl;
                 return labels;
             }
 
-            cave::Matrix batch(labelSize, itemsToRead);
+            int items = file.items();
+            int numberBatches = std::ceil(double(items) / batchSize_);
 
-            for(int item = 0; item < itemsToRead; ++item)
+            for (int i = 0; i < numberBatches; ++i)
             {
-                int value = labelData[item];
-
-                batch.set(value, item, 1);
-            }
+                int first = i * batchSize_;
+                int count = std::min(batchSize_, items - first);
 
-            labels.push_back(batch);
+                std::vector<double> values(count);
+                file.decode(first, count, 1, values.data());
 
-            totalItemsRead += itemsToRead;
-        }
+                cave::Matrix batch(classes_, count);
 
-        labelStream_.close();
+                for (int item = 0; item < count; ++item)
+                {
+                    int value = values[item];
 
-        return labels;
-    }
-
-    std::uint32_t MNISTLoader::readInt(std::ifstream &in)
-    {
-        char bytes[4];
-        uint32_t result = 0;
-        in.read(bytes, 4);
+                    if (value < 0 || value >= classes_)
+                    {
+                        std::cerr << "Label " << value << " out of range in " << labelFile_ << std::endl;
+                        return std::vector<Matrix>();
+                    }
 
-        char *pInt = reinterpret_cast<char *>(&result);
+                    batch.set(value, item, 1);
+                }
 
-        pInt[3] = bytes[0];
-        pInt[2] = bytes[1];
-        pInt[1] = bytes[2];
-        pInt[0] = bytes[3];
+                labels.push_back(batch);
+            }
+        }
+        catch (const FileException &e)
+        {
+            std::cerr << e.what() << std::endl;
+            labels.clear();
+        }
 
-        return result;
+        return labels;
     }
-}
\ No newline at end of file
+}
@@ -1,25 +1,25 @@
 #pragma once
 
 #include <string>
-#include <fstream>
 #include <cstdint>
-#include <mutex>
+#include <thread>
+#include <algorithm>
 
 #include "loader.h"
 
 namespace cave
 {
+    /*
+     * Loads MNIST from its IDX files by mapping them into memory and
+     * decoding the batches on several threads. Images of any IDX element
+     * type are scaled by 1/256; labels may be any integer type.
+     */
     class MNISTLoader : public Loader
     {
     private:
-        std::ifstream imageStream_;
-        std::ifstream labelStream_;
-
         std::string imageFile_;
         std::string labelFile_;
 
-        std::uint32_t readInt(std::ifstream &in);
-
         std::vector<Matrix> loadImages();
         std::vector<Matrix> loadLabels();
 
@@ -27,6 +27,8 @@ namespace cave
         int items_{0};
         int imageWidth_{0};
         int imageHeight_{0};
+        int classes_{10};
+        int threads_{int(std::max(1u, std::thread::hardware_concurrency()))};
 
     public:
         MNISTLoader(int batchSize, std::string inputDir, std::string imageFile, std::string labelFile): batchSize_{batchSize}
@@ -37,6 +39,8 @@ namespace cave
 
         int getImageWidth() { return imageWidth_; }
         int getImageHeight() { return imageHeight_; }
+        void setThreads(int threads) { threads_ = threads; }
+        void setClasses(int classes) { classes_ = classes; }
 
         TrainingData load();
     };
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <string>
+
+#include "neuralnet.h"
+
+namespace cave
+{
+    /*
+     * Publishes a model to concurrent predictors without locking them out.
+     * Readers take a reference-counted pointer to the current model with
+     * acquire() and keep using it for as long as they hold it; publish()
+     * atomically replaces the pointer, so requests already running finish
+     * on the old model, new ones see the new model, and the old model is
+     * freed when its last reader lets go.
+     *
+     * A published model is shared by every reader and must not be modified
+     * again; train or load a fresh NeuralNet and publish that instead.
+     */
+    class ModelHandle
+    {
+    private:
+        std::shared_ptr<NeuralNet> current_;
+        std::atomic<long> version_{0};
+
+    public:
+        ModelHandle() {}
+
+        explicit ModelHandle(std::string file)
+        {
+            load(file);
+        }
+
+        std::shared_ptr<NeuralNet> acquire() const
+        {
+            return std::atomic_load(&current_);
+        }
+
+        /*
+         * Compiles the model before it becomes visible, so the first readers
+         * do not pay for it.
+         */
+        void publish(std::shared_ptr<NeuralNet> model)
+        {
+            model->compile();
+
+            std::atomic_store(&current_, model);
+            ++version_;
+        }
+
+        void load(std::string file)
+        {
+            auto model = std::make_shared<NeuralNet>();
+            model->load(file);
+
+            publish(model);
+        }
+
+        long version() const { return version_; }
+    };
+}
@@ -0,0 +1,635 @@
+#include "multiprocesstrainer.h"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <sstream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "profiler.h"
+#include "topology.h"
+
+namespace cave
+{
+    namespace
+    {
+        const int statsPerWorker = 3;
+
+        std::string systemError(std::string message)
+        {
+            return message + ": " + std::strerror(errno);
+        }
+
+        void writeByte(int fd)
+        {
+            char byte = 0;
+
+            if (write(fd, &byte, 1) != 1)
+            {
+                throw std::runtime_error(systemError("Unable to write to coordinator socket"));
+            }
+        }
+
+        void readByte(int fd)
+        {
+            char byte = 0;
+
+            if (read(fd, &byte, 1) != 1)
+            {
+                throw std::runtime_error("Training socket closed unexpectedly.");
+            }
+        }
+    }
+
+    MultiProcessTrainer::MultiProcessTrainer(NeuralNet &neuralNet, int processes)
+        : neuralNet_(neuralNet), processes_(processes)
+    {
+        if (processes_ < 1)
+        {
+            throw std::invalid_argument("Must be at least 1 process.");
+        }
+    }
+
+    MultiProcessTrainer::~MultiProcessTrainer()
+    {
+        cleanup(true);
+    }
+
+    /*
+     * Shared segment layout, all doubles: per-worker epoch statistics, one
+     * parameter slot per worker, then the averaged parameters.
+     */
+    double *MultiProcessTrainer::stats(int rank)
+    {
+        return shared_ + rank * statsPerWorker;
+    }
+
+    double *MultiProcessTrainer::slot(int rank)
+    {
+        return shared_ + processes_ * statsPerWorker + std::size_t(rank) * parameters_;
+    }
+
+    double *MultiProcessTrainer::reduced()
+    {
+        return slot(processes_);
+    }
+
+    int MultiProcessTrainer::batchesPerRound(int batches)
+    {
+        int shardBatches = std::ceil(double(batches) / processes_);
+
+        if (syncInterval_ > 0)
+        {
+            return std::min(syncInterval_, shardBatches);
+        }
+
+        return shardBatches;
+    }
+
+    int MultiProcessTrainer::rounds(int batches)
+    {
+        int shardBatches = std::ceil(double(batches) / processes_);
+
+        return std::ceil(double(shardBatches) / batchesPerRound(batches));
+    }
+
+    void MultiProcessTrainer::createSharedMemory()
+    {
+        std::stringstream name;
+        name << "/cave-nn-" << getpid();
+
+        sharedBytes_ = sizeof(double) * (std::size_t(processes_) * statsPerWorker + std::size_t(processes_ + 1) * parameters_);
+
+        int fd = shm_open(name.str().c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+        if (fd < 0)
+        {
+            throw std::runtime_error(systemError("Unable to create shared memory " + name.str()));
+        }
+
+        if (ftruncate(fd, sharedBytes_) != 0)
+        {
+            close(fd);
+            shm_unlink(name.str().c_str());
+            throw std::runtime_error(systemError("Unable to size shared memory"));
+        }
+
+        void *address = mmap(nullptr, sharedBytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        close(fd);
+
+        // The mapping is inherited by the workers, so the name is not needed
+        // any more and nothing is left behind if a process dies.
+        shm_unlink(name.str().c_str());
+
+        if (address == MAP_FAILED)
+        {
+            throw std::runtime_error(systemError("Unable to map shared memory"));
+        }
+
+        shared_ = static_cast<double *>(address);
+    }
+
+    void MultiProcessTrainer::createSocket()
+    {
+        std::stringstream path;
+        path << "/tmp/cave-nn-" << getpid() << ".sock";
+        socketPath_ = path.str();
+
+        listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (listener_ < 0)
+        {
+            throw std::runtime_error(systemError("Unable to create coordinator socket"));
+        }
+
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socketPath_.c_str(), sizeof(address.sun_path) - 1);
+
+        unlink(socketPath_.c_str());
+
+        if (bind(listener_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener_, processes_) != 0)
+        {
+            throw std::runtime_error(systemError("Unable to listen on " + socketPath_));
+        }
+    }
+
+    void MultiProcessTrainer::acceptWorkers()
+    {
+        connections_.assign(processes_, -1);
+
+        for (int i = 0; i < processes_; ++i)
+        {
+            waitFor(listener_);
+
+            int connection = accept(listener_, nullptr, nullptr);
+
+            if (connection < 0)
+            {
+                throw std::runtime_error(systemError("Unable to accept worker connection"));
+            }
+
+            int rank = -1;
+
+            waitFor(connection);
+
+            if (read(connection, &rank, sizeof(rank)) != sizeof(rank) || rank < 0 || rank >= processes_)
+            {
+                close(connection);
+                throw std::runtime_error("Worker sent an invalid rank.");
+            }
+
+            connections_[rank] = connection;
+        }
+
+        close(listener_);
+        listener_ = -1;
+        unlink(socketPath_.c_str());
+    }
+
+    void MultiProcessTrainer::barrier()
+    {
+        for (int connection : connections_)
+        {
+            waitFor(connection);
+            readByte(connection);
+        }
+
+        for (int connection : connections_)
+        {
+            writeByte(connection);
+        }
+    }
+
+    /*
+     * Waits until fd can be read without blocking. Between polls, checks
+     * that every worker is still running and that none has taken longer
+     * than the timeout.
+     */
+    void MultiProcessTrainer::waitFor(int fd)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        while (true)
+        {
+            pollfd request{fd, POLLIN, 0};
+            int ready = poll(&request, 1, 100);
+
+            if (ready > 0)
+            {
+                return;
+            }
+
+            if (ready < 0 && errno != EINTR)
+            {
+                throw std::runtime_error(systemError("Unable to wait for worker processes"));
+            }
+
+            checkWorkers();
+
+            std::chrono::duration<double> waited = std::chrono::steady_clock::now() - start;
+
+            if (waited.count() > timeout_)
+            {
+                throw std::runtime_error("Timed out waiting for worker processes.");
+            }
+        }
+    }
+
+    /*
+     * Workers only exit once training is over, so any that has exited
+     * while the coordinator still waits on it has failed.
+     */
+    void MultiProcessTrainer::checkWorkers()
+    {
+        for (std::size_t rank = 0; rank < workers_.size(); ++rank)
+        {
+            int status = 0;
+
+            if (workers_[rank] > 0 && waitpid(workers_[rank], &status, WNOHANG) == workers_[rank])
+            {
+                workers_[rank] = -1;
+
+                std::stringstream ss;
+                ss << "Worker " << rank << " exited unexpectedly.";
+                throw std::runtime_error(ss.str());
+            }
+        }
+    }
+
+    void MultiProcessTrainer::workerBarrier(int connection)
+    {
+        writeByte(connection);
+        readByte(connection);
+    }
+
+    void MultiProcessTrainer::allReduce(int rank, int connection)
+    {
+        neuralNet_.getParameters(slot(rank));
+
+        workerBarrier(connection);
+
+        int chunk = std::ceil(double(parameters_) / processes_);
+        int begin = std::min(parameters_, rank * chunk);
+        int end = std::min(parameters_, begin + chunk);
+
+        double *result = reduced();
+
+        for (int i = begin; i < end; ++i)
+        {
+            double sum = 0;
+
+            for (int p = 0; p < processes_; ++p)
+            {
+                sum += slot(p)[i];
+            }
+
+            result[i] = sum / processes_;
+        }
+
+        workerBarrier(connection);
+
+        neuralNet_.setParameters(result);
+    }
+
+    /*
+     * Binds this worker process to its NUMA node, so the shard it reads and
+     * the memory its threads allocate stay local, and gives the network a
+     * topology of that node alone so its thread pool pins every thread there.
+     */
+    void MultiProcessTrainer::bindWorker(int rank)
+    {
+        Topology topology;
+
+        if (topology.nodes() < 2)
+        {
+            return;
+        }
+
+        int node = rank % topology.nodes();
+
+        if (!topology.bind(node))
+        {
+            throw std::runtime_error(systemError("Unable to bind worker to NUMA node " + std::to_string(node)));
+        }
+
+        neuralNet_.topology_ = std::make_unique<Topology>(topology.only(node));
+    }
+
+    void MultiProcessTrainer::runWorker(int rank, Dataset &shard, int batches)
+    {
+        close(listener_);
+
+        int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socketPath_.c_str(), sizeof(address.sun_path) - 1);
+
+        if (connection < 0 || connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            throw std::runtime_error(systemError("Unable to connect to coordinator"));
+        }
+
+        if (write(connection, &rank, sizeof(rank)) != sizeof(rank))
+        {
+            throw std::runtime_error(systemError("Unable to register with coordinator"));
+        }
+
+        int perRound = batchesPerRound(batches);
+        int shardBatches = shard.batches();
+
+        neuralNet_.learningRate_ = neuralNet_.initialLearningRate_;
+
+        // Shards see the same batch numbers, so give each worker its own
+        // dropout masks.
+        neuralNet_.seed_ = Philox::stream(neuralNet_.seed_, rank);
+
+        for (int epoch = 0; epoch < neuralNet_.epochs_; ++epoch)
+        {
+            neuralNet_.currentEpoch_ = epoch;
+            shard.beginEpoch(epoch);
+
+            BatchResult totals;
+
+            for (int round = 0; round < rounds(batches); ++round)
+            {
+                int first = round * perRound;
+                int count = std::min(perRound, shardBatches - first);
+
+                if (count > 0)
+                {
+                    BatchResult result = neuralNet_.runBatches(shard, first, count, false);
+
+                    totals.numberItems += result.numberItems;
+                    totals.numberCorrect += result.numberCorrect;
+                    totals.totalLoss += result.totalLoss;
+                }
+
+                stats(rank)[0] = totals.numberItems;
+                stats(rank)[1] = totals.numberCorrect;
+                stats(rank)[2] = totals.totalLoss;
+
+                allReduce(rank, connection);
+            }
+
+            neuralNet_.learningRate_ -= (neuralNet_.initialLearningRate_ - neuralNet_.finalLearningRate_) / neuralNet_.epochs_;
+        }
+
+        // Hand back the parameters this worker finished with, so the
+        // coordinator can check every worker ended in the same state.
+        neuralNet_.getParameters(slot(rank));
+        workerBarrier(connection);
+
+        close(connection);
+    }
+
+    void MultiProcessTrainer::coordinate(int batches)
+    {
+        for (int epoch = 0; epoch < neuralNet_.epochs_; ++epoch)
+        {
+            std::cout << "Epoch " << std::setw(3) << (epoch + 1) << " " << std::flush;
+
+            auto start = std::chrono::high_resolution_clock::now();
+
+            double items = 0;
+            double correct = 0;
+            double loss = 0;
+
+            for (int round = 0; round < rounds(batches); ++round)
+            {
+                barrier();
+
+                // Workers publish their totals before the first barrier of
+                // a round and cannot start the next epoch until the second,
+                // so the statistics are read in between.
+                if (round == rounds(batches) - 1)
+                {
+                    for (int rank = 0; rank < processes_; ++rank)
+                    {
+                        items += stats(rank)[0];
+                        correct += stats(rank)[1];
+                        loss += stats(rank)[2];
+                    }
+                }
+
+                barrier();
+            }
+
+            auto finish = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(finish - start);
+
+            std::cout << std::fixed << std::setprecision(2) << "Loss: " << loss / items << " -- percent correct: "
+                      << (100.0 * correct) / items << "%: " << std::setprecision(1)
+                      << duration.count() / 1000.0 << "s" << std::endl;
+        }
+
+        barrier();
+    }
+
+    /*
+     * Whether every worker's final parameters, left in its slot, match the
+     * averaged ones.
+     */
+    bool MultiProcessTrainer::consistent()
+    {
+        for (int rank = 0; rank < processes_; ++rank)
+        {
+            if (!std::equal(slot(rank), slot(rank) + parameters_, reduced()))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void MultiProcessTrainer::fit(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds)
+    {
+        // clang-format off
+        run(inputs.size(), [&](int rank)
+        {
+            // Copying the shard makes this process first-touch its own data.
+            std::vector<Matrix> shardInputs;
+            std::vector<Matrix> shardExpecteds;
+
+            for (std::size_t i = rank; i < inputs.size(); i += processes_)
+            {
+                shardInputs.push_back(inputs[i]);
+                shardExpecteds.push_back(expecteds[i]);
+            }
+
+            MatrixDataset shard(shardInputs, shardExpecteds);
+            runWorker(rank, shard, inputs.size());
+        });
+        // clang-format on
+    }
+
+    /*
+     * Each worker reads its batches through the dataset, decoding them in
+     * its own pinned threads, so a compact dataset is never expanded whole.
+     * A dataset that shuffles must give every worker the same order for an
+     * epoch, as seeded ones do, so the shards stay disjoint.
+     */
+    void MultiProcessTrainer::fit(Dataset &data)
+    {
+        // clang-format off
+        run(data.batches(), [&](int rank)
+        {
+            ShardDataset shard(data, rank, processes_);
+            runWorker(rank, shard, data.batches());
+        });
+        // clang-format on
+    }
+
+    void MultiProcessTrainer::run(int batches, const std::function<void(int)> &worker)
+    {
+        auto timing = gProfiler.start("multi-process fit");
+
+        if (batches < processes_)
+        {
+            throw std::invalid_argument("Fewer batches than worker processes.");
+        }
+
+        parameters_ = neuralNet_.parameterCount();
+
+        createSharedMemory();
+        createSocket();
+
+        std::cout << "Training with " << processes_ << " processes, " << neuralNet_.threads_ << " threads each" << std::endl;
+
+        std::cout.flush();
+        std::cerr.flush();
+
+        for (int rank = 0; rank < processes_; ++rank)
+        {
+            pid_t pid = fork();
+
+            if (pid < 0)
+            {
+                cleanup(true);
+                throw std::runtime_error(systemError("Unable to start worker process"));
+            }
+
+            if (pid == 0)
+            {
+                int status = 0;
+
+                try
+                {
+                    bindWorker(rank);
+                    worker(rank);
+                }
+                catch (const std::exception &e)
+                {
+                    std::cerr << "Worker " << rank << ": " << e.what() << std::endl;
+                    status = 1;
+                }
+
+                std::cout.flush();
+                _exit(status);
+            }
+
+            workers_.push_back(pid);
+        }
+
+        try
+        {
+            acceptWorkers();
+            coordinate(batches);
+        }
+        catch (...)
+        {
+            cleanup(true);
+            throw;
+        }
+
+        neuralNet_.setParameters(reduced());
+
+        bool matched = consistent();
+
+        if (!cleanup(false))
+        {
+            throw std::runtime_error("A worker process failed.");
+        }
+
+        if (!matched)
+        {
+            throw std::logic_error("Worker processes finished with different parameters.");
+        }
+
+        gProfiler.end(timing);
+    }
+
+    /*
+     * Closing the connections releases any worker still waiting on a barrier,
+     * after which it exits with an error; abort kills the workers instead of
+     * waiting for them. Returns false if any worker failed.
+     */
+    bool MultiProcessTrainer::cleanup(bool abort)
+    {
+        bool succeeded = true;
+
+        for (int connection : connections_)
+        {
+            if (connection >= 0)
+            {
+                close(connection);
+            }
+        }
+
+        connections_.clear();
+
+        if (listener_ >= 0)
+        {
+            close(listener_);
+            listener_ = -1;
+            unlink(socketPath_.c_str());
+        }
+
+        for (pid_t pid : workers_)
+        {
+            int status = 0;
+
+            // Workers already reaped by checkWorkers() were reported there.
+            if (pid <= 0)
+            {
+                succeeded = false;
+                continue;
+            }
+
+            if (abort)
+            {
+                kill(pid, SIGKILL);
+            }
+
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                succeeded = false;
+            }
+        }
+
+        workers_.clear();
+
+        if (shared_ != nullptr)
+        {
+            munmap(shared_, sharedBytes_);
+            shared_ = nullptr;
+        }
+
+        return succeeded;
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <sys/types.h>
+
+#include "neuralnet.h"
+
+namespace cave
+{
+    /*
+     * Data-parallel training across worker processes on a single host. Each
+     * worker is forked with its own copy of the network and trains on every
+     * processes'th batch. Parameters are averaged through a POSIX shared
+     * memory segment (reduce-scatter followed by all-gather) every
+     * syncInterval batches, with the parent process acting as coordinator for
+     * startup and barriers over a Unix domain socket. A worker that exits,
+     * or takes longer than the timeout to reach the next barrier, fails
+     * the fit and the remaining workers are stopped.
+     *
+     * Worker rank is bound to NUMA node rank % nodes before it touches its
+     * shard, and its threads are pinned to that node's CPUs.
+     */
+    class MultiProcessTrainer
+    {
+    private:
+        NeuralNet &neuralNet_;
+        int processes_{1};
+        int syncInterval_{0};
+        double timeout_{600};
+
+        int parameters_{0};
+        double *shared_{nullptr};
+        std::size_t sharedBytes_{0};
+
+        std::string socketPath_;
+        int listener_{-1};
+        std::vector<int> connections_;
+        std::vector<pid_t> workers_;
+
+    private:
+        double *stats(int rank);
+        double *slot(int rank);
+        double *reduced();
+
+        int batchesPerRound(int batches);
+        int rounds(int batches);
+
+        void createSharedMemory();
+        void createSocket();
+        void acceptWorkers();
+        void coordinate(int batches);
+        void barrier();
+        void waitFor(int fd);
+        void checkWorkers();
+        bool consistent();
+
+        void run(int batches, const std::function<void(int)> &worker);
+        void bindWorker(int rank);
+        void runWorker(int rank, Dataset &shard, int batches);
+        void workerBarrier(int connection);
+        void allReduce(int rank, int connection);
+
+        bool cleanup(bool abort);
+
+    public:
+        MultiProcessTrainer(NeuralNet &neuralNet, int processes);
+        ~MultiProcessTrainer();
+
+        void setSyncInterval(int batches) { syncInterval_ = batches; }
+        void setTimeout(double seconds) { timeout_ = seconds; }
+        void fit(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds);
+        void fit(Dataset &data);
+    };
+}
@@ -10,15 +10,30 @@
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <future>
+#include <algorithm>
+#include <numeric>
 
 #include "blockingqueue.h"
 #include "matrixfunctions.h"
 #include "threadpool.h"
 #include "profiler.h"
 #include "fileutil.h"
+#include "pipeline.h"
+#include "tensor.h"
 
 namespace cave
 {
+    namespace
+    {
+        const double batchNormEpsilon = 1e-5;
+
+        inline double sigmoid(double value)
+        {
+            return 1.0 / (1.0 + std::exp(-value));
+        }
+    }
+
     std::ostream &operator<<(std::ostream &out, NeuralNet &neuralNet)
     {
         out << "Threads: " << neuralNet.threads_ << std::endl;
@@ -26,6 +41,23 @@ namespace cave
         out << "Initial learning rate: " << neuralNet.initialLearningRate_ << std::endl;
         out << "Final learning rate: " << neuralNet.finalLearningRate_ << std::endl;
         out << "Weight scale: " << neuralNet.scaleInitialWeights_ << std::endl;
+        out << "Seed: " << neuralNet.seed_ << std::endl;
+
+        if (neuralNet.pipelineStages_ > 1)
+        {
+            out << "Pipeline stages: " << neuralNet.pipelineStages_ << " (" << neuralNet.microBatches_ << " micro-batches, "
+                << (neuralNet.pipelineSchedule_ == NeuralNet::GPIPE ? "GPipe" : "1F1B") << ")" << std::endl;
+        }
+
+        if (neuralNet.topology_)
+        {
+            out << "NUMA nodes: " << neuralNet.topology_->nodes() << std::endl;
+        }
+
+        if (neuralNet.checkpointSegment_ > 0)
+        {
+            out << "Checkpoint segment: " << neuralNet.checkpointSegment_ << " layers" << std::endl;
+        }
 
         if (neuralNet.weights_.size() > 0)
         {
@@ -34,15 +66,43 @@ namespace cave
 
         int weightIndex = 0;
 
-        for (NeuralNet::Transform transform : neuralNet.transforms_)
+        for (std::size_t i = 0; i < neuralNet.transforms_.size(); ++i)
         {
+            NeuralNet::Transform transform = neuralNet.transforms_[i];
             out << neuralNet.transformNames_[transform];
 
             if (transform == NeuralNet::DENSE)
             {
-                Matrix &weight = neuralNet.weights_[weightIndex++];
+                Matrix &weight = neuralNet.weights_[weightIndex];
                 out << " " << weight.rows() << " x " << weight.cols();
             }
+            else if (transform == NeuralNet::CONV2D)
+            {
+                NeuralNet::LayerConfig &config = neuralNet.configs_[i];
+                out << " " << config.channels << " x " << config.kernel << "x" << config.kernel;
+                out << ", stride " << config.stride << ", padding " << config.padding;
+            }
+            else if (transform == NeuralNet::MAXPOOL || transform == NeuralNet::AVGPOOL)
+            {
+                NeuralNet::LayerConfig &config = neuralNet.configs_[i];
+                out << " " << config.kernel << "x" << config.kernel << ", stride " << config.stride;
+            }
+            else if (transform == NeuralNet::BATCHNORM)
+            {
+                out << " " << neuralNet.weights_[weightIndex].rows();
+            }
+            else if (transform == NeuralNet::DROPOUT)
+            {
+                out << " " << neuralNet.configs_[i].rate;
+            }
+            else if (transform == NeuralNet::LSTM || transform == NeuralNet::GRU)
+            {
+                NeuralNet::LayerConfig &config = neuralNet.configs_[i];
+                out << " " << config.channels << " x " << neuralNet.weights_[weightIndex].cols();
+                out << (config.returnSequences ? ", sequences" : "");
+            }
+
+            weightIndex += NeuralNet::weightCount(transform);
 
             out << std::endl;
         }
@@ -50,7 +110,19 @@ namespace cave
         return out;
     }
 
+    /*
+     * Saved models have BATCHNORM layers folded into the layer before them
+     * wherever possible, so loading them gives the fastest inference network.
+     */
     void NeuralNet::save(std::string file)
+    {
+        std::unique_ptr<NeuralNet> folded = snapshot();
+
+        folded->foldBatchNorm();
+        folded->write(file);
+    }
+
+    void NeuralNet::write(std::string file)
     {
         std::ofstream out;
 
@@ -74,6 +146,12 @@ namespace cave
         cave::saveValue<int>(out, epochs_);
         cave::saveValue<int>(out, threads_);
 
+        // Appended after the original fields so older files still load.
+        cave::saveValueVector<LayerConfig>(out, configs_);
+        cave::saveValue<Shape>(out, inputShape_);
+        cave::saveSerializableVector<Matrix>(out, runningMeans_);
+        cave::saveSerializableVector<Matrix>(out, runningVariances_);
+
         out.close();
 
         if (!out)
@@ -83,6 +161,11 @@ namespace cave
 
     }
 
+    /*
+     * Replaces the network in place, so it must not run while this object
+     * is predicting; to update a model that is serving, load a new NeuralNet
+     * and publish it through a ModelHandle.
+     */
     void NeuralNet::load(std::string file)
     {
         std::ifstream in;
@@ -103,324 +186,2622 @@ namespace cave
         finalLearningRate_ = cave::loadValue<double>(in);
         epochs_ = cave::loadValue<int>(in);
         threads_ = cave::loadValue<int>(in);
+
+        if (in.peek() != std::ifstream::traits_type::eof())
+        {
+            configs_ = cave::loadValueVector<LayerConfig>(in);
+            inputShape_ = cave::loadValue<Shape>(in);
+        }
+        else
+        {
+            configs_.assign(transforms_.size(), LayerConfig());
+            inputShape_ = Shape();
+        }
+
+        if (in.peek() != std::ifstream::traits_type::eof())
+        {
+            runningMeans_ = cave::loadSerializableVector<Matrix>(in);
+            runningVariances_ = cave::loadSerializableVector<Matrix>(in);
+        }
+        else
+        {
+            runningMeans_.assign(weights_.size(), Matrix());
+            runningVariances_.assign(weights_.size(), Matrix());
+        }
+
         in.close();
 
+        invalidate();
+
         if (!in)
         {
             throw FileException("Unable to close file");
         }
     }
 
-    void NeuralNet::add(NeuralNet::Transform transform, int rows, int cols)
+    /*
+     * BATCHNORM running statistics are included, so data-parallel training
+     * averages them along with the weights.
+     */
+    int NeuralNet::parameterCount()
     {
-        if (transform == DENSE)
-        {
-            weightIndices_.push_back(transforms_.size());
+        int count = 0;
 
-            std::default_random_engine generator;
-            std::random_device rd;
-            generator.seed(rd());
-            std::normal_distribution<double> normal(0, 1);
+        for (std::size_t i = 0; i < weights_.size(); ++i)
+        {
+            count += weights_[i].rows() * weights_[i].cols();
+            count += biases_[i].rows() * biases_[i].cols();
+            count += runningMeans_[i].rows() + runningVariances_[i].rows();
+        }
 
-            if (cols == 0)
-            {
-                if (weights_.size() == 0)
-                {
-                    throw std::invalid_argument("Cols parameter must be supplied for first dense layer");
-                }
+        return count;
+    }
 
-                cols = weights_.back().rows();
-            }
+    /*
+     * Floating point operations for one item through the compiled network.
+     */
+    double NeuralNet::flops()
+    {
+        std::lock_guard<std::mutex> lock(mtxPlans_);
 
-            Matrix weight(rows, cols, [&]()
-                          { return scaleInitialWeights_ * normal(generator); });
+        if (!compiled_)
+        {
+            compileLocked();
+        }
 
-            Matrix bias(rows, 1);
+        double total = 0;
 
-            weights_.push_back(weight);
-            biases_.push_back(bias);
+        for (Operation &operation : operations_)
+        {
+            total += operation.flops;
         }
 
-        transforms_.push_back(transform);
+        return total;
     }
 
-    Matrix NeuralNet::loss(BatchResult &result, Matrix &expecteds)
+    /*
+     * Rows of input one item needs; 0 when the first layer accepts any size.
+     */
+    int NeuralNet::inputSize()
     {
-        Matrix &output = result.io.back();
+        std::lock_guard<std::mutex> lock(mtxPlans_);
 
-        auto losses = crossEntropy(output, expecteds);
+        if (!compiled_)
+        {
+            compileLocked();
+        }
 
-        return losses;
+        return operations_.front().inputSize;
     }
 
-    Matrix NeuralNet::predict(Matrix &input)
+    int NeuralNet::outputSize()
     {
-        Matrix in = input.clone();
+        std::lock_guard<std::mutex> lock(mtxPlans_);
 
-        if (weights_.size() > 0)
+        if (!compiled_)
         {
-            assert(input.rows() == weights_[0].cols());
+            compileLocked();
         }
 
-        BatchResult result;
-        runForwards(result, in);
-
-        return result.io.back();
+        return operations_.back().outputSize;
     }
 
-    BatchResult NeuralNet::runBatch(Matrix &input, Matrix &expected)
+    void NeuralNet::getParameters(double *out)
     {
-        BatchResult batchResult;
+        std::lock_guard<std::mutex> lock(mtxWeights_);
 
-        batchResult.numberItems = input.cols();
+        for (std::size_t i = 0; i < weights_.size(); ++i)
+        {
+            for (Matrix *m : {&weights_[i], &biases_[i], &runningMeans_[i], &runningVariances_[i]})
+            {
+                int size = m->rows() * m->cols();
 
-        runForwards(batchResult, input);
+                for (int j = 0; j < size; ++j)
+                {
+                    *out++ = (*m)[j];
+                }
+            }
+        }
+    }
 
-        runBackwards(batchResult, expected);
-        adjust(batchResult, learningRate_);
+    void NeuralNet::setParameters(const double *in)
+    {
+        std::lock_guard<std::mutex> lock(mtxWeights_);
 
-        batchResult.numberCorrect = numberCorrect(batchResult.io.back(), expected);
-        batchResult.totalLoss = crossEntropy(batchResult.io.back(), expected).rowSums().get(0);
+        for (std::size_t i = 0; i < weights_.size(); ++i)
+        {
+            for (Matrix *m : {&weights_[i], &biases_[i], &runningMeans_[i], &runningVariances_[i]})
+            {
+                int size = m->rows() * m->cols();
 
-        return batchResult;
+                for (int j = 0; j < size; ++j)
+                {
+                    (*m)[j] = *in++;
+                }
+            }
+        }
     }
 
-    void NeuralNet::runEpoch(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds)
+    /*
+     * Number of weights_/biases_ entries a transform owns. Recurrent layers
+     * keep their input and recurrent weights as two consecutive entries.
+     */
+    int NeuralNet::weightCount(Transform transform)
     {
-        double totalLoss = 0;
-        int totalCorrect = 0;
-        int totalItems = 0;
+        switch (transform)
+        {
+        case DENSE:
+        case CONV2D:
+        case BATCHNORM:
+            return 1;
+        case LSTM:
+        case GRU:
+            return 2;
+        default:
+            return 0;
+        }
+    }
 
-        int printDot = std::ceil(inputs.size() / 30);
+    /*
+     * The per-sample shape produced by layer, given the shape it receives.
+     * Recurrent layers read their input as channels steps of height x width
+     * features each.
+     */
+    NeuralNet::Shape NeuralNet::layerOutput(int layer, Shape input, int weightIndex)
+    {
+        switch (transforms_[layer])
+        {
+        case DENSE:
+            return Shape{weights_[weightIndex].rows(), 1, 1};
+        case CONV2D:
+        {
+            LayerConfig &config = configs_[layer];
 
-        cave::ThreadPool<BatchResult> threadPool(threads_);
+            Shape output;
+            output.channels = config.channels;
+            output.height = (input.height + 2 * config.padding - config.kernel) / config.stride + 1;
+            output.width = (input.width + 2 * config.padding - config.kernel) / config.stride + 1;
 
-        for (int i = 0; i < inputs.size(); ++i)
-        {
-            // clang-format off
-            threadPool.submit([this, i, &inputs, &expecteds]()
-            { 
-                return runBatch(inputs[i], expecteds[i]); 
-            });
-            // clang-format on
+            return output;
         }
+        case MAXPOOL:
+        case AVGPOOL:
+        {
+            LayerConfig &config = configs_[layer];
 
-        threadPool.start();
+            Shape output = input;
+            output.height = (input.height - config.kernel) / config.stride + 1;
+            output.width = (input.width - config.kernel) / config.stride + 1;
 
-        for (int i = 0; i < inputs.size(); ++i)
+            return output;
+        }
+        case LSTM:
+        case GRU:
         {
-            BatchResult result = threadPool.get();
+            LayerConfig &config = configs_[layer];
 
-            if (i % printDot == 0)
+            if (config.returnSequences)
             {
-                std::cout << "." << std::flush;
+                return Shape{input.channels, config.channels, 1};
             }
 
-            totalItems += result.numberItems;
-            totalCorrect += result.numberCorrect;
-            totalLoss += result.totalLoss;
+            return Shape{config.channels, 1, 1};
         }
+        default:
+            return input;
+        }
+    }
 
-        double averageLoss = totalLoss / totalItems;
+    /*
+     * The shape of the output of the last layer added so far, or of the
+     * network input if there are no layers yet.
+     */
+    NeuralNet::Shape NeuralNet::currentShape()
+    {
+        Shape shape = inputShape_;
 
-        std::cout << " Loss: " << averageLoss << " -- percent correct: "
-                  << ((100.0 * totalCorrect) / totalItems) << "%: ";
+        if (shape.channels == 0 && weights_.size() > 0 && transforms_[weightIndices_[0]] == DENSE)
+        {
+            shape = Shape{weights_[0].cols(), 1, 1};
+        }
+
+        int weightIndex = 0;
+
+        for (std::size_t i = 0; i < transforms_.size(); ++i)
+        {
+            shape = layerOutput(i, shape, weightIndex);
+            weightIndex += weightCount(transforms_[i]);
+        }
+
+        return shape;
     }
 
-    double NeuralNet::evaluate(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds)
+    void NeuralNet::setInputShape(int channels, int height, int width)
+    {
+        if (channels < 1 || height < 1 || width < 1)
+        {
+            throw std::invalid_argument("Input shape dimensions must be positive.");
+        }
+
+        if (!transforms_.empty())
+        {
+            throw std::logic_error("Input shape must be set before adding layers.");
+        }
+
+        inputShape_ = Shape{channels, height, width};
+        invalidate();
+    }
+
+    void NeuralNet::addConv2D(int channels, int kernelSize, int stride, int padding)
     {
-        int totalCorrect = 0;
-        int totalItems = 0;
+        if (channels < 1 || kernelSize < 1 || stride < 1 || padding < 0)
+        {
+            throw std::invalid_argument("Invalid CONV2D parameters.");
+        }
 
-        for (int i = 0; i < inputs.size(); ++i)
+        Shape input = currentShape();
+
+        if (input.channels == 0)
         {
-            BatchResult result = runBatch(inputs[i], expecteds[i]);
+            throw std::logic_error("Call setInputShape before adding a CONV2D layer.");
+        }
 
-            totalCorrect += result.numberCorrect;
-            totalItems += result.numberItems;
+        if (input.height + 2 * padding < kernelSize || input.width + 2 * padding < kernelSize)
+        {
+            throw std::invalid_argument("CONV2D kernel is larger than its padded input.");
         }
 
-        return double(totalCorrect) / totalItems;
+        LayerConfig config;
+        config.channels = channels;
+        config.kernel = kernelSize;
+        config.stride = stride;
+        config.padding = padding;
+
+        // One row of input.channels x kernel x kernel weights per output channel.
+        Matrix weight = initialWeights(channels, input.channels * kernelSize * kernelSize, weights_.size());
+
+        Matrix bias(channels, 1);
+
+        weightIndices_.push_back(transforms_.size());
+        weights_.push_back(weight);
+        biases_.push_back(bias);
+        runningMeans_.push_back(Matrix());
+        runningVariances_.push_back(Matrix());
+        configs_.push_back(config);
+        transforms_.push_back(CONV2D);
+        invalidate();
     }
 
-    void NeuralNet::fit(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds)
+    /*
+     * Adds a MAXPOOL or AVGPOOL layer over non-overlapping kernel x kernel
+     * windows by default; pass a smaller stride for overlapping windows.
+     */
+    void NeuralNet::addPool(NeuralNet::Transform transform, int kernelSize, int stride)
     {
-        auto timing = gProfiler.start("fit");
+        if (transform != MAXPOOL && transform != AVGPOOL)
+        {
+            throw std::invalid_argument("addPool requires MAXPOOL or AVGPOOL.");
+        }
 
-        learningRate_ = initialLearningRate_;
+        if (stride == 0)
+        {
+            stride = kernelSize;
+        }
 
-        if (weights_.size() > 0)
+        if (kernelSize < 1 || stride < 1)
         {
-            int inputSize = inputs[0].rows();
+            throw std::invalid_argument("Invalid pooling parameters.");
+        }
 
-            if (inputSize != weights_[0].cols())
-            {
-                std::stringstream ss;
+        Shape input = currentShape();
 
-                ss << "Input size is " << inputSize;
-                ss << " but first dense layer has " << weights_[0].cols();
-                ss << " columns; mismatch.";
-                throw std::logic_error(ss.str());
-            }
+        if (input.channels == 0)
+        {
+            throw std::logic_error("Call setInputShape before adding a pooling layer.");
         }
 
-        for (int epoch = 0; epoch < epochs_; ++epoch)
+        if (input.height < kernelSize || input.width < kernelSize)
         {
-            std::cout << "Epoch " << std::setw(3) << std::fixed << std::setprecision(2) << (epoch + 1) << " " << std::flush;
+            throw std::invalid_argument("Pooling kernel is larger than its input.");
+        }
 
-            auto start = std::chrono::high_resolution_clock::now();
+        LayerConfig config;
+        config.channels = input.channels;
+        config.kernel = kernelSize;
+        config.stride = stride;
 
-            runEpoch(inputs, expecteds);
+        configs_.push_back(config);
+        transforms_.push_back(transform);
+        invalidate();
+    }
 
-            auto finish = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(finish - start);
+    /*
+     * Normally distributed weights scaled by scaleInitialWeights_. Each weight
+     * entry draws from its own stream of the network's seed, so a given seed
+     * and architecture always start from the same weights.
+     */
+    Matrix NeuralNet::initialWeights(int rows, int cols, int weightIndex)
+    {
+        Matrix weight(rows, cols);
 
-            std::cout << std::setprecision(1)
-                      << duration.count() / 1000.0 << "s" << std::endl;
+        Philox(seed_).fillNormal(weight.data(), std::size_t(rows) * cols, Philox::stream(weightIndex));
 
-            learningRate_ -= (initialLearningRate_ - finalLearningRate_) / epochs_;
+        double *values = weight.data();
+
+        for (std::size_t i = 0; i < std::size_t(rows) * cols; ++i)
+        {
+            values[i] *= scaleInitialWeights_;
         }
 
-        gProfiler.end(timing);
+        return weight;
     }
 
-    void NeuralNet::runForwards(BatchResult &result, Matrix &input)
+    /*
+     * Zeroes each value with probability rate while training and scales the
+     * rest by 1 / (1 - rate); inference passes values through unchanged.
+     */
+    void NeuralNet::addDropout(double rate)
     {
-        auto timing = gProfiler.start("runForwards");
-        int weightIndex = 0;
+        if (rate < 0 || rate >= 1)
+        {
+            throw std::invalid_argument("Dropout rate must be in [0, 1).");
+        }
 
-        result.io.push_back(input);
+        LayerConfig config;
+        config.rate = rate;
 
-        auto timing1 = gProfiler.start("acquiring lock");
-        std::unique_lock<std::mutex> lock(mtxWeights_);
-        gProfiler.end(timing1);
-        auto weights(weights_);
-        lock.unlock();
+        configs_.push_back(config);
+        transforms_.push_back(DROPOUT);
+        invalidate();
+    }
 
-        int ioIndex = 0;
+    /*
+     * Adds an LSTM or GRU layer of hiddenSize units. It outputs the final
+     * hidden state, or the state after every step when returnSequences is
+     * set so that another recurrent layer can follow.
+     */
+    void NeuralNet::addRecurrent(NeuralNet::Transform transform, int hiddenSize, bool returnSequences)
+    {
+        if (transform != LSTM && transform != GRU)
+        {
+            throw std::invalid_argument("addRecurrent requires LSTM or GRU.");
+        }
 
-        for (Transform transform : transforms_)
+        if (hiddenSize < 1)
         {
-            Matrix &output = result.io.back();
+            throw std::invalid_argument("Recurrent layers need at least one hidden unit.");
+        }
 
-            switch (transform)
-            {
-            case DENSE:
-            {
-                Matrix &weight = weights_[weightIndex];
-                Matrix &bias = biases_[weightIndex];
+        Shape input = currentShape();
 
-                auto timing3 = gProfiler.start("weight * output");
-                Matrix multiplicationResult = weight * output;
-                gProfiler.end(timing3);
+        if (input.channels == 0)
+        {
+            throw std::logic_error("Call setInputShape before adding a recurrent layer.");
+        }
 
-                result.io.push_back(multiplicationResult);
+        int gates = transform == LSTM ? 4 : 3;
+        int features = input.height * input.width;
 
-                result.io.back().modify([&](int row, int col, int index, double value)
-                                        { return value + bias.get(row); });
+        LayerConfig config;
+        config.channels = hiddenSize;
+        config.returnSequences = returnSequences;
 
-                ++weightIndex;
-            }
-            break;
-            case RELU:
-                result.io.push_back(relu(output));
-                break;
-            case SOFTMAX:
-                result.io.push_back(softmax(output));
-                break;
+        // Gate blocks of hiddenSize rows: i, f, g, o for LSTM; r, z, n for GRU.
+        Matrix inputWeight = initialWeights(gates * hiddenSize, features, weights_.size());
+        Matrix recurrentWeight = initialWeights(gates * hiddenSize, hiddenSize, weights_.size() + 1);
+
+        Matrix inputBias(gates * hiddenSize, 1);
+
+        if (transform == LSTM)
+        {
+            // Start with the forget gate open so early gradients flow.
+            for (int row = hiddenSize; row < 2 * hiddenSize; ++row)
+            {
+                inputBias[row] = 1.0;
             }
+        }
 
-            ++ioIndex;
+        for (Matrix *weight : {&inputWeight, &recurrentWeight})
+        {
+            weightIndices_.push_back(transforms_.size());
+            weights_.push_back(*weight);
+            runningMeans_.push_back(Matrix());
+            runningVariances_.push_back(Matrix());
         }
 
-        gProfiler.end(timing);
+        biases_.push_back(inputBias);
+        biases_.push_back(Matrix(gates * hiddenSize, 1));
+
+        configs_.push_back(config);
+        transforms_.push_back(transform);
+        invalidate();
     }
 
-    void NeuralNet::runBackwards(BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    void NeuralNet::add(NeuralNet::Transform transform, int rows, int cols)
     {
-        auto timing = gProfiler.start("runBackwards");
-        auto &io = batchResult.io;
-
-        Matrix &output = io.back();
-
-        if (transforms_.back() != SOFTMAX)
+        if (transform == CONV2D)
         {
-            throw std::logic_error("Final transform must be SOFTMAX.");
+            throw std::invalid_argument("Use addConv2D to add a CONV2D layer.");
         }
 
-        auto weightIt = weights_.rbegin();
+        if (transform == MAXPOOL || transform == AVGPOOL)
+        {
+            throw std::invalid_argument("Use addPool to add a pooling layer.");
+        }
 
-        Matrix error;
+        if (transform == LSTM || transform == GRU)
+        {
+            throw std::invalid_argument("Use addRecurrent to add a recurrent layer.");
+        }
 
-        for (int i = transforms_.size() - 1; i >= 0; --i)
+        if (transform == DROPOUT)
         {
-            Transform transform = transforms_[i];
-            Matrix &input = io[i];
-            Matrix &output = io[i + 1];
+            throw std::invalid_argument("Use addDropout to add a DROPOUT layer.");
+        }
 
-            switch (transform)
-            {
-            case DENSE:
+        if (transform == DENSE)
+        {
+            if (cols == 0)
             {
-                Matrix &weight = *weightIt;
-                ++weightIt;
+                cols = currentShape().size();
 
-                if (bInputError || weightIt != weights_.rend())
-                {
-                    std::unique_lock<std::mutex> lock(mtxWeights_);
-                    Matrix transpose = weight.transpose();
-                    lock.unlock();
-                    error = transpose * batchResult.errors.front();
-                }
-                else
+                if (cols == 0)
                 {
-                    error = Matrix();
+                    throw std::invalid_argument("Cols parameter must be supplied for first dense layer");
                 }
             }
-            break;
-            case RELU:
 
-                // clang-format off
-                error = batchResult.errors.front().apply([&](int row, int col, int index, double value)
-                {
-                    if(input.get(row, col) < 0)
-                    {
-                        return 0.0;
-                    }
+            weightIndices_.push_back(transforms_.size());
 
-                    return value; 
-                });
-                // clang-format on
+            Matrix weight = initialWeights(rows, cols, weights_.size());
 
-                break;
-            case SOFTMAX:
-                assert(output.rows() == expecteds.rows() && "expecteds data has different size to output.");
+            Matrix bias(rows, 1);
 
-                error = output - expecteds;
-                break;
+            weights_.push_back(weight);
+            biases_.push_back(bias);
+            runningMeans_.push_back(Matrix());
+            runningVariances_.push_back(Matrix());
+        }
+
+        LayerConfig config;
+
+        if (transform == BATCHNORM)
+        {
+            // Normalizes each channel; a flat input has one channel per row.
+            config.channels = currentShape().channels;
+
+            if (config.channels == 0)
+            {
+                throw std::invalid_argument("BATCHNORM must follow a layer or an input shape.");
             }
 
-            batchResult.errors.push_front(error);
+            weightIndices_.push_back(transforms_.size());
+
+            // Scale (gamma) and shift (beta), trained like any other weights.
+            weights_.push_back(Matrix(config.channels, 1, []()
+                                      { return 1.0; }));
+            biases_.push_back(Matrix(config.channels, 1));
+            runningMeans_.push_back(Matrix(config.channels, 1));
+            runningVariances_.push_back(Matrix(config.channels, 1, []()
+                                               { return 1.0; }));
         }
 
-        gProfiler.end(timing);
+        transforms_.push_back(transform);
+        configs_.push_back(config);
+        invalidate();
     }
 
-    void NeuralNet::adjust(BatchResult &batchResult, double learningRate)
+    /*
+     * Folds each BATCHNORM that directly follows a DENSE or CONV2D layer into
+     * that layer's weights and biases using the running statistics, then
+     * removes it. Predictions are unchanged; training afterwards no longer
+     * normalizes those layers.
+     */
+    void NeuralNet::foldBatchNorm()
     {
-        auto timing = gProfiler.start("adjust");
+        std::lock_guard<std::mutex> lock(mtxWeights_);
 
-        for (std::size_t i = 0; i < weights_.size(); ++i)
-        {
-            int weightIndex = weightIndices_[i];
-
-            Matrix &error = batchResult.errors[weightIndex + 1];
-            Matrix &input = batchResult.io[weightIndex];
+        int weightIndex = 0;
+
+        for (std::size_t i = 0; i < transforms_.size(); ++i)
+        {
+            if (transforms_[i] != BATCHNORM)
+            {
+                weightIndex += weightCount(transforms_[i]);
+                continue;
+            }
+
+            if (i == 0 || (transforms_[i - 1] != DENSE && transforms_[i - 1] != CONV2D))
+            {
+                ++weightIndex;
+                continue;
+            }
+
+            Matrix &gamma = weights_[weightIndex];
+            Matrix &beta = biases_[weightIndex];
+            Matrix &mean = runningMeans_[weightIndex];
+            Matrix &variance = runningVariances_[weightIndex];
+
+            Matrix &weight = weights_[weightIndex - 1];
+            Matrix &bias = biases_[weightIndex - 1];
+
+            double *values = weight.data();
+            int cols = weight.cols();
+
+            for (int row = 0; row < weight.rows(); ++row)
+            {
+                double scale = gamma[row] / std::sqrt(variance[row] + batchNormEpsilon);
+
+                for (int col = 0; col < cols; ++col)
+                {
+                    values[row * cols + col] *= scale;
+                }
+
+                bias[row] = (bias[row] - mean[row]) * scale + beta[row];
+            }
+
+            weights_.erase(weights_.begin() + weightIndex);
+            biases_.erase(biases_.begin() + weightIndex);
+            runningMeans_.erase(runningMeans_.begin() + weightIndex);
+            runningVariances_.erase(runningVariances_.begin() + weightIndex);
+            weightIndices_.erase(weightIndices_.begin() + weightIndex);
+
+            for (std::size_t j = weightIndex; j < weightIndices_.size(); ++j)
+            {
+                --weightIndices_[j];
+            }
+
+            transforms_.erase(transforms_.begin() + i);
+            configs_.erase(configs_.begin() + i);
+            --i;
+        }
+
+        invalidate();
+    }
+
+    void NeuralNet::compile()
+    {
+        std::lock_guard<std::mutex> lock(mtxPlans_);
+
+        compileLocked();
+    }
+
+    /*
+     * Validates the shapes of the transform chain and resolves each layer's
+     * weights and io buffers once, so the per-batch passes only walk a flat
+     * list of operations. Kernels are chosen per batch size in plan().
+     */
+    void NeuralNet::compileLocked()
+    {
+        if (transforms_.empty())
+        {
+            throw std::logic_error("Cannot compile a network with no layers.");
+        }
+
+        operations_.clear();
+        plans_.clear();
+
+        if (configs_.size() != transforms_.size())
+        {
+            configs_.resize(transforms_.size());
+        }
+
+        Shape shape = inputShape_;
+
+        if (shape.channels == 0 && weights_.size() > 0 && transforms_[weightIndices_[0]] == DENSE)
+        {
+            shape = Shape{weights_[0].cols(), 1, 1};
+        }
+
+        int size = shape.size();
+        int weightIndex = 0;
+
+        for (std::size_t i = 0; i < transforms_.size(); ++i)
+        {
+            Operation operation;
+            operation.transform = transforms_[i];
+            operation.config = configs_[i];
+            operation.inputShape = shape;
+            operation.input = i;
+            operation.output = i + 1;
+            operation.inputSize = size;
+
+            switch (operation.transform)
+            {
+            case DENSE:
+            {
+                Matrix &weight = weights_[weightIndex];
+
+                if (size != 0 && weight.cols() != size)
+                {
+                    std::stringstream ss;
+                    ss << "Layer " << i << " (DENSE " << weight.rows() << " x " << weight.cols();
+                    ss << ") expects " << weight.cols() << " inputs but receives " << size << ".";
+                    throw std::logic_error(ss.str());
+                }
+
+                operation.weightIndex = weightIndex++;
+                operation.inputSize = weight.cols();
+                operation.outputSize = weight.rows();
+                operation.flops = 2.0 * weight.rows() * weight.cols();
+
+                if (size == 0)
+                {
+                    operation.inputShape = Shape{weight.cols(), 1, 1};
+                }
+            }
+            break;
+            case CONV2D:
+            {
+                Matrix &weight = weights_[weightIndex];
+                const LayerConfig &config = operation.config;
+
+                if (shape.channels == 0 || weight.cols() != shape.channels * config.kernel * config.kernel)
+                {
+                    std::stringstream ss;
+                    ss << "Layer " << i << " (CONV2D " << config.channels << " x " << config.kernel << "x" << config.kernel;
+                    ss << ") does not match its " << shape.channels << " input channels.";
+                    throw std::logic_error(ss.str());
+                }
+
+                Shape output = layerOutput(i, shape, weightIndex);
+
+                if (output.height < 1 || output.width < 1)
+                {
+                    std::stringstream ss;
+                    ss << "Layer " << i << " (CONV2D) input " << shape.height << "x" << shape.width << " is smaller than its kernel.";
+                    throw std::logic_error(ss.str());
+                }
+
+                operation.weightIndex = weightIndex++;
+                operation.outputSize = output.size();
+                operation.flops = 2.0 * weight.rows() * weight.cols() * output.height * output.width;
+            }
+            break;
+            case MAXPOOL:
+            case AVGPOOL:
+            {
+                const LayerConfig &config = operation.config;
+                Shape output = layerOutput(i, shape, -1);
+
+                if (shape.channels != config.channels || output.height < 1 || output.width < 1)
+                {
+                    std::stringstream ss;
+                    ss << "Layer " << i << " (" << transformNames_[operation.transform] << " " << config.kernel << "x" << config.kernel;
+                    ss << ") does not fit its " << shape.channels << " x " << shape.height << "x" << shape.width << " input.";
+                    throw std::logic_error(ss.str());
+                }
+
+                operation.outputSize = output.size();
+                operation.flops = double(output.size()) * config.kernel * config.kernel;
+            }
+            break;
+            case BATCHNORM:
+            {
+                Matrix &gamma = weights_[weightIndex];
+
+                if (gamma.rows() != shape.channels)
+                {
+                    std::stringstream ss;
+                    ss << "Layer " << i << " (BATCHNORM " << gamma.rows() << ") receives " << shape.channels << " channels.";
+                    throw std::logic_error(ss.str());
+                }
+
+                operation.weightIndex = weightIndex++;
+                operation.outputSize = size;
+                operation.flops = 4.0 * size;
+            }
+            break;
+            case LSTM:
+            case GRU:
+            {
+                Matrix &inputWeight = weights_[weightIndex];
+                Matrix &recurrentWeight = weights_[weightIndex + 1];
+                int hidden = operation.config.channels;
+                int gates = operation.transform == LSTM ? 4 : 3;
+                int steps = shape.channels;
+
+                if (steps == 0 || inputWeight.cols() != shape.height * shape.width ||
+                    inputWeight.rows() != gates * hidden || recurrentWeight.cols() != hidden)
+                {
+                    std::stringstream ss;
+                    ss << "Layer " << i << " (" << transformNames_[operation.transform] << " " << hidden << " x " << inputWeight.cols();
+                    ss << ") receives " << steps << " steps of " << shape.height * shape.width << " features.";
+                    throw std::logic_error(ss.str());
+                }
+
+                operation.weightIndex = weightIndex;
+                weightIndex += 2;
+                operation.outputSize = layerOutput(i, shape, operation.weightIndex).size();
+                operation.flops = 2.0 * steps * gates * hidden * (inputWeight.cols() + hidden) + 8.0 * steps * hidden;
+            }
+            break;
+            case RELU:
+            case DROPOUT:
+                operation.outputSize = size;
+                operation.flops = size;
+                break;
+            case SOFTMAX:
+                operation.outputSize = size;
+                operation.flops = 3.0 * size;
+                break;
+            }
+
+            operation.outputShape = layerOutput(i, operation.inputShape, operation.weightIndex);
+            shape = operation.outputShape;
+            size = operation.outputSize;
+            operations_.push_back(operation);
+        }
+
+        compiled_ = true;
+    }
+
+    /*
+     * Marks the compiled plans stale after a change to the layers or to
+     * how they run. Batches already running keep the plan they hold, but
+     * changes to the layers' weights themselves must still not overlap
+     * training or inference.
+     */
+    void NeuralNet::invalidate()
+    {
+        std::lock_guard<std::mutex> lock(mtxPlans_);
+
+        compiled_ = false;
+    }
+
+    std::shared_ptr<const NeuralNet::ExecutionPlan> NeuralNet::plan(int batchSize)
+    {
+        std::lock_guard<std::mutex> lock(mtxPlans_);
+
+        if (!compiled_)
+        {
+            compileLocked();
+        }
+
+        auto existing = plans_.find(batchSize);
+
+        if (existing != plans_.end())
+        {
+            return existing->second;
+        }
+
+        auto compiled = std::make_shared<ExecutionPlan>();
+        ExecutionPlan &plan = *compiled;
+        plan.batchSize = batchSize;
+        plan.buffers = operations_.size() + 1;
+        plan.operations = operations_;
+
+        for (Operation &operation : plan.operations)
+        {
+            switch (operation.transform)
+            {
+            case DENSE:
+                operation.forward = batchSize == 1 ? &NeuralNet::denseForwardVector : &NeuralNet::denseForward;
+                operation.backward = &NeuralNet::denseBackward;
+                break;
+            case CONV2D:
+                operation.forward = directConvolution_ && operation.config.kernel == 3 ? &NeuralNet::conv3x3Forward : &NeuralNet::convForward;
+                operation.backward = &NeuralNet::convBackward;
+                break;
+            case MAXPOOL:
+                operation.forward = &NeuralNet::maxPoolForward;
+                operation.backward = &NeuralNet::maxPoolBackward;
+                break;
+            case AVGPOOL:
+                operation.forward = &NeuralNet::avgPoolForward;
+                operation.backward = &NeuralNet::avgPoolBackward;
+                break;
+            case BATCHNORM:
+                operation.forward = &NeuralNet::batchNormForward;
+                operation.backward = &NeuralNet::batchNormBackward;
+                break;
+            case LSTM:
+                operation.forward = &NeuralNet::lstmForward;
+                operation.backward = &NeuralNet::lstmBackward;
+                break;
+            case GRU:
+                operation.forward = &NeuralNet::gruForward;
+                operation.backward = &NeuralNet::gruBackward;
+                break;
+            case DROPOUT:
+                operation.forward = &NeuralNet::dropoutForward;
+                operation.backward = &NeuralNet::dropoutBackward;
+                break;
+            case RELU:
+                operation.forward = &NeuralNet::reluForward;
+                operation.backward = &NeuralNet::reluBackward;
+                break;
+            case SOFTMAX:
+                operation.forward = &NeuralNet::softmaxForward;
+                operation.backward = &NeuralNet::softmaxBackward;
+                break;
+            }
+        }
+
+        plans_[batchSize] = compiled;
+
+        return compiled;
+    }
+
+    Matrix NeuralNet::loss(BatchResult &result, Matrix &expecteds)
+    {
+        Matrix &output = result.io.back();
+
+        auto losses = crossEntropy(output, expecteds);
+
+        return losses;
+    }
+
+    Matrix NeuralNet::predict(Matrix &input)
+    {
+        Matrix in = input.clone();
+
+        BatchResult result;
+        runForwards(result, in);
+
+        return result.io.back();
+    }
+
+    BatchResult NeuralNet::runBatch(Matrix &input, Matrix &expected, int batch)
+    {
+        BatchResult batchResult;
+        batchResult.epoch = currentEpoch_;
+        batchResult.batch = batch;
+
+        batchResult.numberItems = input.cols();
+
+        runForwards(batchResult, input, true);
+
+        // Checkpointing trades compute for memory, so it also applies each
+        // layer's gradients as soon as they are taken; otherwise the whole
+        // batch is applied at once, as before.
+        if (checkpointSegment_ > 0)
+        {
+            batchResult.learningRate = learningRate_;
+        }
+
+        runBackwards(batchResult, expected);
+
+        if (checkpointSegment_ <= 0)
+        {
+            adjust(batchResult, learningRate_);
+        }
+
+        batchResult.numberCorrect = numberCorrect(batchResult.io.back(), expected);
+        batchResult.totalLoss = crossEntropy(batchResult.io.back(), expected).rowSums().get(0);
+
+        // Results wait in the pool's queue; only the totals are read there.
+        batchResult.io.clear();
+        batchResult.errors.clear();
+        batchResult.poolIndices.clear();
+        batchResult.batchMeans.clear();
+        batchResult.batchVariances.clear();
+        batchResult.recurrentStates.clear();
+
+        return batchResult;
+    }
+
+    void NeuralNet::setNumaAware(bool numaAware)
+    {
+        if (numaAware)
+        {
+            topology_ = std::make_unique<Topology>();
+        }
+        else
+        {
+            topology_.reset();
+        }
+    }
+
+    void NeuralNet::setPipeline(int stages, int microBatches, PipelineSchedule schedule)
+    {
+        pipelineStages_ = stages;
+        pipelineLayers_.clear();
+        microBatches_ = microBatches;
+        pipelineSchedule_ = schedule;
+    }
+
+    void NeuralNet::setPipeline(std::vector<int> stageLayers, int microBatches, PipelineSchedule schedule)
+    {
+        pipelineStages_ = stageLayers.size();
+        pipelineLayers_ = stageLayers;
+        microBatches_ = microBatches;
+        pipelineSchedule_ = schedule;
+    }
+
+    void NeuralNet::runPipelinedEpoch(Dataset &data)
+    {
+        std::vector<int> stageLayers = pipelineLayers_;
+
+        if (stageLayers.empty())
+        {
+            stageLayers = Pipeline::balance(*this, pipelineStages_);
+        }
+
+        Pipeline pipeline(*this, stageLayers, microBatches_, pipelineSchedule_);
+
+        BatchResult result = pipeline.runEpoch(data);
+
+        std::cout << "Loss: " << result.totalLoss / result.numberItems << " -- percent correct: "
+                  << ((100.0 * result.numberCorrect) / result.numberItems) << "% -- stages busy:";
+
+        for (double utilization : pipeline.utilization())
+        {
+            std::cout << " " << std::setprecision(0) << 100.0 * utilization << "%";
+        }
+
+        std::cout << std::setprecision(2) << ": ";
+    }
+
+    void NeuralNet::runEpoch(Dataset &data)
+    {
+        if (pipelineStages_ > 1)
+        {
+            runPipelinedEpoch(data);
+            return;
+        }
+
+        BatchResult totals = runBatches(data, 0, data.batches(), true);
+
+        double averageLoss = totals.totalLoss / totals.numberItems;
+
+        std::cout << " Loss: " << averageLoss << " -- percent correct: "
+                  << ((100.0 * totals.numberCorrect) / totals.numberItems) << "%: ";
+
+        if (topology_ && topology_->nodes() > 1)
+        {
+            std::cout << std::setprecision(0) << "items/s per node:";
+
+            for (double throughput : nodeThroughput_)
+            {
+                std::cout << " " << throughput;
+            }
+
+            std::cout << std::setprecision(2) << ": ";
+        }
+    }
+
+    BatchResult NeuralNet::runBatches(Dataset &data, int first, int count, bool progress)
+    {
+        BatchResult totals;
+
+        int printDot = std::max(1, count / 30);
+
+        cave::ThreadPool<BatchResult> threadPool(threads_);
+
+        if (topology_)
+        {
+            threadPool.setTopology(*topology_);
+        }
+
+        for (int i = first; i < first + count; ++i)
+        {
+            // clang-format off
+            threadPool.submit([this, i, &data]()
+            { 
+                // Reused by every batch this thread runs; datasets that keep
+                // matrices ignore them.
+                thread_local Matrix inputBuffer;
+                thread_local Matrix expectedBuffer;
+
+                BatchResult result = runBatch(data.input(i, inputBuffer), data.expected(i, expectedBuffer), i);
+                result.node = Topology::currentNode();
+                return result;
+            }, i);
+            // clang-format on
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        threadPool.start();
+
+        std::vector<int> nodeItems(topology_ ? topology_->nodes() : 1);
+
+        for (int i = 0; i < count; ++i)
+        {
+            BatchResult result = threadPool.get();
+
+            if (progress && i % printDot == 0)
+            {
+                std::cout << "." << std::flush;
+            }
+
+            totals.numberItems += result.numberItems;
+            totals.numberCorrect += result.numberCorrect;
+            totals.totalLoss += result.totalLoss;
+
+            nodeItems[result.node] += result.numberItems;
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        nodeThroughput_.clear();
+
+        for (int items : nodeItems)
+        {
+            nodeThroughput_.push_back(items / elapsed.count());
+        }
+
+        return totals;
+    }
+
+    BatchResult NeuralNet::score(Dataset &data)
+    {
+        BatchResult totals;
+
+        Matrix inputBuffer;
+        Matrix expectedBuffer;
+
+        for (int i = 0; i < data.batches(); ++i)
+        {
+            Matrix &expected = data.expected(i, expectedBuffer);
+
+            BatchResult result;
+            runForwards(result, data.input(i, inputBuffer));
+
+            Matrix &output = result.io.back();
+
+            totals.numberItems += output.cols();
+            totals.numberCorrect += numberCorrect(output, expected);
+            totals.totalLoss += crossEntropy(output, expected).rowSums().get(0);
+
+            if (collectActivations_)
+            {
+                accumulateActivations(result);
+            }
+        }
+
+        return totals;
+    }
+
+    /*
+     * Adds each row's absolute activations to a running sum per io buffer.
+     * Buffers dropped by checkpointing are skipped and keep no statistics.
+     */
+    void NeuralNet::accumulateActivations(BatchResult &result)
+    {
+        if (activationSums_.size() != result.io.size())
+        {
+            activationSums_.assign(result.io.size(), Matrix());
+        }
+
+        for (std::size_t i = 0; i < result.io.size(); ++i)
+        {
+            Matrix &values = result.io[i];
+
+            if (values.rows() == 0)
+            {
+                continue;
+            }
+
+            Matrix &sums = activationSums_[i];
+
+            if (sums.rows() != values.rows())
+            {
+                sums = Matrix(values.rows(), 1);
+            }
+
+            const double *pValues = values.data();
+            int cols = values.cols();
+
+            for (int row = 0; row < values.rows(); ++row)
+            {
+                double total = 0;
+
+                for (int col = 0; col < cols; ++col)
+                {
+                    total += std::abs(pValues[row * cols + col]);
+                }
+
+                sums[row] += total;
+            }
+        }
+
+        activationItems_ += result.io[0].cols();
+    }
+
+    /*
+     * While enabled, evaluate() records the mean absolute value of every
+     * unit of every layer; enabling it clears earlier statistics.
+     */
+    void NeuralNet::setCollectActivations(bool collect)
+    {
+        collectActivations_ = collect;
+
+        if (collect)
+        {
+            activationSums_.clear();
+            activationItems_ = 0;
+        }
+    }
+
+    /*
+     * Indexed like BatchResult::io: entry 0 is the input, entry i + 1 the
+     * output of layer i.
+     */
+    std::vector<Matrix> NeuralNet::getActivationMeans()
+    {
+        std::vector<Matrix> means;
+
+        for (Matrix &sums : activationSums_)
+        {
+            means.push_back(activationItems_ > 0 ? (1.0 / activationItems_) * sums : sums);
+        }
+
+        return means;
+    }
+
+    double NeuralNet::evaluate(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds)
+    {
+        MatrixDataset data(inputs, expecteds);
+
+        return evaluate(data);
+    }
+
+    double NeuralNet::evaluate(Dataset &data)
+    {
+        BatchResult result = score(data);
+
+        return double(result.numberCorrect) / result.numberItems;
+    }
+
+    std::unique_ptr<NeuralNet> NeuralNet::snapshot()
+    {
+        auto copy = std::make_unique<NeuralNet>();
+
+        std::lock_guard<std::mutex> lock(mtxWeights_);
+
+        copy->transforms_ = transforms_;
+        copy->weights_ = weights_;
+        copy->biases_ = biases_;
+        copy->weightIndices_ = weightIndices_;
+        copy->runningMeans_ = runningMeans_;
+        copy->runningVariances_ = runningVariances_;
+        copy->batchNormMomentum_ = batchNormMomentum_;
+        copy->configs_ = configs_;
+        copy->inputShape_ = inputShape_;
+        copy->directConvolution_ = directConvolution_;
+        copy->scaleInitialWeights_ = scaleInitialWeights_;
+        copy->initialLearningRate_ = initialLearningRate_;
+        copy->finalLearningRate_ = finalLearningRate_;
+        copy->epochs_ = epochs_;
+        copy->seed_ = seed_;
+        copy->threads_ = threads_;
+
+        return copy;
+    }
+
+    void NeuralNet::setEarlyStopping(int patience, bool restoreBest)
+    {
+        patience_ = patience;
+        restoreBest_ = restoreBest;
+    }
+
+    void NeuralNet::fit(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds)
+    {
+        MatrixDataset data(inputs, expecteds);
+
+        train(data, nullptr);
+    }
+
+    void NeuralNet::fit(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds,
+                        std::vector<Matrix> &validationInputs, std::vector<Matrix> &validationExpecteds)
+    {
+        MatrixDataset data(inputs, expecteds);
+        MatrixDataset validation(validationInputs, validationExpecteds);
+
+        train(data, &validation);
+    }
+
+    void NeuralNet::fit(Dataset &data)
+    {
+        train(data, nullptr);
+    }
+
+    void NeuralNet::fit(Dataset &data, Dataset &validation)
+    {
+        train(data, &validation);
+    }
+
+    /*
+     * When validation data is supplied, each epoch's weights are scored on a
+     * background thread while the next epoch trains; the result is collected
+     * and reported at the end of that next epoch. Early stopping therefore
+     * reacts one epoch late, and the best snapshot is what gets kept.
+     */
+    void NeuralNet::train(Dataset &data, Dataset *validation)
+    {
+        auto timing = gProfiler.start("fit");
+
+        learningRate_ = initialLearningRate_;
+
+        if (weights_.size() > 0)
+        {
+            int inputSize = data.inputSize();
+            int expectedSize = plan(1)->operations.front().inputSize;
+
+            if (expectedSize != 0 && inputSize != expectedSize)
+            {
+                std::stringstream ss;
+
+                ss << "Input size is " << inputSize;
+                ss << " but first layer expects " << expectedSize;
+                ss << " rows; mismatch.";
+                throw std::logic_error(ss.str());
+            }
+        }
+
+        if (topology_)
+        {
+            data.firstTouch(*topology_);
+        }
+
+        std::unique_ptr<NeuralNet> validating;
+        std::future<BatchResult> validationResult;
+        int validatingEpoch = 0;
+
+        std::unique_ptr<NeuralNet> best;
+        double bestAccuracy = -1;
+        int bestEpoch = 0;
+
+        bool stop = false;
+
+        // Collects the pending validation result, if any, and updates the best
+        // snapshot and early stopping state.
+        auto collect = [&]()
+        {
+            if (!validationResult.valid())
+            {
+                return;
+            }
+
+            BatchResult result = validationResult.get();
+            double accuracy = double(result.numberCorrect) / result.numberItems;
+
+            std::cout << std::setprecision(2) << "validation (epoch " << validatingEpoch << "): "
+                      << result.totalLoss / result.numberItems << ", " << 100.0 * accuracy << "%";
+
+            if (accuracy > bestAccuracy)
+            {
+                bestAccuracy = accuracy;
+                bestEpoch = validatingEpoch;
+                best = std::move(validating);
+
+                if (!bestModelFile_.empty())
+                {
+                    best->save(bestModelFile_);
+                }
+            }
+            else if (patience_ > 0 && validatingEpoch - bestEpoch >= patience_)
+            {
+                stop = true;
+            }
+
+            validating.reset();
+        };
+
+        for (int epoch = 0; epoch < epochs_ && !stop; ++epoch)
+        {
+            std::cout << "Epoch " << std::setw(3) << std::fixed << std::setprecision(2) << (epoch + 1) << " " << std::flush;
+
+            currentEpoch_ = epoch;
+
+            auto start = std::chrono::high_resolution_clock::now();
+
+            data.beginEpoch(epoch);
+            runEpoch(data);
+
+            if (validationResult.valid())
+            {
+                collect();
+                std::cout << ": ";
+            }
+
+            if (validation != nullptr)
+            {
+                validating = snapshot();
+                validatingEpoch = epoch + 1;
+
+                NeuralNet *model = validating.get();
+
+                validationResult = std::async(std::launch::async, [model, validation]()
+                                              { return model->score(*validation); });
+            }
+
+            auto finish = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(finish - start);
+
+            std::cout << std::setprecision(1)
+                      << duration.count() / 1000.0 << "s" << std::endl;
+
+            learningRate_ -= (initialLearningRate_ - finalLearningRate_) / epochs_;
+        }
+
+        if (validationResult.valid())
+        {
+            std::cout << "Final ";
+            collect();
+            std::cout << std::endl;
+        }
+
+        if (stop)
+        {
+            std::cout << "Stopped early: no validation improvement for " << patience_ << " epochs." << std::endl;
+        }
+
+        if (best && restoreBest_)
+        {
+            std::cout << "Restoring weights from epoch " << bestEpoch << std::endl;
+
+            std::lock_guard<std::mutex> lock(mtxWeights_);
+            weights_ = best->weights_;
+            biases_ = best->biases_;
+            runningMeans_ = best->runningMeans_;
+            runningVariances_ = best->runningVariances_;
+        }
+
+        gProfiler.end(timing);
+    }
+
+    Matrix NeuralNet::denseForward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        Matrix &weight = weights_[operation.weightIndex];
+        Matrix &bias = biases_[operation.weightIndex];
+
+        auto timing = gProfiler.start("weight * output");
+        Matrix output = weight * input;
+        gProfiler.end(timing);
+
+        double *values = output.data();
+        int cols = output.cols();
+
+        for (int row = 0; row < output.rows(); ++row)
+        {
+            double value = bias[row];
+
+            for (int col = 0; col < cols; ++col)
+            {
+                values[row * cols + col] += value;
+            }
+        }
+
+        return output;
+    }
+
+    Matrix NeuralNet::denseForwardVector(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        Matrix output = multiplyVector(weights_[operation.weightIndex], input);
+        Matrix &bias = biases_[operation.weightIndex];
+
+        for (int row = 0; row < output.rows(); ++row)
+        {
+            output[row] += bias[row];
+        }
+
+        return output;
+    }
+
+    Matrix NeuralNet::reluForward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        return relu(input);
+    }
+
+    Matrix NeuralNet::softmaxForward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        return softmax(input);
+    }
+
+    Matrix NeuralNet::denseBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        int weightIndex = operation.weightIndex;
+        Matrix &input = batchResult.io[operation.input];
+        Matrix &outputError = batchResult.errors.front();
+
+        batchResult.biasGradients[weightIndex] = outputError.rowMeans();
+        batchResult.weightGradients[weightIndex] = (1.0 / input.cols()) * multiplyTransposed(outputError, input);
+
+        if (!bInputError && operation.input == 0)
+        {
+            return Matrix();
+        }
+
+        std::unique_lock<std::mutex> lock(mtxWeights_);
+        Matrix weight = weights_[weightIndex];
+        lock.unlock();
+
+        return transposeMultiply(weight, outputError);
+    }
+
+    /*
+     * Convolution as one matrix product: W (outChannels x inChannels*k*k)
+     * times the im2col patch matrix. The product's columns are ordered pixel
+     * by pixel, sample by sample, so it is written straight into the
+     * (outChannels * pixels) x items output through an outChannels x
+     * (pixels * items) view of it.
+     */
+    Matrix NeuralNet::convForward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        const LayerConfig &config = operation.config;
+        const Shape &in = operation.inputShape;
+        const Shape &out = operation.outputShape;
+        int items = input.cols();
+        int cols = out.height * out.width * items;
+
+        Matrix columns = im2col(input, in.channels, in.height, in.width, config.kernel, config.stride, config.padding);
+
+        Matrix output(operation.outputSize, items);
+        Tensor product = Tensor::view(output, {out.channels, cols});
+
+        auto timing = gProfiler.start("weight * im2col");
+        matmul(Tensor::view(weights_[operation.weightIndex]), Tensor::view(columns), product);
+        gProfiler.end(timing);
+
+        Matrix &bias = biases_[operation.weightIndex];
+
+        for (int channel = 0; channel < out.channels; ++channel)
+        {
+            double value = bias[channel];
+            double *values = product.address(channel, 0);
+
+            for (int col = 0; col < cols; ++col)
+            {
+                values[col] += value;
+            }
+        }
+
+        return output;
+    }
+
+    /*
+     * Direct 3x3 convolution without the im2col buffer; the innermost loop
+     * runs over the samples of the batch, which are contiguous.
+     */
+    Matrix NeuralNet::conv3x3Forward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        const int kernel = 3;
+
+        const LayerConfig &config = operation.config;
+        const Shape &in = operation.inputShape;
+        const Shape &out = operation.outputShape;
+        int items = input.cols();
+
+        Matrix &bias = biases_[operation.weightIndex];
+        Matrix output(operation.outputSize, items);
+
+        const Tensor weights = Tensor::view(weights_[operation.weightIndex], {out.channels, in.channels, kernel, kernel});
+        const Tensor image = Tensor::view(input, {in.channels, in.height, in.width, items});
+        Tensor result = Tensor::view(output, {out.channels, out.height, out.width, items});
+
+        for (int outChannel = 0; outChannel < out.channels; ++outChannel)
+        {
+            double *channelOutput = result.address(outChannel, 0, 0, 0);
+
+            std::fill(channelOutput, channelOutput + std::size_t(out.height) * out.width * items, bias[outChannel]);
+
+            for (int inChannel = 0; inChannel < in.channels; ++inChannel)
+            {
+                for (int ky = 0; ky < kernel; ++ky)
+                {
+                    for (int kx = 0; kx < kernel; ++kx)
+                    {
+                        double w = *weights.address(outChannel, inChannel, ky, kx);
+
+                        for (int oy = 0; oy < out.height; ++oy)
+                        {
+                            int iy = oy * config.stride - config.padding + ky;
+
+                            if (iy < 0 || iy >= in.height)
+                            {
+                                continue;
+                            }
+
+                            for (int ox = 0; ox < out.width; ++ox)
+                            {
+                                int ix = ox * config.stride - config.padding + kx;
+
+                                if (ix < 0 || ix >= in.width)
+                                {
+                                    continue;
+                                }
+
+                                const double *from = image.address(inChannel, iy, ix, 0);
+                                double *to = result.address(outChannel, oy, ox, 0);
+
+                                for (int n = 0; n < items; ++n)
+                                {
+                                    to[n] += w * from[n];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        return output;
+    }
+
+    Matrix NeuralNet::convBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        int weightIndex = operation.weightIndex;
+        const LayerConfig &config = operation.config;
+        const Shape &in = operation.inputShape;
+        const Shape &out = operation.outputShape;
+
+        Matrix &input = batchResult.io[operation.input];
+        int items = input.cols();
+        int cols = out.height * out.width * items;
+
+        // The forward product's layout: one row per output channel.
+        const Tensor outputError = Tensor::view(batchResult.errors.front(), {out.channels, cols});
+
+        Matrix columns = im2col(input, in.channels, in.height, in.width, config.kernel, config.stride, config.padding);
+        const Tensor patches = Tensor::view(columns);
+
+        Matrix biasGradient(out.channels, 1);
+
+        for (int channel = 0; channel < out.channels; ++channel)
+        {
+            const double *errors = outputError.address(channel, 0);
+            biasGradient[channel] = std::accumulate(errors, errors + cols, 0.0);
+        }
+
+        Matrix weightGradient(out.channels, columns.rows());
+        Tensor weightProduct = Tensor::view(weightGradient);
+        matmul(outputError, patches.permute({1, 0}), weightProduct);
+
+        batchResult.biasGradients[weightIndex] = (1.0 / items) * biasGradient;
+        batchResult.weightGradients[weightIndex] = (1.0 / items) * weightGradient;
+
+        if (!bInputError && operation.input == 0)
+        {
+            return Matrix();
+        }
+
+        std::unique_lock<std::mutex> lock(mtxWeights_);
+        Matrix weight = weights_[weightIndex];
+        lock.unlock();
+
+        Matrix columnErrors(columns.rows(), columns.cols());
+        Tensor columnProduct = Tensor::view(columnErrors);
+        matmul(Tensor::view(weight).permute({1, 0}), outputError, columnProduct);
+
+        return col2im(columnErrors, items, in.channels, in.height, in.width, config.kernel, config.stride, config.padding);
+    }
+
+    /*
+     * Each output keeps the input row its maximum came from in
+     * batchResult.poolIndices, so the backward pass is a scatter. All loops
+     * run innermost over the samples of the batch, which are contiguous.
+     */
+    Matrix NeuralNet::maxPoolForward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        const LayerConfig &config = operation.config;
+        const Shape &in = operation.inputShape;
+        const Shape &out = operation.outputShape;
+        int items = input.cols();
+
+        Matrix output(operation.outputSize, items);
+
+        if (int(batchResult.poolIndices.size()) <= operation.output)
+        {
+            batchResult.poolIndices.resize(operation.output + 1);
+        }
+
+        std::vector<int> &indices = batchResult.poolIndices[operation.output];
+        indices.resize(std::size_t(operation.outputSize) * items);
+
+        const Tensor image = Tensor::view(input, {in.channels, in.height, in.width, items});
+        Tensor result = Tensor::view(output, {out.channels, out.height, out.width, items});
+
+        for (int channel = 0; channel < out.channels; ++channel)
+        {
+            for (int oy = 0; oy < out.height; ++oy)
+            {
+                for (int ox = 0; ox < out.width; ++ox)
+                {
+                    double *to = result.address(channel, oy, ox, 0);
+                    int *index = indices.data() + (to - output.data());
+
+                    for (int ky = 0; ky < config.kernel; ++ky)
+                    {
+                        for (int kx = 0; kx < config.kernel; ++kx)
+                        {
+                            const double *from = image.address(channel, oy * config.stride + ky, ox * config.stride + kx, 0);
+                            int inputRow = (from - input.data()) / items;
+
+                            if (ky == 0 && kx == 0)
+                            {
+                                std::copy(from, from + items, to);
+                                std::fill(index, index + items, inputRow);
+                                continue;
+                            }
+
+                            for (int n = 0; n < items; ++n)
+                            {
+                                bool greater = from[n] > to[n];
+                                to[n] = greater ? from[n] : to[n];
+                                index[n] = greater ? inputRow : index[n];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        return output;
+    }
+
+    Matrix NeuralNet::avgPoolForward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        const LayerConfig &config = operation.config;
+        const Shape &in = operation.inputShape;
+        const Shape &out = operation.outputShape;
+        int items = input.cols();
+        double scale = 1.0 / (config.kernel * config.kernel);
+
+        Matrix output(operation.outputSize, items);
+
+        const Tensor image = Tensor::view(input, {in.channels, in.height, in.width, items});
+        Tensor result = Tensor::view(output, {out.channels, out.height, out.width, items});
+
+        for (int channel = 0; channel < out.channels; ++channel)
+        {
+            for (int oy = 0; oy < out.height; ++oy)
+            {
+                for (int ox = 0; ox < out.width; ++ox)
+                {
+                    double *to = result.address(channel, oy, ox, 0);
+
+                    for (int ky = 0; ky < config.kernel; ++ky)
+                    {
+                        for (int kx = 0; kx < config.kernel; ++kx)
+                        {
+                            const double *from = image.address(channel, oy * config.stride + ky, ox * config.stride + kx, 0);
+
+                            for (int n = 0; n < items; ++n)
+                            {
+                                to[n] += from[n];
+                            }
+                        }
+                    }
+
+                    for (int n = 0; n < items; ++n)
+                    {
+                        to[n] *= scale;
+                    }
+                }
+            }
+        }
+
+        return output;
+    }
+
+    Matrix NeuralNet::maxPoolBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        Matrix &outputError = batchResult.errors.front();
+        std::vector<int> &indices = batchResult.poolIndices[operation.output];
+        int items = outputError.cols();
+
+        Matrix inputError(operation.inputSize, items);
+
+        const double *errors = outputError.data();
+        double *target = inputError.data();
+
+        for (int row = 0; row < operation.outputSize; ++row)
+        {
+            const double *error = errors + std::size_t(row) * items;
+            const int *index = indices.data() + std::size_t(row) * items;
+
+            for (int n = 0; n < items; ++n)
+            {
+                target[std::size_t(index[n]) * items + n] += error[n];
+            }
+        }
+
+        return inputError;
+    }
+
+    Matrix NeuralNet::avgPoolBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        const LayerConfig &config = operation.config;
+        const Shape &in = operation.inputShape;
+        const Shape &out = operation.outputShape;
+
+        Matrix &outputError = batchResult.errors.front();
+        int items = outputError.cols();
+        double scale = 1.0 / (config.kernel * config.kernel);
+
+        Matrix inputError(operation.inputSize, items);
+
+        const Tensor errors = Tensor::view(outputError, {out.channels, out.height, out.width, items});
+        Tensor result = Tensor::view(inputError, {in.channels, in.height, in.width, items});
+
+        for (int channel = 0; channel < out.channels; ++channel)
+        {
+            for (int oy = 0; oy < out.height; ++oy)
+            {
+                for (int ox = 0; ox < out.width; ++ox)
+                {
+                    const double *error = errors.address(channel, oy, ox, 0);
+
+                    for (int ky = 0; ky < config.kernel; ++ky)
+                    {
+                        for (int kx = 0; kx < config.kernel; ++kx)
+                        {
+                            double *to = result.address(channel, oy * config.stride + ky, ox * config.stride + kx, 0);
+
+                            for (int n = 0; n < items; ++n)
+                            {
+                                to[n] += scale * error[n];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        return inputError;
+    }
+
+    /*
+     * Training normalizes each channel with its mean and variance over the
+     * batch, found in a single Welford pass and kept in the BatchResult for
+     * the backward pass. Otherwise the running statistics are used.
+     */
+    Matrix NeuralNet::batchNormForward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        int weightIndex = operation.weightIndex;
+        int channels = operation.inputShape.channels;
+        int pixels = operation.inputShape.height * operation.inputShape.width;
+        int items = input.cols();
+        std::size_t channelSize = std::size_t(pixels) * items;
+
+        Matrix &gamma = weights_[weightIndex];
+        Matrix &beta = biases_[weightIndex];
+
+        Matrix mean;
+        Matrix variance;
+
+        if (batchResult.training)
+        {
+            mean = Matrix(channels, 1);
+            variance = Matrix(channels, 1);
+
+            const double *values = input.data();
+
+            for (int channel = 0; channel < channels; ++channel)
+            {
+                const double *channelValues = values + channel * channelSize;
+
+                double runningMean = 0;
+                double sumSquares = 0;
+
+                for (std::size_t i = 0; i < channelSize; ++i)
+                {
+                    double delta = channelValues[i] - runningMean;
+                    runningMean += delta / (i + 1);
+                    sumSquares += delta * (channelValues[i] - runningMean);
+                }
+
+                mean[channel] = runningMean;
+                variance[channel] = sumSquares / channelSize;
+            }
+
+            if (int(batchResult.batchMeans.size()) <= operation.output)
+            {
+                batchResult.batchMeans.resize(operation.output + 1);
+                batchResult.batchVariances.resize(operation.output + 1);
+            }
+
+            batchResult.batchMeans[operation.output] = mean;
+            batchResult.batchVariances[operation.output] = variance;
+        }
+        else
+        {
+            mean = runningMeans_[weightIndex];
+            variance = runningVariances_[weightIndex];
+        }
+
+        Matrix output(operation.outputSize, items);
+
+        const double *source = input.data();
+        double *target = output.data();
+
+        for (int channel = 0; channel < channels; ++channel)
+        {
+            double scale = gamma[channel] / std::sqrt(variance[channel] + batchNormEpsilon);
+            double shift = beta[channel] - mean[channel] * scale;
+
+            const double *from = source + channel * channelSize;
+            double *to = target + channel * channelSize;
+
+            for (std::size_t i = 0; i < channelSize; ++i)
+            {
+                to[i] = from[i] * scale + shift;
+            }
+        }
+
+        return output;
+    }
+
+    /*
+     * Also folds the batch statistics into the running averages. This is done
+     * here rather than in the forward pass so that recomputing a checkpointed
+     * segment does not count a batch twice.
+     */
+    Matrix NeuralNet::batchNormBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        if (int(batchResult.batchMeans.size()) <= operation.output || batchResult.batchMeans[operation.output].rows() == 0)
+        {
+            throw std::logic_error("BATCHNORM backward pass needs a training forward pass.");
+        }
+
+        int weightIndex = operation.weightIndex;
+        int channels = operation.inputShape.channels;
+        int pixels = operation.inputShape.height * operation.inputShape.width;
+
+        Matrix &input = batchResult.io[operation.input];
+        Matrix &outputError = batchResult.errors.front();
+        Matrix &mean = batchResult.batchMeans[operation.output];
+        Matrix &variance = batchResult.batchVariances[operation.output];
+
+        int items = input.cols();
+        std::size_t channelSize = std::size_t(pixels) * items;
+
+        Matrix gammaGradient(channels, 1);
+        Matrix betaGradient(channels, 1);
+
+        std::unique_lock<std::mutex> lock(mtxWeights_);
+        Matrix gamma = weights_[weightIndex];
+        lock.unlock();
+
+        bool inputError = bInputError || operation.input != 0;
+        Matrix result = inputError ? Matrix(operation.inputSize, items) : Matrix();
+
+        for (int channel = 0; channel < channels; ++channel)
+        {
+            double inverseDeviation = 1.0 / std::sqrt(variance[channel] + batchNormEpsilon);
+
+            const double *x = input.data() + channel * channelSize;
+            const double *error = outputError.data() + channel * channelSize;
+
+            double errorSum = 0;
+            double errorNormalizedSum = 0;
+
+            for (std::size_t i = 0; i < channelSize; ++i)
+            {
+                errorSum += error[i];
+                errorNormalizedSum += error[i] * (x[i] - mean[channel]) * inverseDeviation;
+            }
+
+            gammaGradient[channel] = errorNormalizedSum / items;
+            betaGradient[channel] = errorSum / items;
+
+            if (inputError)
+            {
+                double *to = result.data() + channel * channelSize;
+                double factor = gamma[channel] * inverseDeviation / channelSize;
+
+                for (std::size_t i = 0; i < channelSize; ++i)
+                {
+                    double normalized = (x[i] - mean[channel]) * inverseDeviation;
+                    to[i] = factor * (channelSize * error[i] - errorSum - normalized * errorNormalizedSum);
+                }
+            }
+        }
+
+        batchResult.weightGradients[weightIndex] = gammaGradient;
+        batchResult.biasGradients[weightIndex] = betaGradient;
+
+        // Running variance uses the unbiased estimate, as for inference.
+        double correction = channelSize > 1 ? double(channelSize) / (channelSize - 1) : 1.0;
+
+        lock.lock();
+        Matrix &runningMean = runningMeans_[weightIndex];
+        Matrix &runningVariance = runningVariances_[weightIndex];
+
+        for (int channel = 0; channel < channels; ++channel)
+        {
+            runningMean[channel] += batchNormMomentum_ * (mean[channel] - runningMean[channel]);
+            runningVariance[channel] += batchNormMomentum_ * (correction * variance[channel] - runningVariance[channel]);
+        }
+
+        return result;
+    }
+
+    /*
+     * The input products for every gate and step come from one multiply.
+     * Each step then needs only one multiply by the fused 4-gate recurrent
+     * weights, followed by a single element-wise pass that applies the gate
+     * nonlinearities and updates the cell and hidden states. Activated gates
+     * and states are kept in BatchResult::recurrentStates for the backward
+     * pass.
+     */
+    Matrix NeuralNet::lstmForward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        int steps = operation.inputShape.channels;
+        int hidden = operation.config.channels;
+        int items = input.cols();
+        std::size_t width = std::size_t(steps) * items;
+        std::size_t stateWidth = width + items;
+
+        Matrix &recurrentWeight = weights_[operation.weightIndex + 1];
+        Matrix &inputBias = biases_[operation.weightIndex];
+        Matrix &recurrentBias = biases_[operation.weightIndex + 1];
+
+        auto timing = gProfiler.start("lstm input gates");
+        Matrix gates = weights_[operation.weightIndex] * sequenceToColumns(input, steps);
+        gProfiler.end(timing);
+
+        // Hidden and cell states; step 0 is the zero initial state.
+        Matrix states(hidden, stateWidth);
+        Matrix cells(hidden, stateWidth);
+        Matrix previous(hidden, items);
+
+        Tensor gateSteps = Tensor::view(gates, {4, hidden, steps, items});
+        Tensor stateSteps = Tensor::view(states, {hidden, steps + 1, items});
+        Tensor cellSteps = Tensor::view(cells, {hidden, steps + 1, items});
+        Tensor last = Tensor::view(previous);
+
+        for (int step = 0; step < steps; ++step)
+        {
+            Matrix recurrent = recurrentWeight * previous;
+            const Tensor recurrentGates = Tensor::view(recurrent, {4, hidden, items});
+
+            for (int unit = 0; unit < hidden; ++unit)
+            {
+                double *inputGate = gateSteps.address(0, unit, step, 0);
+                double *forgetGate = gateSteps.address(1, unit, step, 0);
+                double *cellGate = gateSteps.address(2, unit, step, 0);
+                double *outputGate = gateSteps.address(3, unit, step, 0);
+
+                const double *recurrentInput = recurrentGates.address(0, unit, 0);
+                const double *recurrentForget = recurrentGates.address(1, unit, 0);
+                const double *recurrentCell = recurrentGates.address(2, unit, 0);
+                const double *recurrentOutput = recurrentGates.address(3, unit, 0);
+
+                double inputOffset = inputBias[unit] + recurrentBias[unit];
+                double forgetOffset = inputBias[hidden + unit] + recurrentBias[hidden + unit];
+                double cellOffset = inputBias[2 * hidden + unit] + recurrentBias[2 * hidden + unit];
+                double outputOffset = inputBias[3 * hidden + unit] + recurrentBias[3 * hidden + unit];
+
+                const double *cellPrevious = cellSteps.address(unit, step, 0);
+                double *cell = cellSteps.address(unit, step + 1, 0);
+                double *state = stateSteps.address(unit, step + 1, 0);
+                double *carried = last.address(unit, 0);
+
+                for (int n = 0; n < items; ++n)
+                {
+                    double i = sigmoid(inputGate[n] + recurrentInput[n] + inputOffset);
+                    double f = sigmoid(forgetGate[n] + recurrentForget[n] + forgetOffset);
+                    double g = std::tanh(cellGate[n] + recurrentCell[n] + cellOffset);
+                    double o = sigmoid(outputGate[n] + recurrentOutput[n] + outputOffset);
+                    double c = f * cellPrevious[n] + i * g;
+                    double h = o * std::tanh(c);
+
+                    inputGate[n] = i;
+                    forgetGate[n] = f;
+                    cellGate[n] = g;
+                    outputGate[n] = o;
+                    cell[n] = c;
+                    state[n] = h;
+                    carried[n] = h;
+                }
+            }
+        }
+
+        if (int(batchResult.recurrentStates.size()) <= operation.output)
+        {
+            batchResult.recurrentStates.resize(operation.output + 1);
+        }
+
+        batchResult.recurrentStates[operation.output] = {gates, states, cells};
+
+        if (operation.config.returnSequences)
+        {
+            Matrix sequence(steps * hidden, items);
+            Tensor::view(sequence, {steps, hidden, items}).copy(stateSteps.slice(1, 1, steps).permute({1, 0, 2}));
+
+            return sequence;
+        }
+
+        return previous;
+    }
+
+    /*
+     * Backpropagation through time. The per-step gate error and the carried
+     * hidden and cell errors live in buffers allocated once per batch; the
+     * weight gradients for all steps are then two products.
+     */
+    Matrix NeuralNet::lstmBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        if (int(batchResult.recurrentStates.size()) <= operation.output || batchResult.recurrentStates[operation.output].empty())
+        {
+            throw std::logic_error("LSTM backward pass needs its forward pass states.");
+        }
+
+        int weightIndex = operation.weightIndex;
+        int steps = operation.inputShape.channels;
+        int hidden = operation.config.channels;
+
+        Matrix &input = batchResult.io[operation.input];
+        int items = input.cols();
+        std::size_t width = std::size_t(steps) * items;
+
+        std::vector<Matrix> &cache = batchResult.recurrentStates[operation.output];
+        Matrix &gates = cache[0];
+        Matrix &states = cache[1];
+        Matrix &cells = cache[2];
+
+        bool inputError = bInputError || operation.input != 0;
+
+        std::unique_lock<std::mutex> lock(mtxWeights_);
+        Matrix recurrentWeight = weights_[weightIndex + 1];
+        Matrix inputWeight = inputError ? weights_[weightIndex] : Matrix();
+        lock.unlock();
+
+        // A returned sequence's error is read in place, step by step.
+        Matrix &outputError = batchResult.errors.front();
+        const Tensor externalErrors = operation.config.returnSequences ? Tensor::view(outputError, {steps, hidden, items}) : Tensor::view(outputError, {1, hidden, items});
+
+        Matrix gateErrors(4 * hidden, width);
+        Matrix stepErrors(4 * hidden, items);
+        Matrix stateError(hidden, items);
+        Matrix cellError(hidden, items);
+
+        const Tensor gateSteps = Tensor::view(gates, {4, hidden, steps, items});
+        const Tensor cellSteps = Tensor::view(cells, {hidden, steps + 1, items});
+        Tensor gateErrorSteps = Tensor::view(gateErrors, {4, hidden, steps, items});
+        Tensor stepGateErrors = Tensor::view(stepErrors, {4, hidden, items});
+        Tensor cellCarries = Tensor::view(cellError);
+
+        for (int step = steps - 1; step >= 0; --step)
+        {
+            Tensor stateCarries = Tensor::view(stateError);
+
+            for (int unit = 0; unit < hidden; ++unit)
+            {
+                const double *external = nullptr;
+
+                if (operation.config.returnSequences)
+                {
+                    external = externalErrors.address(step, unit, 0);
+                }
+                else if (step == steps - 1)
+                {
+                    external = externalErrors.address(0, unit, 0);
+                }
+
+                const double *inputGate = gateSteps.address(0, unit, step, 0);
+                const double *forgetGate = gateSteps.address(1, unit, step, 0);
+                const double *cellGate = gateSteps.address(2, unit, step, 0);
+                const double *outputGate = gateSteps.address(3, unit, step, 0);
+
+                const double *cellPrevious = cellSteps.address(unit, step, 0);
+                const double *cell = cellSteps.address(unit, step + 1, 0);
+
+                double *stepInput = stepGateErrors.address(0, unit, 0);
+                double *stepForget = stepGateErrors.address(1, unit, 0);
+                double *stepCell = stepGateErrors.address(2, unit, 0);
+                double *stepOutput = stepGateErrors.address(3, unit, 0);
+
+                double *errorInput = gateErrorSteps.address(0, unit, step, 0);
+                double *errorForget = gateErrorSteps.address(1, unit, step, 0);
+                double *errorCell = gateErrorSteps.address(2, unit, step, 0);
+                double *errorOutput = gateErrorSteps.address(3, unit, step, 0);
+
+                double *stateCarry = stateCarries.address(unit, 0);
+                double *cellCarry = cellCarries.address(unit, 0);
+
+                for (int n = 0; n < items; ++n)
+                {
+                    double dh = stateCarry[n] + (external ? external[n] : 0.0);
+
+                    double i = inputGate[n];
+                    double f = forgetGate[n];
+                    double g = cellGate[n];
+                    double o = outputGate[n];
+                    double tanhCell = std::tanh(cell[n]);
+
+                    double dc = cellCarry[n] + dh * o * (1 - tanhCell * tanhCell);
+
+                    stepInput[n] = errorInput[n] = dc * g * i * (1 - i);
+                    stepForget[n] = errorForget[n] = dc * cellPrevious[n] * f * (1 - f);
+                    stepCell[n] = errorCell[n] = dc * i * (1 - g * g);
+                    stepOutput[n] = errorOutput[n] = dh * tanhCell * o * (1 - o);
+
+                    cellCarry[n] = dc * f;
+                }
+            }
+
+            stateError = transposeMultiply(recurrentWeight, stepErrors);
+        }
+
+        Matrix biasGradient = (1.0 / items) * gateErrors.rowSums();
+
+        batchResult.weightGradients[weightIndex] = (1.0 / items) * multiplyTransposed(gateErrors, sequenceToColumns(input, steps));
+        batchResult.weightGradients[weightIndex + 1] = (1.0 / items) * multiplyTransposed(gateErrors, states.columns(0, width));
+        batchResult.biasGradients[weightIndex] = biasGradient;
+        batchResult.biasGradients[weightIndex + 1] = biasGradient;
+
+        if (!inputError)
+        {
+            return Matrix();
+        }
+
+        return columnsToSequence(transposeMultiply(inputWeight, gateErrors), steps);
+    }
+
+    /*
+     * As lstmForward, with reset, update and candidate gates. The recurrent
+     * part of the candidate is kept as well, since the reset gate scales it.
+     */
+    Matrix NeuralNet::gruForward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        int steps = operation.inputShape.channels;
+        int hidden = operation.config.channels;
+        int items = input.cols();
+        std::size_t width = std::size_t(steps) * items;
+        std::size_t stateWidth = width + items;
+
+        Matrix &recurrentWeight = weights_[operation.weightIndex + 1];
+        Matrix &inputBias = biases_[operation.weightIndex];
+        Matrix &recurrentBias = biases_[operation.weightIndex + 1];
+
+        auto timing = gProfiler.start("gru input gates");
+        Matrix gates = weights_[operation.weightIndex] * sequenceToColumns(input, steps);
+        gProfiler.end(timing);
+
+        Matrix states(hidden, stateWidth);
+        Matrix candidates(hidden, width);
+        Matrix previous(hidden, items);
+
+        Tensor gateSteps = Tensor::view(gates, {3, hidden, steps, items});
+        Tensor stateSteps = Tensor::view(states, {hidden, steps + 1, items});
+        Tensor candidateSteps = Tensor::view(candidates, {hidden, steps, items});
+        Tensor last = Tensor::view(previous);
+
+        for (int step = 0; step < steps; ++step)
+        {
+            Matrix recurrent = recurrentWeight * previous;
+            const Tensor recurrentGates = Tensor::view(recurrent, {3, hidden, items});
+
+            for (int unit = 0; unit < hidden; ++unit)
+            {
+                double *resetGate = gateSteps.address(0, unit, step, 0);
+                double *updateGate = gateSteps.address(1, unit, step, 0);
+                double *candidateGate = gateSteps.address(2, unit, step, 0);
+
+                const double *recurrentReset = recurrentGates.address(0, unit, 0);
+                const double *recurrentUpdate = recurrentGates.address(1, unit, 0);
+                const double *recurrentCandidate = recurrentGates.address(2, unit, 0);
+
+                double resetOffset = inputBias[unit] + recurrentBias[unit];
+                double updateOffset = inputBias[hidden + unit] + recurrentBias[hidden + unit];
+                double candidateInputBias = inputBias[2 * hidden + unit];
+                double candidateRecurrentBias = recurrentBias[2 * hidden + unit];
+
+                double *candidate = candidateSteps.address(unit, step, 0);
+                double *carried = last.address(unit, 0);
+                double *state = stateSteps.address(unit, step + 1, 0);
+
+                for (int n = 0; n < items; ++n)
+                {
+                    double r = sigmoid(resetGate[n] + recurrentReset[n] + resetOffset);
+                    double z = sigmoid(updateGate[n] + recurrentUpdate[n] + updateOffset);
+                    double hiddenCandidate = recurrentCandidate[n] + candidateRecurrentBias;
+                    double c = std::tanh(candidateGate[n] + candidateInputBias + r * hiddenCandidate);
+                    double h = (1 - z) * c + z * carried[n];
+
+                    resetGate[n] = r;
+                    updateGate[n] = z;
+                    candidateGate[n] = c;
+                    candidate[n] = hiddenCandidate;
+                    state[n] = h;
+                    carried[n] = h;
+                }
+            }
+        }
+
+        if (int(batchResult.recurrentStates.size()) <= operation.output)
+        {
+            batchResult.recurrentStates.resize(operation.output + 1);
+        }
+
+        batchResult.recurrentStates[operation.output] = {gates, states, candidates};
+
+        if (operation.config.returnSequences)
+        {
+            Matrix sequence(steps * hidden, items);
+            Tensor::view(sequence, {steps, hidden, items}).copy(stateSteps.slice(1, 1, steps).permute({1, 0, 2}));
+
+            return sequence;
+        }
+
+        return previous;
+    }
+
+    Matrix NeuralNet::gruBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        if (int(batchResult.recurrentStates.size()) <= operation.output || batchResult.recurrentStates[operation.output].empty())
+        {
+            throw std::logic_error("GRU backward pass needs its forward pass states.");
+        }
+
+        int weightIndex = operation.weightIndex;
+        int steps = operation.inputShape.channels;
+        int hidden = operation.config.channels;
+
+        Matrix &input = batchResult.io[operation.input];
+        int items = input.cols();
+        std::size_t width = std::size_t(steps) * items;
+
+        std::vector<Matrix> &cache = batchResult.recurrentStates[operation.output];
+        Matrix &gates = cache[0];
+        Matrix &states = cache[1];
+        Matrix &candidates = cache[2];
+
+        bool inputError = bInputError || operation.input != 0;
+
+        std::unique_lock<std::mutex> lock(mtxWeights_);
+        Matrix recurrentWeight = weights_[weightIndex + 1];
+        Matrix inputWeight = inputError ? weights_[weightIndex] : Matrix();
+        lock.unlock();
+
+        // A returned sequence's error is read in place, step by step.
+        Matrix &outputError = batchResult.errors.front();
+        const Tensor externalErrors = operation.config.returnSequences ? Tensor::view(outputError, {steps, hidden, items}) : Tensor::view(outputError, {1, hidden, items});
+
+        // The candidate's recurrent part is scaled by the reset gate, so the
+        // input and recurrent weights see different gate errors.
+        Matrix gateErrors(3 * hidden, width);
+        Matrix recurrentErrors(3 * hidden, width);
+        Matrix stepErrors(3 * hidden, items);
+        Matrix stateError(hidden, items);
+
+        const Tensor gateSteps = Tensor::view(gates, {3, hidden, steps, items});
+        const Tensor stateSteps = Tensor::view(states, {hidden, steps + 1, items});
+        const Tensor candidateSteps = Tensor::view(candidates, {hidden, steps, items});
+        Tensor gateErrorSteps = Tensor::view(gateErrors, {3, hidden, steps, items});
+        Tensor recurrentErrorSteps = Tensor::view(recurrentErrors, {3, hidden, steps, items});
+        Tensor stepGateErrors = Tensor::view(stepErrors, {3, hidden, items});
+
+        for (int step = steps - 1; step >= 0; --step)
+        {
+            Tensor stateCarries = Tensor::view(stateError);
+
+            for (int unit = 0; unit < hidden; ++unit)
+            {
+                const double *external = nullptr;
+
+                if (operation.config.returnSequences)
+                {
+                    external = externalErrors.address(step, unit, 0);
+                }
+                else if (step == steps - 1)
+                {
+                    external = externalErrors.address(0, unit, 0);
+                }
+
+                const double *resetGate = gateSteps.address(0, unit, step, 0);
+                const double *updateGate = gateSteps.address(1, unit, step, 0);
+                const double *candidateGate = gateSteps.address(2, unit, step, 0);
+
+                const double *candidate = candidateSteps.address(unit, step, 0);
+                const double *statePrevious = stateSteps.address(unit, step, 0);
+
+                double *stepReset = stepGateErrors.address(0, unit, 0);
+                double *stepUpdate = stepGateErrors.address(1, unit, 0);
+                double *stepCandidate = stepGateErrors.address(2, unit, 0);
+
+                double *errorReset = gateErrorSteps.address(0, unit, step, 0);
+                double *errorUpdate = gateErrorSteps.address(1, unit, step, 0);
+                double *errorCandidate = gateErrorSteps.address(2, unit, step, 0);
+
+                double *recurrentReset = recurrentErrorSteps.address(0, unit, step, 0);
+                double *recurrentUpdate = recurrentErrorSteps.address(1, unit, step, 0);
+                double *recurrentCandidate = recurrentErrorSteps.address(2, unit, step, 0);
+
+                double *stateCarry = stateCarries.address(unit, 0);
+
+                for (int n = 0; n < items; ++n)
+                {
+                    double dh = stateCarry[n] + (external ? external[n] : 0.0);
+
+                    double r = resetGate[n];
+                    double z = updateGate[n];
+                    double c = candidateGate[n];
+
+                    double dCandidate = dh * (1 - z) * (1 - c * c);
+                    double dUpdate = dh * (statePrevious[n] - c) * z * (1 - z);
+                    double dReset = dCandidate * candidate[n] * r * (1 - r);
+
+                    errorReset[n] = recurrentReset[n] = stepReset[n] = dReset;
+                    errorUpdate[n] = recurrentUpdate[n] = stepUpdate[n] = dUpdate;
+                    errorCandidate[n] = dCandidate;
+                    recurrentCandidate[n] = stepCandidate[n] = dCandidate * r;
+
+                    stateCarry[n] = dh * z;
+                }
+            }
+
+            stateError = stateError + transposeMultiply(recurrentWeight, stepErrors);
+        }
+
+        batchResult.weightGradients[weightIndex] = (1.0 / items) * multiplyTransposed(gateErrors, sequenceToColumns(input, steps));
+        batchResult.weightGradients[weightIndex + 1] = (1.0 / items) * multiplyTransposed(recurrentErrors, states.columns(0, width));
+        batchResult.biasGradients[weightIndex] = (1.0 / items) * gateErrors.rowSums();
+        batchResult.biasGradients[weightIndex + 1] = (1.0 / items) * recurrentErrors.rowSums();
+
+        if (!inputError)
+        {
+            return Matrix();
+        }
+
+        return columnsToSequence(transposeMultiply(inputWeight, gateErrors), steps);
+    }
+
+    /*
+     * The keep mask is never stored: it is regenerated from the counter-based
+     * generator, keyed by epoch, batch and layer, in both passes. Masks are
+     * therefore the same whichever thread runs a batch.
+     */
+    Matrix NeuralNet::applyDropout(const Operation &operation, BatchResult &batchResult, const Matrix &values)
+    {
+        double rate = operation.config.rate;
+        double scale = 1.0 / (1.0 - rate);
+        std::uint64_t threshold = std::uint64_t(rate * 4294967296.0);
+
+        Philox philox(seed_);
+        std::uint64_t stream = Philox::stream(batchResult.epoch, batchResult.batch, operation.output);
+
+        std::size_t size = std::size_t(values.rows()) * values.cols();
+        Matrix result(values.rows(), values.cols());
+
+        const double *source = values.data();
+        double *target = result.data();
+        std::uint32_t words[4];
+
+        for (std::size_t i = 0; i < size; i += 4)
+        {
+            philox.block(stream, i / 4, words);
+
+            for (std::size_t lane = 0; lane < 4 && i + lane < size; ++lane)
+            {
+                target[i + lane] = words[lane] >= threshold ? source[i + lane] * scale : 0.0;
+            }
+        }
+
+        return result;
+    }
+
+    Matrix NeuralNet::dropoutForward(const Operation &operation, BatchResult &batchResult, Matrix &input)
+    {
+        if (!batchResult.training || operation.config.rate == 0)
+        {
+            return input;
+        }
+
+        return applyDropout(operation, batchResult, input);
+    }
+
+    Matrix NeuralNet::dropoutBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        if (!batchResult.training || operation.config.rate == 0)
+        {
+            return batchResult.errors.front();
+        }
+
+        return applyDropout(operation, batchResult, batchResult.errors.front());
+    }
+
+    Matrix NeuralNet::reluBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        Matrix &input = batchResult.io[operation.input];
+        Matrix error = batchResult.errors.front();
+
+        double *values = error.data();
+        const double *inputs = input.data();
+        int size = error.rows() * error.cols();
+
+        for (int i = 0; i < size; ++i)
+        {
+            if (inputs[i] < 0)
+            {
+                values[i] = 0.0;
+            }
+        }
+
+        return error;
+    }
+
+    Matrix NeuralNet::softmaxBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        Matrix &output = batchResult.io[operation.output];
+
+        assert(output.rows() == expecteds.rows() && "expecteds data has different size to output.");
+
+        return output - expecteds;
+    }
+
+    void NeuralNet::forwardLayer(BatchResult &batchResult, const Operation &operation)
+    {
+        Matrix &input = batchResult.io[operation.input];
+
+        batchResult.io[operation.output] = (this->*operation.forward)(operation, batchResult, input);
+    }
+
+    void NeuralNet::backwardLayer(BatchResult &batchResult, const Operation &operation, Matrix &expecteds, bool bInputError)
+    {
+        Matrix error = (this->*operation.backward)(operation, batchResult, expecteds, bInputError);
+
+        batchResult.errors.push_front(error);
+    }
+
+    /*
+     * With checkpointing enabled only every checkpointSegment_'th layer input
+     * is kept after the forward pass, together with the network input and the
+     * final output; everything in between is recomputed during runBackwards.
+     */
+    bool NeuralNet::isCheckpoint(int ioIndex)
+    {
+        if (checkpointSegment_ <= 0)
+        {
+            return true;
+        }
+
+        return ioIndex % checkpointSegment_ == 0 || ioIndex == int(transforms_.size());
+    }
+
+    /*
+     * Reruns the forward pass from the segment's checkpoint with the current
+     * weights. Layers below top have not been adjusted yet by this batch, so
+     * with one thread that reproduces the original activations. With more
+     * threads, other workers may already have updated those weights, and the
+     * gradients are then taken at the recomputed activations, not those of
+     * the original forward pass.
+     */
+    void NeuralNet::recomputeSegment(BatchResult &batchResult, const ExecutionPlan &plan, int top)
+    {
+        auto timing = gProfiler.start("recomputeSegment");
+        auto &io = batchResult.io;
+
+        int start = (top / checkpointSegment_) * checkpointSegment_;
+
+        for (int i = start; i < top; ++i)
+        {
+            const Operation &operation = plan.operations[i];
+
+            if (io[operation.output].rows() == 0)
+            {
+                forwardLayer(batchResult, operation);
+            }
+        }
+
+        gProfiler.end(timing);
+    }
+
+    /*
+     * Pooling indices, batch statistics and recurrent states are only read by
+     * the layer's own backward pass, so they go with its activations: a layer
+     * whose output is not a checkpoint gets them back from recomputeSegment.
+     */
+    void NeuralNet::releaseLayerState(BatchResult &batchResult, int ioIndex)
+    {
+        if (ioIndex < int(batchResult.poolIndices.size()))
+        {
+            std::vector<int>().swap(batchResult.poolIndices[ioIndex]);
+        }
+
+        if (ioIndex < int(batchResult.batchMeans.size()))
+        {
+            batchResult.batchMeans[ioIndex] = Matrix();
+            batchResult.batchVariances[ioIndex] = Matrix();
+        }
+
+        if (ioIndex < int(batchResult.recurrentStates.size()))
+        {
+            std::vector<Matrix>().swap(batchResult.recurrentStates[ioIndex]);
+        }
+    }
+
+    void NeuralNet::runForwards(BatchResult &result, Matrix &input, bool training)
+    {
+        auto timing = gProfiler.start("runForwards");
+
+        std::shared_ptr<const ExecutionPlan> compiled = this->plan(input.cols());
+        const ExecutionPlan &plan = *compiled;
+
+        result.io.assign(plan.buffers, Matrix());
+        result.io[0] = input;
+        result.training = training;
+
+        for (const Operation &operation : plan.operations)
+        {
+            forwardLayer(result, operation);
+
+            if (!isCheckpoint(operation.input))
+            {
+                result.io[operation.input] = Matrix();
+            }
+
+            if (!isCheckpoint(operation.output))
+            {
+                releaseLayerState(result, operation.output);
+            }
+        }
+
+        gProfiler.end(timing);
+    }
+
+    void NeuralNet::runBackwards(BatchResult &batchResult, Matrix &expecteds, bool bInputError)
+    {
+        auto timing = gProfiler.start("runBackwards");
+        auto &io = batchResult.io;
+
+        if (transforms_.back() != SOFTMAX)
+        {
+            throw std::logic_error("Final transform must be SOFTMAX.");
+        }
+
+        std::shared_ptr<const ExecutionPlan> compiled = this->plan(expecteds.cols());
+        const ExecutionPlan &plan = *compiled;
+
+        batchResult.weightGradients.resize(weights_.size());
+        batchResult.biasGradients.resize(weights_.size());
+
+        for (int i = plan.operations.size() - 1; i >= 0; --i)
+        {
+            const Operation &operation = plan.operations[i];
+
+            if (io[operation.input].rows() == 0)
+            {
+                recomputeSegment(batchResult, plan, i);
+            }
+
+            backwardLayer(batchResult, operation, expecteds, bInputError);
+
+            if (batchResult.learningRate > 0)
+            {
+                adjust(batchResult, batchResult.learningRate);
+            }
+
+            if (checkpointSegment_ > 0)
+            {
+                batchResult.errors.resize(1);
+                releaseLayerState(batchResult, operation.output);
+
+                if (!isCheckpoint(operation.output))
+                {
+                    io[operation.output] = Matrix();
+                }
+            }
+        }
+
+        gProfiler.end(timing);
+    }
+
+    void NeuralNet::adjust(BatchResult &batchResult, double learningRate)
+    {
+        auto timing = gProfiler.start("adjust");
+
+        // Gradients are released once applied, so calling this after each
+        // layer applies every gradient exactly once.
+        for (std::size_t i = 0; i < batchResult.weightGradients.size(); ++i)
+        {
+            if (batchResult.weightGradients[i].rows() == 0)
+            {
+                continue;
+            }
 
             std::unique_lock<std::mutex> lock(mtxWeights_);
-            biases_[i] -= learningRate * error.rowMeans();
-            weights_[i] -= (double(learningRate) / input.cols()) * (error * input.transpose());
+            biases_[i] -= learningRate * batchResult.biasGradients[i];
+            weights_[i] -= learningRate * batchResult.weightGradients[i];
             lock.unlock();
+
+            batchResult.weightGradients[i] = Matrix();
+            batchResult.biasGradients[i] = Matrix();
         }
 
         gProfiler.end(timing);
@@ -5,17 +5,41 @@
 #include <string>
 #include <deque>
 #include <mutex>
+#include <memory>
+#include <map>
 #include "matrix.h"
+#include "topology.h"
+#include "random.h"
+#include "dataset.h"
 
 namespace cave
 {
     class NeuralNetTest;
+    class Pipeline;
+    class MultiProcessTrainer;
+    class Pruner;
+    class Factorizer;
 
     struct BatchResult
     {
         std::vector<Matrix> io;
         std::deque<Matrix> errors;
+        std::vector<std::vector<int>> poolIndices;
+        std::vector<Matrix> batchMeans;
+        std::vector<Matrix> batchVariances;
+        std::vector<std::vector<Matrix>> recurrentStates;
 
+        bool training{false};
+        int epoch{0};
+        int batch{0};
+        std::vector<Matrix> weightGradients;
+        std::vector<Matrix> biasGradients;
+
+        // Nonzero applies each layer's gradients as soon as they are taken,
+        // so a batch holds at most one layer's worth at a time.
+        double learningRate{0};
+
+        int node{0};
         int numberItems{0};
         int numberCorrect{0};
         double totalLoss{0};
@@ -29,54 +53,238 @@ namespace cave
             DENSE = 0,
             RELU = 1,
             SOFTMAX = 2,
+            CONV2D = 3,
+            MAXPOOL = 4,
+            AVGPOOL = 5,
+            BATCHNORM = 6,
+            LSTM = 7,
+            GRU = 8,
+            DROPOUT = 9,
+        };
+
+        /*
+         * Layout of one sample within a column: channels x height x width,
+         * row-major. Dense layers produce a flat shape of size x 1 x 1.
+         */
+        struct Shape
+        {
+            int channels{0};
+            int height{1};
+            int width{1};
+
+            int size() const { return channels * height * width; }
+        };
+
+        /*
+         * Parameters of transforms that need more than rows and cols. Stored
+         * per transform, so it must stay plain data for saveValueVector.
+         */
+        struct LayerConfig
+        {
+            int channels{0};
+            int kernel{0};
+            int stride{1};
+            int padding{0};
+            bool returnSequences{false};
+            double rate{0};
+        };
+
+        enum PipelineSchedule
+        {
+            GPIPE = 0,
+            ONE_F_ONE_B = 1,
         };
+    private:
+        struct Operation;
+
+        typedef Matrix (NeuralNet::*ForwardKernel)(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        typedef Matrix (NeuralNet::*BackwardKernel)(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+
+        /*
+         * One step of a compiled plan: a transform with its weights, shapes,
+         * io buffer indices and kernels already resolved.
+         */
+        struct Operation
+        {
+            Transform transform{DENSE};
+            LayerConfig config;
+            Shape inputShape;
+            Shape outputShape;
+            int weightIndex{-1};
+            int inputSize{0};
+            int outputSize{0};
+            int input{0};
+            int output{0};
+            double flops{0};
+
+            ForwardKernel forward{nullptr};
+            BackwardKernel backward{nullptr};
+        };
+
+        struct ExecutionPlan
+        {
+            int batchSize{0};
+            int buffers{0};
+            std::vector<Operation> operations;
+        };
+
     private:
         std::mutex mtxWeights_;
+        std::mutex mtxPlans_;
 
-        std::vector<std::string> transformNames_{"DENSE", "RELU", "SOFTMAX"};
+        // Plans are shared with the batches running them, so recompiling
+        // never pulls a plan out from under a batch in flight.
+        bool compiled_{false};
+        std::vector<Operation> operations_;
+        std::map<int, std::shared_ptr<const ExecutionPlan>> plans_;
+
+        std::vector<std::string> transformNames_{"DENSE", "RELU", "SOFTMAX", "CONV2D", "MAXPOOL", "AVGPOOL", "BATCHNORM", "LSTM", "GRU", "DROPOUT"};
 
         std::vector<Matrix> weights_;
         std::vector<Matrix> biases_;
         std::vector<int> weightIndices_;
+        std::vector<Matrix> runningMeans_;
+        std::vector<Matrix> runningVariances_;
 
         std::vector<Transform> transforms_;
+        std::vector<LayerConfig> configs_;
+        Shape inputShape_;
+        bool directConvolution_{false};
 
         double scaleInitialWeights_{0.2};
         double initialLearningRate_{0.01};
         double finalLearningRate_{0.001};
         double learningRate_{0.01};
+        double batchNormMomentum_{0.1};
 
         int epochs_{20};
+        int currentEpoch_{0};
+        std::uint64_t seed_{Philox::randomSeed()};
         int threads_{4};
+        int checkpointSegment_{0};
+
+        int pipelineStages_{0};
+        std::vector<int> pipelineLayers_;
+        int microBatches_{4};
+        PipelineSchedule pipelineSchedule_{ONE_F_ONE_B};
+
+        int patience_{0};
+        bool restoreBest_{true};
+        std::string bestModelFile_;
+
+        std::unique_ptr<Topology> topology_;
+        std::vector<double> nodeThroughput_;
+
+        bool collectActivations_{false};
+        std::vector<Matrix> activationSums_;
+        int activationItems_{0};
 
     private: 
-        void runForwards(BatchResult &batchResult, Matrix &input);
+        static int weightCount(Transform transform);
+        Matrix initialWeights(int rows, int cols, int weightIndex);
+        Shape layerOutput(int layer, Shape input, int weightIndex);
+        Shape currentShape();
+        void compileLocked();
+        void invalidate();
+        std::shared_ptr<const ExecutionPlan> plan(int batchSize);
+
+        Matrix denseForward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix denseForwardVector(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix reluForward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix softmaxForward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix convForward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix conv3x3Forward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix maxPoolForward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix avgPoolForward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix batchNormForward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix lstmForward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix gruForward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix dropoutForward(const Operation &operation, BatchResult &batchResult, Matrix &input);
+        Matrix denseBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+        Matrix reluBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+        Matrix softmaxBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+        Matrix convBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+        Matrix maxPoolBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+        Matrix avgPoolBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+        Matrix batchNormBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+        Matrix lstmBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+        Matrix gruBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+        Matrix dropoutBackward(const Operation &operation, BatchResult &batchResult, Matrix &expecteds, bool bInputError);
+        Matrix applyDropout(const Operation &operation, BatchResult &batchResult, const Matrix &values);
+
+        void forwardLayer(BatchResult &batchResult, const Operation &operation);
+        void backwardLayer(BatchResult &batchResult, const Operation &operation, Matrix &expecteds, bool bInputError);
+        bool isCheckpoint(int ioIndex);
+        void recomputeSegment(BatchResult &batchResult, const ExecutionPlan &plan, int top);
+        void releaseLayerState(BatchResult &batchResult, int ioIndex);
+        void runForwards(BatchResult &batchResult, Matrix &input, bool training = false);
         void runBackwards(BatchResult &batchResult, Matrix &expecteds, bool bInputError = false);
         void adjust(BatchResult &batchResult, double learningRate);
         Matrix loss(BatchResult &result, Matrix &expecteds);
-        void runEpoch(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds);
-        BatchResult runBatch(Matrix &input, Matrix &expected);
+        void runEpoch(Dataset &data);
+        void train(Dataset &data, Dataset *validation);
+        BatchResult score(Dataset &data);
+        void accumulateActivations(BatchResult &result);
+        std::unique_ptr<NeuralNet> snapshot();
+        void write(std::string file);
+        BatchResult runBatches(Dataset &data, int first, int count, bool progress);
+        void runPipelinedEpoch(Dataset &data);
+        BatchResult runBatch(Matrix &input, Matrix &expected, int batch = 0);
 
     public:
         NeuralNet(){};
         NeuralNet(std::vector<int> layerSizes);
 
         void add(NeuralNet::Transform transform, int rows = 0, int cols = 0);
+        void setInputShape(int channels, int height, int width);
+        void addConv2D(int channels, int kernelSize, int stride = 1, int padding = 0);
+        void addPool(NeuralNet::Transform transform, int kernelSize, int stride = 0);
+        void addRecurrent(NeuralNet::Transform transform, int hiddenSize, bool returnSequences = false);
+        void addDropout(double rate);
+        void setSeed(std::uint64_t seed) { seed_ = seed; }
+        void setDirectConvolution(bool direct) { directConvolution_ = direct; invalidate(); }
+        void compile();
+        void foldBatchNorm();
+        void setBatchNormMomentum(double momentum) { batchNormMomentum_ = momentum; }
         void setScaleInitialWeights(double scale) { scaleInitialWeights_ = scale; };
         void setLearningRates(double initial, double final){ initialLearningRate_ = initial; finalLearningRate_ = final; };
         void fit(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds);
+        void fit(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds,
+                 std::vector<Matrix> &validationInputs, std::vector<Matrix> &validationExpecteds);
+        void fit(Dataset &data);
+        void fit(Dataset &data, Dataset &validation);
+        void setEarlyStopping(int patience, bool restoreBest = true);
+        void setBestModelFile(std::string file) { bestModelFile_ = file; }
         double evaluate(std::vector<Matrix> &inputs, std::vector<Matrix> &expecteds);
+        double evaluate(Dataset &data);
         Matrix predict(Matrix &input);
+        void setCollectActivations(bool collect);
+        std::vector<Matrix> getActivationMeans();
         void setEpochs(int epochs) { epochs_ = epochs; }
         std::vector<double> predict(std::vector<double> input);
         Matrix &getWeight(int i) { return weights_[i]; };
         Matrix &getBias(int i) { return biases_[i]; };
         void setThreads(int threads){ threads_ = threads;}
+        void setCheckpointSegment(int layers) { checkpointSegment_ = layers; }
+        void setNumaAware(bool numaAware);
+        std::vector<double> getNodeThroughput() { return nodeThroughput_; }
+        void setPipeline(int stages, int microBatches = 4, PipelineSchedule schedule = ONE_F_ONE_B);
+        void setPipeline(std::vector<int> stageLayers, int microBatches = 4, PipelineSchedule schedule = ONE_F_ONE_B);
+        int parameterCount();
+        double flops();
+        int inputSize();
+        int outputSize();
+        void getParameters(double *out);
+        void setParameters(const double *in);
         void save(std::string file);
         void load(std::string file);
 
         friend std::ostream &operator<<(std::ostream &out, NeuralNet &neuralNet);
 
         friend class cave::NeuralNetTest;
+        friend class cave::Pipeline;
+        friend class cave::MultiProcessTrainer;
+        friend class cave::Pruner;
+        friend class cave::Factorizer;
     };
 }
\ No newline at end of file
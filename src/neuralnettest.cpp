@@ -1,10 +1,88 @@
 #include <cmath>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <set>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "neuralnettest.h"
 #include "matrixfunctions.h"
+#include "pruner.h"
+#include "factorizer.h"
+#include "modelhandle.h"
+#include "prefetcher.h"
+#include "augmenter.h"
+#include "datacache.h"
+#include "idxfile.h"
+#include "idxdataset.h"
+#include "mnistloader.h"
+#include "pipeline.h"
+#include "multiprocesstrainer.h"
+#include "topology.h"
+#include "threadpool.h"
+#include "tensor.h"
+#include "server.h"
+
+#ifdef CAVE_ZLIB
+#include <zlib.h>
+#endif
 
 namespace cave
 {
+    namespace
+    {
+        bool identical(const Matrix &m1, const Matrix &m2)
+        {
+            return m1.rows() == m2.rows() && m1.cols() == m2.cols() &&
+                   std::equal(m1.data(), m1.data() + std::size_t(m1.rows()) * m1.cols(), m2.data());
+        }
+
+        /*
+         * The bytes of an IDX file: header, big-endian dimensions, then the
+         * elements, each stored big-endian as the format requires.
+         */
+        template <typename E>
+        std::vector<std::uint8_t> idxBytes(IdxFile::Type type, std::vector<std::uint32_t> dims, const std::vector<E> &elements)
+        {
+            std::vector<std::uint8_t> bytes = {0, 0, std::uint8_t(type), std::uint8_t(dims.size())};
+
+            auto append = [&](auto value)
+            {
+                std::uint8_t raw[sizeof(value)];
+                std::memcpy(raw, &value, sizeof(value));
+
+                for (int i = sizeof(value) - 1; i >= 0; --i)
+                {
+                    bytes.push_back(raw[i]);
+                }
+            };
+
+            for (std::uint32_t extent : dims)
+            {
+                append(extent);
+            }
+
+            for (E element : elements)
+            {
+                append(element);
+            }
+
+            return bytes;
+        }
+
+        void writeFile(const std::string &file, const std::vector<std::uint8_t> &bytes)
+        {
+            std::ofstream(file, std::ios::binary).write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+        }
+    }
 
     TestLoader NeuralNetTest::getTestLoader(int items)
     {
@@ -24,6 +102,96 @@ namespace cave
         neuralNet_.setLearningRates(0.02, 0.001);
     }
 
+    /*
+     * Compares every weight and bias gradient from runBackwards with a finite
+     * difference of the mean loss over the batch.
+     */
+    bool NeuralNetTest::parameterGradientsMatch(NeuralNet &neuralNet, Matrix &input, Matrix &expected, std::string name)
+    {
+        BatchResult result;
+        neuralNet.runForwards(result, input);
+        neuralNet.runBackwards(result, expected);
+
+        auto meanLoss = [&](Matrix &parameter)
+        {
+            BatchResult result;
+            neuralNet.runForwards(result, input);
+
+            double mean = crossEntropy(result.io.back(), expected).sum() / input.cols();
+
+            return Matrix(1, parameter.cols(), [&]() { return mean; });
+        };
+
+        for (std::size_t i = 0; i < neuralNet.weights_.size(); ++i)
+        {
+            for (bool bias : {false, true})
+            {
+                Matrix &parameter = bias ? neuralNet.biases_[i] : neuralNet.weights_[i];
+                Matrix &calculated = bias ? result.biasGradients[i] : result.weightGradients[i];
+
+                Matrix approximated = gradient(&parameter, [&]() { return meanLoss(parameter); });
+
+                bool matched = calculated.rows() == approximated.rows() && calculated.cols() == approximated.cols();
+                double largest = 0;
+
+                for (int j = 0; matched && j < calculated.rows() * calculated.cols(); ++j)
+                {
+                    largest = std::max(largest, std::abs(calculated[j]));
+                    matched = std::abs(calculated[j] - approximated[j]) <= 1e-4 + 1e-3 * std::abs(approximated[j]);
+                }
+
+                if (!matched || largest == 0)
+                {
+                    std::cerr << name << " " << (bias ? "bias" : "weight") << " " << i << " gradient: calculated and approximated don't match." << std::endl;
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    /*
+     * Compares the input error from runBackwards with a finite difference of
+     * the loss. A training pass may couple the items of a batch, as batch
+     * norm does, so it is compared against the gradient of the total loss.
+     */
+    bool NeuralNetTest::inputGradientMatches(NeuralNet &neuralNet, Matrix &input, Matrix &expected, std::string name, bool training)
+    {
+        BatchResult result;
+        neuralNet.runForwards(result, input, training);
+        neuralNet.runBackwards(result, expected, true);
+        Matrix &inputError = result.errors.front();
+
+        // clang-format off
+        Matrix approximatedError = gradient(&input, [&]()
+        {
+            BatchResult result;
+
+            neuralNet.runForwards(result, input, training);
+
+            Matrix loss = crossEntropy(result.io.back(), expected);
+
+            if (!training)
+            {
+                return loss;
+            }
+
+            double total = loss.sum();
+
+            return Matrix(1, input.cols(), [&]() { return total; });
+        });
+        // clang-format on
+
+        if (inputError != approximatedError)
+        {
+            std::cerr << name << " input error: calculated and approximated don't match." << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
     bool NeuralNetTest::all()
     {
 
@@ -33,13 +201,109 @@ namespace cave
         bool backpropPassed = testBackprop();
         std::cout << (backpropPassed ? "passed" : "failed") << std::endl;
 
+        std::cout << "Testing checkpointing ... " << std::flush;
+        bool checkpointingPassed = testCheckpointing();
+        std::cout << (checkpointingPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing pipeline ... " << std::flush;
+        bool pipelinePassed = testPipeline();
+        std::cout << (pipelinePassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing multi-process ... " << std::endl;
+        bool multiProcessPassed = testMultiProcess();
+        std::cout << (multiProcessPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing topology ... " << std::flush;
+        bool topologyPassed = testTopology();
+        std::cout << (topologyPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing early stopping ... " << std::endl;
+        bool earlyStoppingPassed = testEarlyStopping();
+        std::cout << (earlyStoppingPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing convolution ... " << std::flush;
+        bool convolutionPassed = testConvolution();
+        std::cout << (convolutionPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing pooling ... " << std::flush;
+        bool poolingPassed = testPooling();
+        std::cout << (poolingPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing batch norm ... " << std::flush;
+        bool batchNormPassed = testBatchNorm();
+        std::cout << (batchNormPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing recurrent ... " << std::flush;
+        bool recurrentPassed = testRecurrent();
+        std::cout << (recurrentPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing dropout ... " << std::flush;
+        bool dropoutPassed = testDropout();
+        std::cout << (dropoutPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing pruning ... " << std::flush;
+        bool pruningPassed = testPruning();
+        std::cout << (pruningPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing factorization ... " << std::flush;
+        bool factorizationPassed = testFactorization();
+        std::cout << (factorizationPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing hot swap ... " << std::flush;
+        bool hotSwapPassed = testHotSwap();
+        std::cout << (hotSwapPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing server ... " << std::flush;
+        bool serverPassed = testServer();
+        std::cout << (serverPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing dataset ... " << std::flush;
+        bool datasetPassed = testDataset();
+        std::cout << (datasetPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing prefetch ... " << std::flush;
+        bool prefetchPassed = testPrefetch();
+        std::cout << (prefetchPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing shuffle ... " << std::flush;
+        bool shufflePassed = testShuffle();
+        std::cout << (shufflePassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing augmentation ... " << std::flush;
+        bool augmentationPassed = testAugmentation();
+        std::cout << (augmentationPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing data cache ... " << std::flush;
+        bool dataCachePassed = testDataCache();
+        std::cout << (dataCachePassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing compressed IDX ... " << std::flush;
+        bool compressedIdxPassed = testCompressedIdx();
+        std::cout << (compressedIdxPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing IDX files ... " << std::endl;
+        bool idxFilePassed = testIdxFile();
+        std::cout << (idxFilePassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing out of core ... " << std::flush;
+        bool outOfCorePassed = testOutOfCore();
+        std::cout << (outOfCorePassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing synthetic data ... " << std::flush;
+        bool syntheticDataPassed = testSyntheticData();
+        std::cout << (syntheticDataPassed ? "passed" : "failed") << std::endl;
+
+        std::cout << "Testing tensor ... " << std::flush;
+        bool tensorPassed = testTensor();
+        std::cout << (tensorPassed ? "passed" : "failed") << std::endl;
+
         std::cout << "Testing adjust ... " << std::endl;
         neuralNet_.setEpochs(1);
         bool adjustPassed = testAdjust();
         std::cout << "\n"
                   << (adjustPassed ? "passed" : "failed") << std::endl;
 
-        bool passed = backpropPassed && adjustPassed;
+        bool passed = backpropPassed && checkpointingPassed && pipelinePassed && multiProcessPassed && topologyPassed && earlyStoppingPassed && convolutionPassed && poolingPassed && batchNormPassed && recurrentPassed && dropoutPassed && pruningPassed && factorizationPassed && hotSwapPassed && serverPassed && datasetPassed && prefetchPassed && shufflePassed && augmentationPassed && dataCachePassed && compressedIdxPassed && idxFilePassed && outOfCorePassed && syntheticDataPassed && tensorPassed && adjustPassed;
 
         if (passed)
         {
@@ -85,52 +349,1975 @@ namespace cave
         return false;
     }
 
-    bool NeuralNetTest::testBackprop()
+    bool NeuralNetTest::testCheckpointing()
     {
-        TestLoader loader = getTestLoader(1000);
+        TestLoader loader = getTestLoader(100);
 
         TrainingData data = loader.load();
 
         Matrix &input = data.input[0];
         Matrix &expected = data.expected[0];
-        BatchResult result;
 
-        neuralNet_.runForwards(result, input);
-        neuralNet_.runBackwards(result, data.expected[0], true);
-        Matrix &inputError = result.errors.front();
-        // clang-format off
-        Matrix approximatedError = gradient(&input, [&]()
+        BatchResult fullResult;
+        neuralNet_.runForwards(fullResult, input);
+        neuralNet_.runBackwards(fullResult, expected, true);
+
+        BatchResult checkpointResult;
+        neuralNet_.setCheckpointSegment(2);
+        neuralNet_.runForwards(checkpointResult, input);
+        neuralNet_.runBackwards(checkpointResult, expected, true);
+        neuralNet_.setCheckpointSegment(0);
+
+        for (std::size_t i = 0; i < fullResult.weightGradients.size(); ++i)
+        {
+            if (fullResult.weightGradients[i] != checkpointResult.weightGradients[i] ||
+                fullResult.biasGradients[i] != checkpointResult.biasGradients[i])
+            {
+                std::cerr << "Gradients for weight " << i << " differ with checkpointing." << std::endl;
+                return false;
+            }
+        }
+
+        if (fullResult.errors.front() != checkpointResult.errors.front())
+        {
+            std::cerr << "Input error differs with checkpointing." << std::endl;
+            return false;
+        }
+
+        // Pooling indices, batch statistics and recurrent states are dropped
+        // with the activations and rebuilt on the way down. Two segment
+        // lengths put every one of those layers inside a segment.
+        const int channels = 2;
+        const int height = 6;
+        const int width = 4;
+
+        NeuralNet neuralNet;
+        neuralNet.setInputShape(channels, height, width);
+        neuralNet.addConv2D(3, 3, 1, 1);
+        neuralNet.add(NeuralNet::RELU);
+        neuralNet.addPool(NeuralNet::MAXPOOL, 2);
+        neuralNet.add(NeuralNet::BATCHNORM);
+        neuralNet.addRecurrent(NeuralNet::LSTM, 5);
+        neuralNet.add(NeuralNet::DENSE, outputSize_);
+        neuralNet.add(NeuralNet::SOFTMAX);
+
+        TestLoader stateLoader(20, channels * height * width, outputSize_, 20);
+        TrainingData stateData = stateLoader.load();
+
+        Matrix &stateInput = stateData.input[0];
+        Matrix &stateExpected = stateData.expected[0];
+
+        BatchResult stateResult;
+        neuralNet.runForwards(stateResult, stateInput, true);
+        neuralNet.runBackwards(stateResult, stateExpected, true);
+
+        for (int segment : {2, 3})
+        {
+            BatchResult segmentResult;
+            neuralNet.setCheckpointSegment(segment);
+            neuralNet.runForwards(segmentResult, stateInput, true);
+
+            for (int i = 1; i < int(segmentResult.io.size()); ++i)
+            {
+                if (neuralNet.isCheckpoint(i))
+                {
+                    continue;
+                }
+
+                if ((i < int(segmentResult.poolIndices.size()) && !segmentResult.poolIndices[i].empty()) ||
+                    (i < int(segmentResult.batchMeans.size()) && segmentResult.batchMeans[i].rows() != 0) ||
+                    (i < int(segmentResult.recurrentStates.size()) && !segmentResult.recurrentStates[i].empty()))
+                {
+                    std::cerr << "Layer state " << i << " kept after the forward pass with segment " << segment << "." << std::endl;
+                    neuralNet.setCheckpointSegment(0);
+                    return false;
+                }
+            }
+
+            neuralNet.runBackwards(segmentResult, stateExpected, true);
+            neuralNet.setCheckpointSegment(0);
+
+            for (std::size_t i = 0; i < stateResult.weightGradients.size(); ++i)
+            {
+                if (stateResult.weightGradients[i] != segmentResult.weightGradients[i] ||
+                    stateResult.biasGradients[i] != segmentResult.biasGradients[i])
+                {
+                    std::cerr << "Gradients for weight " << i << " differ with segment " << segment << "." << std::endl;
+                    return false;
+                }
+            }
+
+            if (stateResult.errors.front() != segmentResult.errors.front())
+            {
+                std::cerr << "Input error differs with segment " << segment << "." << std::endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testPipeline()
+    {
+        auto createNet = [&]()
+        {
+            auto neuralNet = std::make_unique<NeuralNet>();
+            neuralNet->setSeed(17);
+            neuralNet->add(NeuralNet::DENSE, 12, inputSize_);
+            neuralNet->add(NeuralNet::RELU);
+            neuralNet->add(NeuralNet::DENSE, 8);
+            neuralNet->add(NeuralNet::RELU);
+            neuralNet->add(NeuralNet::DENSE, outputSize_);
+            neuralNet->add(NeuralNet::SOFTMAX);
+            neuralNet->learningRate_ = 0.1;
+
+            return neuralNet;
+        };
+
+        TestLoader loader(50, inputSize_, outputSize_, 10, 3);
+        TrainingData data = loader.load();
+        MatrixDataset dataset(data.input, data.expected);
+
+        // The mean gradient over a batch is the size-weighted mean of its
+        // micro-batch gradients, so one sequential step per batch is what
+        // the pipeline should apply.
+        std::unique_ptr<NeuralNet> sequential = createNet();
+
+        for (std::size_t i = 0; i < data.input.size(); ++i)
         {
             BatchResult result;
-            
-            neuralNet_.runForwards(result, input);
+            sequential->runForwards(result, data.input[i], true);
+            sequential->runBackwards(result, data.expected[i]);
+            sequential->adjust(result, sequential->learningRate_);
+        }
 
-            return crossEntropy(result.io.back(), expected); 
-        });
-        // clang-format on
+        auto maxDifference = [&](NeuralNet &neuralNet)
+        {
+            double difference = 0;
 
-        if (inputError != approximatedError)
+            auto compare = [&](Matrix &actual, Matrix &expected)
+            {
+                for (int j = 0; j < actual.rows() * actual.cols(); ++j)
+                {
+                    difference = std::max(difference, std::abs(actual[j] - expected[j]));
+                }
+            };
+
+            for (std::size_t i = 0; i < neuralNet.weights_.size(); ++i)
+            {
+                compare(neuralNet.weights_[i], sequential->weights_[i]);
+                compare(neuralNet.biases_[i], sequential->biases_[i]);
+            }
+
+            return difference;
+        };
+
+        if (maxDifference(*createNet()) < 1e-4)
         {
-            std::cerr << "Input error: calculated and approximated don't match." << std::endl;
+            std::cerr << "Sequential training did not change the weights." << std::endl;
+            return false;
+        }
 
-            std::cerr << "\nCalculated:\n"
-                      << inputError << std::endl;
-            std::cerr << "\nApproximated:\n"
-                      << approximatedError << std::endl;
+        for (NeuralNet::PipelineSchedule schedule : {NeuralNet::GPIPE, NeuralNet::ONE_F_ONE_B})
+        {
+            // Micro-batches of 3, 3, 3 and 1 items, over three stages.
+            std::unique_ptr<NeuralNet> pipelined = createNet();
+            Pipeline pipeline(*pipelined, {2, 3, 1}, 4, schedule);
+            BatchResult totals = pipeline.runEpoch(dataset);
+
+            if (totals.numberItems != 50 || maxDifference(*pipelined) > 1e-9)
+            {
+                std::cerr << (schedule == NeuralNet::GPIPE ? "GPipe" : "1F1B") << " training differs from sequential training." << std::endl;
+                return false;
+            }
+        }
+
+        // A batch that cannot be read stops every stage and reaches the caller.
+        class FailingDataset : public MatrixDataset
+        {
+        public:
+            using MatrixDataset::MatrixDataset;
+
+            bool failInput{false};
+
+            Matrix &input(int batch, Matrix &buffer)
+            {
+                if (failInput && batch == 2)
+                {
+                    throw FileException("Unreadable input batch.");
+                }
+
+                return MatrixDataset::input(batch, buffer);
+            }
+
+            Matrix &expected(int batch, Matrix &buffer)
+            {
+                if (!failInput && batch == 2)
+                {
+                    throw FileException("Label out of range.");
+                }
+
+                return MatrixDataset::expected(batch, buffer);
+            }
+        };
+
+        for (bool failInput : {true, false})
+        {
+            FailingDataset failing(data.input, data.expected);
+            failing.failInput = failInput;
+
+            std::unique_ptr<NeuralNet> pipelined = createNet();
+            Pipeline pipeline(*pipelined, {2, 3, 1}, 4, NeuralNet::ONE_F_ONE_B);
+
+            try
+            {
+                pipeline.runEpoch(failing);
+                std::cerr << "Pipeline ignored a failing " << (failInput ? "first" : "last") << " stage." << std::endl;
+                return false;
+            }
+            catch (const FileException &)
+            {
+            }
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testMultiProcess()
+    {
+        auto configure = [&](NeuralNet &neuralNet)
+        {
+            neuralNet.setSeed(5);
+            neuralNet.add(NeuralNet::DENSE, 20, inputSize_);
+            neuralNet.add(NeuralNet::RELU);
+            neuralNet.add(NeuralNet::DENSE, outputSize_);
+            neuralNet.add(NeuralNet::SOFTMAX);
+            neuralNet.setEpochs(4);
+            neuralNet.setThreads(1);
+            neuralNet.setLearningRates(0.05, 0.01);
+        };
+
+        NeuralNet neuralNet;
+        configure(neuralNet);
+
+        TestLoader loader(2000, inputSize_, outputSize_, 20, 9);
+        TrainingData data = loader.load();
+
+        double before = neuralNet.evaluate(data.input, data.expected);
+
+        // fit() checks that every worker finished with the averaged
+        // parameters, and throws if any differ.
+        try
+        {
+            MultiProcessTrainer trainer(neuralNet, 2);
+            trainer.setSyncInterval(5);
+            trainer.setTimeout(60);
+            trainer.fit(data.input, data.expected);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Multi-process training failed: " << e.what() << std::endl;
             return false;
         }
 
-        if (std::abs(inputError.sum()) < 0.0001)
+        double after = neuralNet.evaluate(data.input, data.expected);
+
+        if (after < before + 0.1)
         {
-            std::cout << "Input error contained only zero. Consider re-running test." << std::endl;
+            std::cerr << "Multi-process training did not improve accuracy: " << before << " to " << after << std::endl;
+            return false;
         }
 
-        if (inputError.cols() != approximatedError.cols())
+        // Reading the shards through a Dataset trains on the same batches.
+        NeuralNet datasetNet;
+        configure(datasetNet);
+
+        try
         {
-            std::cerr << "Calculated error has different number of columns to approximated error" << std::endl;
+            MatrixDataset dataset(data.input, data.expected);
+
+            MultiProcessTrainer trainer(datasetNet, 2);
+            trainer.setSyncInterval(5);
+            trainer.setTimeout(60);
+            trainer.fit(dataset);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Multi-process training from a dataset failed: " << e.what() << std::endl;
+            return false;
+        }
+
+        std::vector<double> parameters(neuralNet.parameterCount());
+        std::vector<double> datasetParameters(datasetNet.parameterCount());
+        neuralNet.getParameters(parameters.data());
+        datasetNet.getParameters(datasetParameters.data());
+
+        if (parameters != datasetParameters)
+        {
+            std::cerr << "Multi-process training from a dataset differs from training on matrices." << std::endl;
             return false;
         }
 
         return true;
     }
-}
\ No newline at end of file
+
+    bool NeuralNetTest::testTopology()
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+
+        int firstCpu = 0;
+
+        while (!CPU_ISSET(firstCpu, &allowed))
+        {
+            ++firstCpu;
+        }
+
+        std::string cpu = std::to_string(firstCpu);
+        std::filesystem::path root = "test_topology";
+
+        auto writeNode = [&](std::string name, std::string cpulist)
+        {
+            std::filesystem::create_directories(root / name);
+            std::ofstream(root / name / "cpulist") << cpulist << "\n";
+        };
+
+        // Nodes sort by number, not name; other entries are ignored.
+        writeNode("node10", cpu);
+        writeNode("node1", "0-3," + cpu);
+        writeNode("node0", cpu + ",1000-1002");
+        writeNode("node2", "1000");
+        writeNode("nodex", cpu);
+        std::ofstream(root / "possible") << "0-2\n";
+
+        bool passed = true;
+
+        {
+            Topology topology(root.string());
+
+            std::vector<int> second;
+
+            for (int id = 0; id <= 3; ++id)
+            {
+                if (CPU_ISSET(id, &allowed))
+                {
+                    second.push_back(id);
+                }
+            }
+
+            second.push_back(firstCpu);
+
+            // Node 2 has no CPU this process may use, so it is left out.
+            if (topology.nodes() != 3 || topology.cpus(0) != std::vector<int>{firstCpu} ||
+                topology.cpus(1) != second || topology.cpus(2) != std::vector<int>{firstCpu})
+            {
+                std::cerr << "Topology read the wrong nodes from a node directory." << std::endl;
+                passed = false;
+            }
+        }
+
+        std::filesystem::remove(root / "node10" / "cpulist");
+        std::filesystem::remove(root / "node10");
+
+        Topology topology(root.string());
+
+        if (Topology(root.string() + "/missing").nodes() != 1 || topology.nodes() != 2)
+        {
+            std::cerr << "Topology without a node directory is not one node." << std::endl;
+            passed = false;
+        }
+
+        Topology second = topology.only(1);
+
+        if (second.nodes() != 1 || second.cpus(0) != topology.cpus(1))
+        {
+            std::cerr << "Topology of a single node has the wrong CPUs." << std::endl;
+            passed = false;
+        }
+
+        // Binding sets the mask of the calling thread, so bind one that
+        // exits rather than the test's own.
+        bool bound = false;
+
+        // clang-format off
+        std::thread([&]()
+        {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+
+            bound = topology.bind(0) && sched_getaffinity(0, sizeof(mask), &mask) == 0 &&
+                    CPU_COUNT(&mask) == 1 && CPU_ISSET(firstCpu, &mask);
+        }).join();
+        // clang-format on
+
+        if (!bound)
+        {
+            std::cerr << "Binding to a node did not restrict the CPUs." << std::endl;
+            passed = false;
+        }
+
+        // A single worker belongs to node 0 and has to steal all of node
+        // 1's work; with three, each node has a worker.
+        for (int threads : {1, 3})
+        {
+            const int tasks = 50;
+
+            ThreadPool<int> threadPool(threads);
+            threadPool.setTopology(topology);
+
+            std::atomic<int> ranOnNode[2] = {{0}, {0}};
+
+            for (int i = 0; i < tasks; ++i)
+            {
+                // clang-format off
+                threadPool.submit([i, &ranOnNode]()
+                {
+                    ++ranOnNode[Topology::currentNode()];
+                    return i;
+                }, i);
+                // clang-format on
+            }
+
+            threadPool.start();
+
+            std::set<int> results;
+
+            for (int i = 0; i < tasks; ++i)
+            {
+                results.insert(threadPool.get());
+            }
+
+            if (int(results.size()) != tasks || *results.rbegin() != tasks - 1 ||
+                ranOnNode[0] + ranOnNode[1] != tasks || (threads == 1 && ranOnNode[0] != tasks))
+            {
+                std::cerr << "Thread pool with " << threads << " threads did not run every task." << std::endl;
+                passed = false;
+            }
+        }
+
+        std::filesystem::remove_all(root);
+
+        return passed;
+    }
+
+    bool NeuralNetTest::testEarlyStopping()
+    {
+        /*
+         * Gives the real inputs on the first pass only, then zeros, so no
+         * model validated after the first epoch can improve on it.
+         */
+        class FirstPassDataset : public MatrixDataset
+        {
+        public:
+            using MatrixDataset::MatrixDataset;
+
+            std::atomic<int> passes{0};
+
+            Matrix &input(int batch, Matrix &buffer)
+            {
+                passes += batch == 0;
+
+                Matrix &input = MatrixDataset::input(batch, buffer);
+
+                if (passes == 1)
+                {
+                    return input;
+                }
+
+                buffer = Matrix(input.rows(), input.cols());
+                return buffer;
+            }
+        };
+
+        auto createNet = [&]()
+        {
+            auto neuralNet = std::make_unique<NeuralNet>();
+            neuralNet->setSeed(3);
+            neuralNet->add(NeuralNet::DENSE, 20, inputSize_);
+            neuralNet->add(NeuralNet::RELU);
+            neuralNet->add(NeuralNet::DENSE, outputSize_);
+            neuralNet->add(NeuralNet::SOFTMAX);
+            neuralNet->setThreads(1);
+            neuralNet->setLearningRates(0.05, 0.01);
+            neuralNet->setEpochs(10);
+
+            return neuralNet;
+        };
+
+        TrainingData training = TestLoader(1000, inputSize_, outputSize_, 20, 4).load();
+        TrainingData validation = TestLoader(200, inputSize_, outputSize_, 20, 5).load();
+
+        MatrixDataset trainingData(training.input, training.expected);
+        FirstPassDataset validationData(validation.input, validation.expected);
+
+        const int patience = 2;
+
+        std::unique_ptr<NeuralNet> stopped = createNet();
+        stopped->setEarlyStopping(patience);
+        stopped->fit(trainingData, validationData);
+
+        // Epoch 1 is the best. Its lack of improvement is known by the end
+        // of epoch 1 + patience; one more epoch runs while that epoch's
+        // validation is scored, and every epoch is validated.
+        if (validationData.passes != patience + 2)
+        {
+            std::cerr << "Early stopping ran " << validationData.passes << " epochs, not " << patience + 2 << "." << std::endl;
+            return false;
+        }
+
+        // The learning rate only changes after an epoch, so one epoch of
+        // the same net gives the best snapshot's weights.
+        std::unique_ptr<NeuralNet> firstEpoch = createNet();
+        firstEpoch->setEpochs(1);
+        firstEpoch->fit(trainingData);
+
+        for (std::size_t i = 0; i < stopped->weights_.size(); ++i)
+        {
+            if (!identical(stopped->weights_[i], firstEpoch->weights_[i]) || !identical(stopped->biases_[i], firstEpoch->biases_[i]))
+            {
+                std::cerr << "Early stopping did not restore the best epoch's weights." << std::endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testConvolution()
+    {
+        const int channels = 2;
+        const int height = 5;
+        const int width = 4;
+
+        NeuralNet neuralNet;
+        neuralNet.setInputShape(channels, height, width);
+        neuralNet.addConv2D(3, 3, 1, 1);
+        neuralNet.add(NeuralNet::RELU);
+        neuralNet.addConv2D(2, 2, 2);
+        neuralNet.add(NeuralNet::DENSE, outputSize_);
+        neuralNet.add(NeuralNet::SOFTMAX);
+
+        TestLoader loader(20, channels * height * width, outputSize_, 20);
+        TrainingData data = loader.load();
+
+        Matrix &input = data.input[0];
+        Matrix &expected = data.expected[0];
+
+        if (!inputGradientMatches(neuralNet, input, expected, "Convolution") ||
+            !parameterGradientsMatch(neuralNet, input, expected, "Convolution"))
+        {
+            return false;
+        }
+
+        BatchResult result;
+        neuralNet.runForwards(result, input);
+
+        BatchResult direct;
+        neuralNet.setDirectConvolution(true);
+        neuralNet.runForwards(direct, input);
+        neuralNet.setDirectConvolution(false);
+
+        if (direct.io.back() != result.io.back())
+        {
+            std::cerr << "Direct and im2col convolution outputs differ." << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testPooling()
+    {
+        const int channels = 2;
+        const int height = 6;
+        const int width = 4;
+
+        NeuralNet neuralNet;
+        neuralNet.setInputShape(channels, height, width);
+        neuralNet.addConv2D(3, 3, 1, 1);
+        neuralNet.addPool(NeuralNet::MAXPOOL, 2);
+        neuralNet.add(NeuralNet::RELU);
+        neuralNet.addPool(NeuralNet::AVGPOOL, 2, 1);
+        neuralNet.add(NeuralNet::DENSE, outputSize_);
+        neuralNet.add(NeuralNet::SOFTMAX);
+
+        TestLoader loader(20, channels * height * width, outputSize_, 20);
+        TrainingData data = loader.load();
+
+        Matrix &input = data.input[0];
+        Matrix &expected = data.expected[0];
+
+        if (!inputGradientMatches(neuralNet, input, expected, "Pooling"))
+        {
+            return false;
+        }
+
+        // Pooling has no parameters of its own; this checks the gradients
+        // it routes to the convolution below it and the dense layer above.
+        if (!parameterGradientsMatch(neuralNet, input, expected, "Pooling"))
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testBatchNorm()
+    {
+        NeuralNet neuralNet;
+        neuralNet.add(NeuralNet::DENSE, 20, inputSize_);
+        neuralNet.add(NeuralNet::BATCHNORM);
+        neuralNet.add(NeuralNet::RELU);
+        neuralNet.add(NeuralNet::DENSE, outputSize_);
+        neuralNet.add(NeuralNet::SOFTMAX);
+
+        TestLoader loader(200, inputSize_, outputSize_, 20);
+        TrainingData data = loader.load();
+
+        Matrix &input = data.input[0];
+        Matrix &expected = data.expected[0];
+
+        // Every sample's loss depends on every input through the batch
+        // statistics, which a training pass uses.
+        if (!inputGradientMatches(neuralNet, input, expected, "Batch norm", true))
+        {
+            return false;
+        }
+
+        for (std::size_t i = 0; i < data.input.size(); ++i)
+        {
+            neuralNet.runBatch(data.input[i], data.expected[i]);
+        }
+
+        Matrix unfolded = neuralNet.predict(input);
+
+        neuralNet.foldBatchNorm();
+
+        if (neuralNet.transforms_.size() != 4 || neuralNet.predict(input) != unfolded)
+        {
+            std::cerr << "Folded batch norm changes predictions." << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testRecurrent()
+    {
+        const int steps = 4;
+        const int features = 3;
+
+        NeuralNet neuralNet;
+        neuralNet.setInputShape(steps, features, 1);
+        neuralNet.addRecurrent(NeuralNet::LSTM, 5, true);
+        neuralNet.addRecurrent(NeuralNet::GRU, 4);
+        neuralNet.add(NeuralNet::DENSE, outputSize_);
+        neuralNet.add(NeuralNet::SOFTMAX);
+
+        TestLoader loader(10, steps * features, outputSize_, 10);
+        TrainingData data = loader.load();
+
+        Matrix &input = data.input[0];
+        Matrix &expected = data.expected[0];
+
+        if (!inputGradientMatches(neuralNet, input, expected, "Recurrent") ||
+            !parameterGradientsMatch(neuralNet, input, expected, "Recurrent"))
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testDropout()
+    {
+        NeuralNet neuralNet;
+        neuralNet.add(NeuralNet::DENSE, 20, inputSize_);
+        neuralNet.add(NeuralNet::RELU);
+        neuralNet.addDropout(0.5);
+        neuralNet.add(NeuralNet::DENSE, outputSize_);
+        neuralNet.add(NeuralNet::SOFTMAX);
+
+        TestLoader loader(20, inputSize_, outputSize_, 20);
+        TrainingData data = loader.load();
+
+        Matrix &input = data.input[0];
+        Matrix &expected = data.expected[0];
+
+        // The mask depends only on seed, epoch, batch and layer, so every
+        // training pass over this batch drops the same units.
+        if (!inputGradientMatches(neuralNet, input, expected, "Dropout", true))
+        {
+            return false;
+        }
+
+        BatchResult result;
+        neuralNet.runForwards(result, input, true);
+
+        Matrix &hidden = result.io[2];
+        Matrix &dropped = result.io[3];
+        int zeroed = 0;
+
+        for (int i = 0; i < hidden.rows() * hidden.cols(); ++i)
+        {
+            if (hidden[i] != 0 && dropped[i] == 0)
+            {
+                ++zeroed;
+            }
+        }
+
+        if (zeroed == 0)
+        {
+            std::cerr << "Dropout did not drop anything while training." << std::endl;
+            return false;
+        }
+
+        BatchResult inference;
+        neuralNet.runForwards(inference, input);
+
+        if (inference.io[3] != inference.io[2])
+        {
+            std::cerr << "Dropout changed values during inference." << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testPruning()
+    {
+        NeuralNet neuralNet;
+        neuralNet.add(NeuralNet::DENSE, 8, inputSize_);
+        neuralNet.add(NeuralNet::RELU);
+        neuralNet.add(NeuralNet::DENSE, outputSize_);
+        neuralNet.add(NeuralNet::SOFTMAX);
+
+        TestLoader loader(20, inputSize_, outputSize_, 20);
+        TrainingData data = loader.load();
+        MatrixDataset dataset(data.input, data.expected);
+
+        // Neurons with no outgoing weights contribute nothing, so removing
+        // them must leave every prediction unchanged.
+        Matrix &nextWeight = neuralNet.weights_[1];
+
+        for (int row = 0; row < nextWeight.rows(); ++row)
+        {
+            nextWeight.set(row, 2, 0);
+            nextWeight.set(row, 5, 0);
+        }
+
+        Matrix before = neuralNet.predict(data.input[0]);
+
+        for (Pruner::Criterion criterion : {Pruner::WEIGHT_NORM, Pruner::ACTIVATION})
+        {
+            std::unique_ptr<NeuralNet> pruned = neuralNet.snapshot();
+
+            Pruner pruner(*pruned, criterion);
+            pruner.prune(0, 6, dataset);
+
+            if (pruned->weights_[0].rows() != 6 || pruned->biases_[0].rows() != 6 || pruned->weights_[1].cols() != 6)
+            {
+                std::cerr << "Pruning did not compact the layers." << std::endl;
+                return false;
+            }
+
+            if (pruned->predict(data.input[0]) != before)
+            {
+                std::cerr << "Pruning neurons without outgoing weights changed predictions." << std::endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testFactorization()
+    {
+        const int rank = 3;
+
+        NeuralNet neuralNet;
+        neuralNet.add(NeuralNet::DENSE, 12, inputSize_);
+        neuralNet.add(NeuralNet::RELU);
+        neuralNet.add(NeuralNet::DENSE, outputSize_);
+        neuralNet.add(NeuralNet::SOFTMAX);
+
+        // A weight of exactly this rank factorizes without any error.
+        Matrix left(12, rank);
+        Matrix right(rank, inputSize_);
+        Philox(1).fillNormal(left.data(), 12 * rank, 0);
+        Philox(1).fillNormal(right.data(), rank * inputSize_, 1);
+        neuralNet.weights_[0] = left * right;
+
+        TestLoader loader(20, inputSize_, outputSize_, 20);
+        TrainingData data = loader.load();
+
+        Matrix before = neuralNet.predict(data.input[0]);
+
+        Factorizer factorizer(neuralNet);
+
+        if (factorizer.rankForEnergy(0, 0.999999) != rank)
+        {
+            std::cerr << "Factorization found the wrong rank." << std::endl;
+            return false;
+        }
+
+        factorizer.factorize(0, rank);
+
+        if (neuralNet.transforms_.size() != 5 || neuralNet.weights_[0].rows() != rank || neuralNet.weights_[1].cols() != rank)
+        {
+            std::cerr << "Factorization did not insert a rank " << rank << " layer." << std::endl;
+            return false;
+        }
+
+        if (neuralNet.predict(data.input[0]) != before)
+        {
+            std::cerr << "Exact factorization changed predictions." << std::endl;
+            return false;
+        }
+
+        // Explicit pipeline stages must grow with the stage that was split.
+        NeuralNet pipelined;
+        pipelined.add(NeuralNet::DENSE, 12, inputSize_);
+        pipelined.add(NeuralNet::RELU);
+        pipelined.add(NeuralNet::DENSE, outputSize_);
+        pipelined.add(NeuralNet::SOFTMAX);
+        pipelined.setPipeline({2, 2});
+
+        Factorizer(pipelined).factorize(2, 2);
+
+        if (pipelined.pipelineLayers_ != std::vector<int>{2, 3})
+        {
+            std::cerr << "Factorization did not update the pipeline stages." << std::endl;
+            return false;
+        }
+
+        try
+        {
+            Pipeline(pipelined, pipelined.pipelineLayers_, 2, NeuralNet::GPIPE);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            std::cerr << "Factorized pipeline was refused: " << e.what() << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testHotSwap()
+    {
+        TestLoader loader(20, inputSize_, outputSize_, 20);
+        TrainingData data = loader.load();
+        Matrix &input = data.input[0];
+
+        std::vector<std::shared_ptr<NeuralNet>> models;
+        std::vector<Matrix> outputs;
+
+        for (int i = 0; i < 2; ++i)
+        {
+            auto model = std::make_shared<NeuralNet>();
+            model->add(NeuralNet::DENSE, 8, inputSize_);
+            model->add(NeuralNet::RELU);
+            model->add(NeuralNet::DENSE, outputSize_);
+            model->add(NeuralNet::SOFTMAX);
+
+            models.push_back(model);
+            outputs.push_back(model->predict(input));
+        }
+
+        ModelHandle handle;
+        handle.publish(models[0]);
+
+        std::shared_ptr<NeuralNet> held = handle.acquire();
+        std::atomic<bool> swapping{true};
+        std::atomic<int> mismatches{0};
+
+        // Every prediction must come wholly from one model or the other.
+        std::vector<std::thread> readers;
+
+        for (int i = 0; i < 4; ++i)
+        {
+            readers.emplace_back([&]()
+                                 {
+                while (swapping)
+                {
+                    Matrix output = handle.acquire()->predict(input);
+
+                    if (output != outputs[0] && output != outputs[1])
+                    {
+                        ++mismatches;
+                    }
+                } });
+        }
+
+        for (int i = 0; i < 200; ++i)
+        {
+            handle.publish(models[(i + 1) % 2]);
+        }
+
+        swapping = false;
+
+        for (std::thread &reader : readers)
+        {
+            reader.join();
+        }
+
+        if (mismatches > 0 || handle.version() != 201)
+        {
+            std::cerr << "Predictions mixed models during a swap." << std::endl;
+            return false;
+        }
+
+        if (held->predict(input) != outputs[0])
+        {
+            std::cerr << "A held model changed after being replaced." << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testServer()
+    {
+        const int clients = 8;
+        const int requestsEach = 5;
+
+        NeuralNet neuralNet;
+        neuralNet.add(NeuralNet::DENSE, 8, inputSize_);
+        neuralNet.add(NeuralNet::RELU);
+        neuralNet.add(NeuralNet::DENSE, outputSize_);
+        neuralNet.add(NeuralNet::SOFTMAX);
+
+        std::string modelFile = "test_server.model";
+        std::string socketPath = "test_server.sock";
+        neuralNet.save(modelFile);
+
+        InferenceServer server(modelFile, socketPath);
+        server.setThreads(2);
+        server.setMaxDelay(20000);
+        server.start();
+
+        auto connectTo = [&]()
+        {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+            if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+
+            return fd;
+        };
+
+        auto exchange = [](int fd, std::int32_t size, const double *values, std::vector<double> &reply)
+        {
+            std::int32_t count = 0;
+
+            if (send(fd, &size, sizeof(size), MSG_NOSIGNAL) != sizeof(size) ||
+                send(fd, values, sizeof(double) * size, MSG_NOSIGNAL) != ssize_t(sizeof(double) * size) ||
+                recv(fd, &count, sizeof(count), MSG_WAITALL) != sizeof(count))
+            {
+                return -2;
+            }
+
+            reply.resize(std::max(0, count));
+
+            if (count > 0 && recv(fd, reply.data(), sizeof(double) * count, MSG_WAITALL) != ssize_t(sizeof(double) * count))
+            {
+                return -2;
+            }
+
+            return int(count);
+        };
+
+        // Several connections at once, so requests can share batches.
+        std::atomic<int> mismatches{0};
+        std::vector<std::thread> threads;
+
+        for (int client = 0; client < clients; ++client)
+        {
+            threads.emplace_back([&, client]()
+                                 {
+                int fd = connectTo();
+
+                for (int request = 0; request < requestsEach; ++request)
+                {
+                    Matrix input(inputSize_, 1, [&](int index) { return (client * 31 + request * 7 + index) % 11 / 10.0; });
+                    std::vector<double> reply;
+
+                    if (fd < 0 || exchange(fd, inputSize_, input.data(), reply) != outputSize_ ||
+                        Matrix(outputSize_, 1, reply) != neuralNet.predict(input))
+                    {
+                        ++mismatches;
+                    }
+                }
+
+                if (fd >= 0)
+                {
+                    close(fd);
+                } });
+        }
+
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+
+        bool passed = true;
+
+        if (mismatches > 0)
+        {
+            std::cerr << mismatches << " server replies differ from predict()." << std::endl;
+            passed = false;
+        }
+
+        ServerStatistics statistics = server.statistics();
+
+        if (statistics.requests != clients * requestsEach || statistics.batches >= statistics.requests)
+        {
+            std::cerr << "Server ran " << statistics.requests << " requests in " << statistics.batches << " batches." << std::endl;
+            passed = false;
+        }
+
+        // The wrong input size is refused as soon as the size is read.
+        int fd = connectTo();
+        std::int32_t size = inputSize_ + 1;
+        std::int32_t reply = 0;
+
+        if (fd < 0 || send(fd, &size, sizeof(size), MSG_NOSIGNAL) != sizeof(size) || recv(fd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply) || reply != -1)
+        {
+            std::cerr << "Server accepted a request of the wrong size." << std::endl;
+            passed = false;
+        }
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        server.stop();
+        std::remove(modelFile.c_str());
+
+        return passed;
+    }
+
+    bool NeuralNetTest::testBackprop()
+    {
+        TestLoader loader = getTestLoader(1000);
+
+        TrainingData data = loader.load();
+
+        Matrix &input = data.input[0];
+        Matrix &expected = data.expected[0];
+        BatchResult result;
+
+        neuralNet_.runForwards(result, input);
+        neuralNet_.runBackwards(result, data.expected[0], true);
+        Matrix &inputError = result.errors.front();
+        // clang-format off
+        Matrix approximatedError = gradient(&input, [&]()
+        {
+            BatchResult result;
+            
+            neuralNet_.runForwards(result, input);
+
+            return crossEntropy(result.io.back(), expected); 
+        });
+        // clang-format on
+
+        if (inputError != approximatedError)
+        {
+            std::cerr << "Input error: calculated and approximated don't match." << std::endl;
+
+            std::cerr << "\nCalculated:\n"
+                      << inputError << std::endl;
+            std::cerr << "\nApproximated:\n"
+                      << approximatedError << std::endl;
+            return false;
+        }
+
+        if (std::abs(inputError.sum()) < 0.0001)
+        {
+            std::cout << "Input error contained only zero. Consider re-running test." << std::endl;
+        }
+
+        if (inputError.cols() != approximatedError.cols())
+        {
+            std::cerr << "Calculated error has different number of columns to approximated error" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testDataset()
+    {
+        const int items = 10;
+        const int batchSize = 4;
+
+        ByteDataset bytes(inputSize_, outputSize_, batchSize);
+        std::vector<Matrix> inputs;
+        std::vector<Matrix> expecteds;
+
+        for (int item = 0; item < items; ++item)
+        {
+            int batch = item / batchSize;
+            int column = item % batchSize;
+
+            if (column == 0)
+            {
+                int cols = std::min(batchSize, items - item);
+                inputs.push_back(Matrix(inputSize_, cols));
+                expecteds.push_back(Matrix(outputSize_, cols));
+            }
+
+            std::vector<std::uint8_t> input(inputSize_);
+
+            for (int row = 0; row < inputSize_; ++row)
+            {
+                input[row] = (item * 37 + row * 11) % 256;
+                inputs[batch].set(row, column, input[row] / 256.0);
+            }
+
+            int label = item % outputSize_;
+            expecteds[batch].set(label, column, 1);
+
+            bytes.add(input.data(), label);
+        }
+
+        if (bytes.batches() != 3 || bytes.items(2) != 2)
+        {
+            std::cerr << "Byte dataset has the wrong batches." << std::endl;
+            return false;
+        }
+
+        // One buffer is reused across batches of different sizes.
+        Matrix inputBuffer;
+        Matrix expectedBuffer;
+
+        for (int batch = 0; batch < bytes.batches(); ++batch)
+        {
+            if (bytes.input(batch, inputBuffer) != inputs[batch] || bytes.expected(batch, expectedBuffer) != expecteds[batch])
+            {
+                std::cerr << "Byte dataset decoded batch " << batch << " wrongly." << std::endl;
+                return false;
+            }
+        }
+
+        // Training from bytes must match training from the decoded matrices.
+        NeuralNet neuralNet;
+        neuralNet.add(NeuralNet::DENSE, 8, inputSize_);
+        neuralNet.add(NeuralNet::RELU);
+        neuralNet.add(NeuralNet::DENSE, outputSize_);
+        neuralNet.add(NeuralNet::SOFTMAX);
+        neuralNet.setEpochs(2);
+        neuralNet.setThreads(1);
+
+        std::unique_ptr<NeuralNet> fromMatrices = neuralNet.snapshot();
+
+        std::cout << "\n";
+        neuralNet.fit(bytes);
+        fromMatrices->fit(inputs, expecteds);
+
+        if (neuralNet.predict(inputs[0]) != fromMatrices->predict(inputs[0]))
+        {
+            std::cerr << "Training from bytes differs from training from matrices." << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testPrefetch()
+    {
+        TestLoader loader(200, inputSize_, outputSize_, 8);
+        TrainingData data = loader.load();
+        MatrixDataset source(data.input, data.expected);
+
+        Prefetcher prefetcher(source, 3, 2);
+
+        // Every batch arrives exactly once per run, and a second run
+        // starts over.
+        for (int run = 0; run < 2; ++run)
+        {
+            std::vector<int> seen(source.batches());
+            Batch batch;
+
+            while (prefetcher.nextBatch(batch))
+            {
+                ++seen[batch.index];
+
+                if (batch.input != data.input[batch.index] || batch.expected != data.expected[batch.index])
+                {
+                    std::cerr << "Prefetched batch " << batch.index << " differs from its source." << std::endl;
+                    return false;
+                }
+            }
+
+            if (std::count(seen.begin(), seen.end(), 1) != source.batches())
+            {
+                std::cerr << "Prefetching did not deliver every batch once." << std::endl;
+                return false;
+            }
+        }
+
+        // Asked for by index, as the trainer does, in either order.
+        Matrix inputBuffer;
+        Matrix expectedBuffer;
+
+        for (int epoch = 0; epoch < 2; ++epoch)
+        {
+            for (int i = 0; i < source.batches(); ++i)
+            {
+                bool same = i % 2 == 0 ? prefetcher.expected(i, expectedBuffer) == data.expected[i] && prefetcher.input(i, inputBuffer) == data.input[i]
+                                       : prefetcher.input(i, inputBuffer) == data.input[i] && prefetcher.expected(i, expectedBuffer) == data.expected[i];
+
+                if (!same)
+                {
+                    std::cerr << "Prefetched batch " << i << " differs from its source in epoch " << epoch << "." << std::endl;
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testShuffle()
+    {
+        const int items = 50;
+        const int classes = 5;
+
+        // The first byte of each item identifies it; its label follows from it.
+        ByteDataset bytes(inputSize_, classes, 8);
+
+        for (int item = 0; item < items; ++item)
+        {
+            std::vector<std::uint8_t> input(inputSize_, std::uint8_t(item * 3));
+            input[0] = item;
+            bytes.add(input.data(), item % classes);
+        }
+
+        auto order = [&](int epoch)
+        {
+            std::vector<int> result;
+            Matrix inputBuffer;
+            Matrix expectedBuffer;
+
+            bytes.beginEpoch(epoch);
+
+            for (int batch = 0; batch < bytes.batches(); ++batch)
+            {
+                Matrix &input = bytes.input(batch, inputBuffer);
+                Matrix &expected = bytes.expected(batch, expectedBuffer);
+
+                for (int col = 0; col < input.cols(); ++col)
+                {
+                    int item = std::lround(input.get(0, col) * 256);
+
+                    if (expected.get(item % classes, col) != 1 || input.get(1, col) != std::uint8_t(item * 3) / 256.0)
+                    {
+                        result.clear();
+                        return result;
+                    }
+
+                    result.push_back(item);
+                }
+            }
+
+            return result;
+        };
+
+        bytes.setShuffle(true, 7);
+        std::vector<int> first = order(0);
+        std::vector<int> second = order(1);
+        std::vector<int> repeated = order(0);
+
+        std::vector<int> sorted = first;
+        std::sort(sorted.begin(), sorted.end());
+
+        if (int(sorted.size()) != items || std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+        {
+            std::cerr << "Shuffled epoch is not a permutation of the items." << std::endl;
+            return false;
+        }
+
+        if (first == second || first != repeated)
+        {
+            std::cerr << "Shuffle is not a seeded permutation per epoch." << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testAugmentation()
+    {
+        const int side = 8;
+
+        ByteDataset bytes(side * side, outputSize_, 4);
+
+        for (int item = 0; item < 6; ++item)
+        {
+            std::vector<std::uint8_t> image(side * side);
+
+            for (int i = 0; i < side * side; ++i)
+            {
+                image[i] = (item * 41 + i * 13) % 256;
+            }
+
+            bytes.add(image.data(), item % outputSize_);
+        }
+
+        Matrix original;
+        bytes.input(1, original);
+
+        Augmenter augmenter(bytes, side, side, 3);
+        Matrix buffer;
+
+        if (augmenter.input(1, buffer) != original)
+        {
+            std::cerr << "Augmentation with nothing enabled changed the images." << std::endl;
+            return false;
+        }
+
+        augmenter.setShift(1.5);
+        augmenter.setRotation(10);
+        augmenter.setElastic(2, 2);
+        augmenter.setNoise(0.05);
+
+        Matrix first = augmenter.input(1, buffer);
+        Matrix again = augmenter.input(1, buffer);
+
+        augmenter.beginEpoch(1);
+        Matrix nextEpoch = augmenter.input(1, buffer);
+
+        if (first != again || first == original || nextEpoch == first)
+        {
+            std::cerr << "Augmentation is not seeded per epoch and image." << std::endl;
+            return false;
+        }
+
+        for (int i = 0; i < first.rows() * first.cols(); ++i)
+        {
+            if (first.data()[i] < 0 || first.data()[i] > 1)
+            {
+                std::cerr << "Augmented pixel out of range." << std::endl;
+                return false;
+            }
+        }
+
+        Matrix expected;
+        Matrix augmentedExpected;
+
+        if (augmenter.expected(1, augmentedExpected) != bytes.expected(1, expected))
+        {
+            std::cerr << "Augmentation changed the labels." << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool NeuralNetTest::testDataCache()
+    {
+        TestLoader loader(45, inputSize_, outputSize_, 8);
+        TrainingData data = loader.load();
+        MatrixDataset source(data.input, data.expected);
+
+        std::string file = "test_dataset.cache";
+        CachedDataset::write(source, file);
+
+        bool passed = true;
+
+        {
+            CachedDataset cache(file);
+
+            if (cache.batches() != source.batches() || cache.items(5) != 5 || !cache.verify())
+            {
+                std::cerr << "Cached dataset has the wrong shape or checksum." << std::endl;
+                passed = false;
+            }
+
+            Matrix input;
+            Matrix expected;
+
+            for (int batch = 0; passed && batch < cache.batches(); ++batch)
+            {
+                if (cache.input(batch, input) != data.input[batch] || cache.expected(batch, expected) != data.expected[batch])
+                {
+                    std::cerr << "Cached batch " << batch << " differs from its source." << std::endl;
+                    passed = false;
+                }
+            }
+        }
+
+        // Labels are the last bytes of the file; one past the class count must be refused.
+        {
+            std::fstream damage(file, std::ios::in | std::ios::out | std::ios::binary);
+            damage.seekp(-45, std::ios::end);
+            damage.put(char(outputSize_));
+        }
+
+        try
+        {
+            CachedDataset cache(file);
+            Matrix expected;
+            cache.expected(0, expected);
+            std::cerr << "Out of range cached label was accepted." << std::endl;
+            passed = false;
+        }
+        catch (const FileException &)
+        {
+        }
+
+        // A damaged header must be refused rather than trusted.
+        {
+            std::fstream damage(file, std::ios::in | std::ios::out | std::ios::binary);
+            damage.seekp(12);
+            damage.put(char(99));
+        }
+
+        try
+        {
+            CachedDataset cache(file);
+            std::cerr << "Damaged cache was accepted." << std::endl;
+            passed = false;
+        }
+        catch (const FileException &)
+        {
+        }
+
+        // A cache written from source files is refused once one of them
+        // changes, whether it keeps its size and gets a new first byte or
+        // grows.
+        std::vector<std::string> sources = {"test_cache_source_a", "test_cache_source_b"};
+
+        for (std::size_t changed = 0; changed < sources.size(); ++changed)
+        {
+            for (const std::string &sourceFile : sources)
+            {
+                std::ofstream(sourceFile, std::ios::binary) << "0123456789abcdefghij";
+            }
+
+            CachedDataset::write(source, file, sources);
+
+            try
+            {
+                CachedDataset cache(file, sources);
+            }
+            catch (const FileException &e)
+            {
+                std::cerr << "Cache with unchanged sources was refused: " << e.what() << std::endl;
+                passed = false;
+            }
+
+            if (changed == 0)
+            {
+                std::fstream change(sources[changed], std::ios::in | std::ios::out | std::ios::binary);
+                change.put('X');
+            }
+            else
+            {
+                std::ofstream(sources[changed], std::ios::binary | std::ios::app) << "klm";
+            }
+
+            try
+            {
+                CachedDataset cache(file, sources);
+                std::cerr << "Cache with a changed source " << sources[changed] << " was accepted." << std::endl;
+                passed = false;
+            }
+            catch (const FileException &)
+            {
+            }
+        }
+
+        for (const std::string &sourceFile : sources)
+        {
+            std::remove(sourceFile.c_str());
+        }
+
+        std::remove(file.c_str());
+
+        // Labels are single bytes, so more classes cannot be cached.
+        std::vector<Matrix> inputs{Matrix(inputSize_, 2)};
+        std::vector<Matrix> expecteds{Matrix(300, 2)};
+        expecteds[0].set(299, 0, 1.0);
+        MatrixDataset wide(inputs, expecteds);
+
+        try
+        {
+            CachedDataset::write(wide, file);
+            std::cerr << "Cache with 300 classes was written." << std::endl;
+            passed = false;
+        }
+        catch (const std::invalid_argument &)
+        {
+        }
+
+        if (std::ifstream(file) || std::ifstream(file + ".tmp"))
+        {
+            std::cerr << "Refused cache left a file behind." << std::endl;
+            passed = false;
+        }
+
+        std::remove(file.c_str());
+
+        return passed;
+    }
+
+    bool NeuralNetTest::testCompressedIdx()
+    {
+        // Large enough to be inflated in several chunks.
+        const int items = 3000;
+        const int side = 28;
+
+        std::vector<std::uint8_t> pixels(items * side * side);
+
+        for (std::size_t i = 0; i < pixels.size(); ++i)
+        {
+            pixels[i] = (i * 7 + i / 1000) % 256;
+        }
+
+        std::vector<std::uint8_t> bytes = idxBytes(IdxFile::UNSIGNED_BYTE, {items, side, side}, pixels);
+
+        std::string file = "test_images.idx";
+        std::string compressed = file + ".gz";
+
+        writeFile(file, bytes);
+
+        bool passed = true;
+
+#ifdef CAVE_ZLIB
+        gzFile out = gzopen(compressed.c_str(), "wb");
+        gzwrite(out, bytes.data(), bytes.size());
+        gzclose(out);
+
+        {
+            IdxFile plain(file);
+            IdxFile inflated(compressed);
+
+            if (inflated.dims() != plain.dims() ||
+                !std::equal(plain.item(0), plain.item(0) + items * side * side, inflated.range(0, items)))
+            {
+                std::cerr << "Inflated IDX data differs from the plain file." << std::endl;
+                passed = false;
+            }
+        }
+
+        // Closing a file while it is still being inflated must not hang.
+        {
+            IdxFile inflated(compressed);
+            inflated.item(0);
+        }
+
+        std::remove(compressed.c_str());
+#else
+        try
+        {
+            std::ofstream(compressed, std::ios::binary) << "not read";
+            IdxFile inflated(compressed);
+
+            std::cerr << "Compressed IDX file opened without zlib." << std::endl;
+            passed = false;
+        }
+        catch (const FileException &)
+        {
+        }
+
+        std::remove(compressed.c_str());
+#endif
+
+        std::remove(file.c_str());
+
+        return passed;
+    }
+
+    bool NeuralNetTest::testIdxFile()
+    {
+        // Neither count is a multiple of decodeColumns' 16 item, 64 row tiles.
+        const int items = 37;
+        const int height = 9;
+        const int width = 8;
+        const int itemSize = height * width;
+        const int classes = 10;
+        const int batchSize = 16;
+
+        std::vector<std::uint8_t> pixels(items * itemSize);
+
+        for (std::size_t i = 0; i < pixels.size(); ++i)
+        {
+            pixels[i] = (i * 13 + i / 7) % 256;
+        }
+
+        Matrix columns(itemSize, items);
+        decodeColumns(pixels.data(), items, itemSize, 1.0 / 256.0, columns.data());
+
+        for (int item = 0; item < items; ++item)
+        {
+            for (int row = 0; row < itemSize; ++row)
+            {
+                if (columns.get(row, item) != pixels[item * itemSize + row] / 256.0)
+                {
+                    std::cerr << "decodeColumns misplaced item " << item << " row " << row << "." << std::endl;
+                    return false;
+                }
+            }
+        }
+
+        std::vector<std::uint8_t> classIndexes(items);
+
+        for (int item = 0; item < items; ++item)
+        {
+            classIndexes[item] = item * 3 % classes;
+        }
+
+        std::vector<std::uint8_t> images = idxBytes(IdxFile::UNSIGNED_BYTE, {items, height, width}, pixels);
+        std::vector<std::uint8_t> labels = idxBytes(IdxFile::UNSIGNED_BYTE, {items}, classIndexes);
+
+        std::string imageFile = "test-images-idx3-ubyte";
+        std::string labelFile = "test-labels-idx1-ubyte";
+        writeFile(imageFile, images);
+        writeFile(labelFile, labels);
+
+        bool passed = true;
+
+        MNISTLoader loader(batchSize, ".", imageFile, labelFile);
+        loader.setThreads(2);
+        TrainingData data = loader.load();
+
+        if (data.input.size() != 3 || data.input.back().cols() != items % batchSize || loader.getImageHeight() != height || loader.getImageWidth() != width)
+        {
+            std::cerr << "MNIST loader produced the wrong batches." << std::endl;
+            passed = false;
+        }
+
+        for (std::size_t batch = 0; passed && batch < data.input.size(); ++batch)
+        {
+            for (int col = 0; col < data.input[batch].cols(); ++col)
+            {
+                int item = batch * batchSize + col;
+
+                for (int row = 0; row < itemSize; ++row)
+                {
+                    if (data.input[batch].get(row, col) != columns.get(row, item))
+                    {
+                        passed = false;
+                    }
+                }
+
+                for (int label = 0; label < classes; ++label)
+                {
+                    if (data.expected[batch].get(label, col) != (label == item * 3 % classes ? 1 : 0))
+                    {
+                        passed = false;
+                    }
+                }
+            }
+
+            if (!passed)
+            {
+                std::cerr << "MNIST loader decoded batch " << batch << " wrongly." << std::endl;
+            }
+        }
+
+        // A file shorter than its header says, or without the magic number, is refused.
+        images.pop_back();
+        writeFile(imageFile, images);
+
+        labels[0] = 1;
+        writeFile(labelFile, labels);
+
+        for (const std::string &file : {imageFile, labelFile})
+        {
+            try
+            {
+                IdxFile idxFile(file);
+                std::cerr << "Damaged IDX file " << file << " was accepted." << std::endl;
+                passed = false;
+            }
+            catch (const FileException &)
+            {
+            }
+        }
+
+        std::remove(imageFile.c_str());
+        std::remove(labelFile.c_str());
+
+        return passed;
+    }
+
+    bool NeuralNetTest::testOutOfCore()
+    {
+        const int items = 50;
+        const int rows = 6;
+        const int classes = 4;
+
+        // Float images of rank 3 and int labels.
+        std::vector<float> pixels;
+        std::vector<std::int32_t> classIndexes;
+
+        for (int item = 0; item < items; ++item)
+        {
+            for (int row = 0; row < rows; ++row)
+            {
+                pixels.push_back(item + 0.25 * row);
+            }
+
+            classIndexes.push_back(item % classes);
+        }
+
+        std::string imageFile = "test_images.idx";
+        std::string labelFile = "test_labels.idx";
+
+        writeFile(imageFile, idxBytes(IdxFile::FLOAT, {items, 2, 3}, pixels));
+        writeFile(labelFile, idxBytes(IdxFile::INT, {items}, classIndexes));
+
+        bool passed = true;
+
+        {
+            IdxDataset data(4, imageFile, labelFile, 0, 7);
+            data.setScale(1);
+
+            auto epoch = [&](int number)
+            {
+                std::vector<int> order;
+                Matrix input;
+                Matrix expected;
+
+                data.beginEpoch(number);
+
+                for (int batch = 0; batch < data.batches(); ++batch)
+                {
+                    data.input(batch, input);
+                    data.expected(batch, expected);
+
+                    for (int col = 0; col < input.cols(); ++col)
+                    {
+                        int item = input.get(0, col);
+
+                        // Windows round up to 8 items; a batch stays in one.
+                        if (input.get(rows - 1, col) != item + 0.25 * (rows - 1) || expected.get(item % classes, col) != 1 ||
+                            item / 8 != int(input.get(0, 0)) / 8)
+                        {
+                            order.clear();
+                            return order;
+                        }
+
+                        order.push_back(item);
+                    }
+                }
+
+                return order;
+            };
+
+            if (data.classes() != classes || data.inputSize() != rows || data.batches() != 13)
+            {
+                std::cerr << "IDX dataset read the wrong shape." << std::endl;
+                passed = false;
+            }
+
+            std::vector<int> sequential = epoch(0);
+
+            for (int i = 0; passed && i < items; ++i)
+            {
+                if (int(sequential.size()) != items || sequential[i] != i)
+                {
+                    std::cerr << "IDX dataset did not read items in order." << std::endl;
+                    passed = false;
+                }
+            }
+
+            data.setShuffle(true, 11);
+            std::vector<int> first = epoch(0);
+            std::vector<int> second = epoch(1);
+
+            std::vector<int> sorted = first;
+            std::sort(sorted.begin(), sorted.end());
+
+            if (passed && (sorted != sequential || first == sequential || first == second || first.back() < 48))
+            {
+                std::cerr << "IDX dataset shuffle is not a windowed permutation." << std::endl;
+                passed = false;
+            }
+        }
+
+        std::remove(imageFile.c_str());
+        std::remove(labelFile.c_str());
+
+        return passed;
+    }
+
+    bool NeuralNetTest::testSyntheticData()
+    {
+        TestLoader serial(95, inputSize_, outputSize_, 10, 7);
+        serial.setThreads(1);
+
+        TestLoader parallel(95, inputSize_, outputSize_, 10, 7);
+        parallel.setThreads(3);
+
+        TrainingData first = serial.load();
+        TrainingData second = parallel.load();
+
+        if (first.input.size() != 10 || second.input.size() != 10 || first.input.back().cols() != 5)
+        {
+            std::cerr << "Synthetic data has the wrong batches." << std::endl;
+            return false;
+        }
+
+        for (std::size_t batch = 0; batch < first.input.size(); ++batch)
+        {
+            IO io = generateTestData(first.input[batch].cols(), inputSize_, outputSize_, 7, batch);
+
+            if (!identical(first.input[batch], second.input[batch]) || !identical(first.expected[batch], second.expected[batch]) ||
+                !identical(first.input[batch], io.input) || !identical(first.expected[batch], io.output))
+            {
+                std::cerr << "Synthetic data depends on the thread count." << std::endl;
+                return false;
+            }
+        }
+
+        return !identical(first.input[0], TestLoader(10, inputSize_, outputSize_, 10, 8).load().input[0]);
+    }
+
+    bool NeuralNetTest::testTensor()
+    {
+        Tensor tensor({2, 3, 4});
+
+        for (int i = 0; i < 2; ++i)
+        {
+            for (int j = 0; j < 3; ++j)
+            {
+                for (int k = 0; k < 4; ++k)
+                {
+                    tensor.at({i, j, k}) = i * 100 + j * 10 + k;
+                }
+            }
+        }
+
+        // Reshapes and slices are views: writes through them reach the original.
+        Tensor flat = tensor.reshape({6, -1});
+        Tensor middle = tensor.slice(1, 1, 2);
+
+        if (!flat.sharesStorage(tensor) || flat.dim(1) != 4 || !middle.sharesStorage(tensor) || middle.dim(1) != 2 || middle.at({1, 0, 3}) != 113)
+        {
+            std::cerr << "Tensor reshape or slice is not a view." << std::endl;
+            return false;
+        }
+
+        flat.at({5, 2}) = -1;
+        middle.at({0, 1, 0}) = -2;
+
+        if (tensor.at({1, 2, 2}) != -1 || tensor.at({0, 2, 0}) != -2)
+        {
+            std::cerr << "Writes through a tensor view were lost." << std::endl;
+            return false;
+        }
+
+        // Permuting only swaps strides; contiguous() then copies in the new order.
+        Tensor permuted = tensor.permute({2, 0, 1});
+
+        if (permuted.shape() != std::vector<int>{4, 2, 3} || permuted.strides() != std::vector<std::size_t>{1, 12, 4} ||
+            permuted.isContiguous() || !permuted.sharesStorage(tensor) || permuted.at({3, 1, 0}) != 103)
+        {
+            std::cerr << "Tensor permute has the wrong shape or strides." << std::endl;
+            return false;
+        }
+
+        Tensor packed = permuted.contiguous();
+
+        if (packed.sharesStorage(tensor) || !packed.isContiguous() || packed.data()[1 * 6 + 0 * 3 + 2] != 21)
+        {
+            std::cerr << "Contiguous copy of a permuted tensor is wrong." << std::endl;
+            return false;
+        }
+
+        Matrix matrix(3, 5, [](int row, int col, int) { return row * 5 + col; });
+        Tensor transposed = Tensor::fromMatrix(matrix).permute({1, 0});
+
+        if (transposed.strides() != std::vector<std::size_t>{1, 5} || !identical(transposed.toMatrix(), matrix.transpose()))
+        {
+            std::cerr << "Tensor transpose differs from Matrix transpose." << std::endl;
+            return false;
+        }
+
+        // A view of a Matrix writes through to it; copy() fills one view from another.
+        Matrix target(5, 3);
+        Tensor targetView = Tensor::view(target);
+        targetView.copy(transposed);
+
+        if (!identical(target, matrix.transpose()) || targetView.data() != target.data())
+        {
+            std::cerr << "Tensor view of a Matrix did not alias it." << std::endl;
+            return false;
+        }
+
+        // matmul runs the Matrix kernels on contiguous and transposed views
+        // alike, and copies any other view first.
+        Matrix left(3, 4, [](int row, int col, int) { return row - 2.0 * col; });
+        Matrix right(4, 2, [](int row, int col, int) { return 0.5 * row + col; });
+        Matrix product = left * right;
+
+        Tensor leftTransposed = Tensor::fromMatrix(left.transpose()).permute({1, 0});
+        Tensor rightTransposed = Tensor::fromMatrix(right.transpose()).permute({1, 0});
+        Tensor leftStrided = Tensor::fromMatrix(Matrix(3, 8, [&](int row, int col, int) { return col < 4 ? left.get(row, col) : -1.0; })).slice(1, 0, 4);
+
+        for (const Tensor &a : {Tensor::view(left), leftTransposed, leftStrided})
+        {
+            for (const Tensor &b : {Tensor::view(right), rightTransposed})
+            {
+                if (!identical(matmul(a, b).toMatrix(), product))
+                {
+                    std::cerr << "Tensor matmul differs from the Matrix product." << std::endl;
+                    return false;
+                }
+            }
+        }
+
+        // A batch of 2 x 3 x 4 images, one per column, to NHWC and back.
+        const int channels = 2;
+        const int height = 3;
+        const int width = 4;
+        Matrix images(channels * height * width, 5, [](int row, int col, int) { return row + col * 0.01; });
+
+        Tensor nchw = Tensor::fromColumns(images, channels, height, width);
+        Tensor nhwc = nchw.toLayout(Tensor::NHWC);
+
+        if (nchw.shape() != std::vector<int>{5, channels, height, width} || nhwc.shape() != std::vector<int>{5, height, width, channels} ||
+            nhwc.layout() != Tensor::NHWC || !nhwc.isContiguous())
+        {
+            std::cerr << "Tensor layout conversion has the wrong shape." << std::endl;
+            return false;
+        }
+
+        for (int n = 0; n < 5; ++n)
+        {
+            for (int c = 0; c < channels; ++c)
+            {
+                for (int h = 0; h < height; ++h)
+                {
+                    for (int w = 0; w < width; ++w)
+                    {
+                        double value = images.get((c * height + h) * width + w, n);
+                        std::size_t offset = ((n * height + h) * width + w) * channels + c;
+
+                        if (nchw.at({n, c, h, w}) != value || nhwc.data()[offset] != value)
+                        {
+                            std::cerr << "NHWC tensor holds the wrong value." << std::endl;
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+
+        return identical(nhwc.toColumns(), images) && identical(nhwc.toLayout(Tensor::NCHW).toColumns(), images);
+    }
+}
@@ -16,6 +16,8 @@ namespace cave
 
         TestLoader getTestLoader(int items);
         void configureNeuralNet();
+        bool inputGradientMatches(NeuralNet &neuralNet, Matrix &input, Matrix &expected, std::string name, bool training = false);
+        bool parameterGradientsMatch(NeuralNet &neuralNet, Matrix &input, Matrix &expected, std::string name);
     public:
         NeuralNetTest()
         {
@@ -24,6 +26,30 @@ namespace cave
 
         bool testBackprop();
         bool testAdjust();
+        bool testCheckpointing();
+        bool testPipeline();
+        bool testMultiProcess();
+        bool testTopology();
+        bool testEarlyStopping();
+        bool testConvolution();
+        bool testPooling();
+        bool testBatchNorm();
+        bool testRecurrent();
+        bool testDropout();
+        bool testPruning();
+        bool testFactorization();
+        bool testHotSwap();
+        bool testServer();
+        bool testDataset();
+        bool testPrefetch();
+        bool testShuffle();
+        bool testAugmentation();
+        bool testDataCache();
+        bool testCompressedIdx();
+        bool testIdxFile();
+        bool testOutOfCore();
+        bool testSyntheticData();
+        bool testTensor();
         bool all();
     };
 }
\ No newline at end of file
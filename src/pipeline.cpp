@@ -0,0 +1,448 @@
+#include "pipeline.h"
+
+#include <future>
+#include <chrono>
+#include <map>
+#include <queue>
+#include <cmath>
+#include <iomanip>
+#include <stdexcept>
+#include <exception>
+
+#include "matrixfunctions.h"
+#include "profiler.h"
+
+namespace cave
+{
+    Pipeline::Pipeline(NeuralNet &neuralNet, std::vector<int> stageLayers, int microBatches, NeuralNet::PipelineSchedule schedule)
+        : neuralNet_(neuralNet), microBatches_(microBatches), schedule_(schedule)
+    {
+        int layer = 0;
+
+        for (int layers : stageLayers)
+        {
+            if (layers <= 0)
+            {
+                throw std::invalid_argument("Every pipeline stage needs at least one layer.");
+            }
+
+            Stage stage;
+            stage.firstLayer = layer;
+            stage.endLayer = layer + layers;
+            stages_.push_back(stage);
+
+            layer += layers;
+        }
+
+        if (layer != int(neuralNet_.transforms_.size()))
+        {
+            throw std::invalid_argument("Pipeline stages must cover every layer exactly once.");
+        }
+
+        if (microBatches_ < 1)
+        {
+            throw std::invalid_argument("Pipeline needs at least one micro-batch.");
+        }
+
+        // A stage never has more than one batch worth of micro-batches queued
+        // in either direction, so this capacity never blocks a producer.
+        for (std::size_t i = 0; i < stages_.size(); ++i)
+        {
+            forwardQueues_.push_back(std::make_unique<BlockingQueue<Message>>(microBatches_));
+            backwardQueues_.push_back(std::make_unique<BlockingQueue<Message>>(microBatches_));
+        }
+    }
+
+    std::vector<int> Pipeline::balance(NeuralNet &neuralNet, int stages)
+    {
+        int layers = neuralNet.transforms_.size();
+
+        stages = std::max(1, std::min(stages, layers));
+
+        std::vector<double> costs;
+        double total = 0;
+
+        auto plan = neuralNet.plan(1);
+
+        for (auto &operation : plan->operations)
+        {
+            costs.push_back(operation.flops);
+            total += operation.flops;
+        }
+
+        std::vector<int> stageLayers;
+        double cumulative = 0;
+        int count = 0;
+
+        for (int i = 0; i < layers; ++i)
+        {
+            double target = total * (stageLayers.size() + 1) / stages;
+            int stagesLeft = stages - stageLayers.size() - 1;
+            int layersLeft = layers - i;
+
+            bool overshoot = cumulative + costs[i] - target > target - cumulative;
+
+            if (count > 0 && stagesLeft > 0 && (overshoot || layersLeft == stagesLeft))
+            {
+                stageLayers.push_back(count);
+                count = 0;
+            }
+
+            cumulative += costs[i];
+            ++count;
+        }
+
+        stageLayers.push_back(count);
+
+        return stageLayers;
+    }
+
+    /*
+     * The order in which a stage runs forward (F) and backward (B) work for
+     * one batch. GPipe runs every forward before any backward; 1F1B runs just
+     * enough forwards to fill the stages below it, then alternates, which
+     * bounds the number of stashed activations by the pipeline depth.
+     */
+    std::string Pipeline::stageOrder(int stage, int microBatches)
+    {
+        if (schedule_ == NeuralNet::GPIPE)
+        {
+            return std::string(microBatches, 'F') + std::string(microBatches, 'B');
+        }
+
+        int warmup = std::min(int(stages_.size()) - stage - 1, microBatches);
+
+        std::string order(warmup, 'F');
+
+        for (int i = warmup; i < microBatches; ++i)
+        {
+            order += "FB";
+        }
+
+        order += std::string(warmup, 'B');
+
+        return order;
+    }
+
+    /*
+     * A closed queue means another stage has failed; this one stops too.
+     */
+    Pipeline::Message Pipeline::take(BlockingQueue<Message> &queue)
+    {
+        Message message;
+
+        if (!queue.take(message))
+        {
+            throw std::runtime_error("Pipeline stage stopped by an error in another stage.");
+        }
+
+        return message;
+    }
+
+    void Pipeline::put(BlockingQueue<Message> &queue, Message message)
+    {
+        if (!queue.push(std::move(message)))
+        {
+            throw std::runtime_error("Pipeline stage stopped by an error in another stage.");
+        }
+    }
+
+    /*
+     * Keeps the first error of any stage and closes every queue, so the
+     * stages waiting on the failed one are released instead of hanging.
+     */
+    void Pipeline::abort(std::exception_ptr error)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtxError_);
+
+            if (!error_)
+            {
+                error_ = error;
+            }
+        }
+
+        for (auto &queue : forwardQueues_)
+        {
+            queue->close();
+        }
+
+        for (auto &queue : backwardQueues_)
+        {
+            queue->close();
+        }
+    }
+
+    BatchResult Pipeline::runStage(int stageIndex, Dataset &data)
+    {
+        try
+        {
+            Stage &stage = stages_[stageIndex];
+            bool first = stageIndex == 0;
+            bool last = stageIndex == int(stages_.size()) - 1;
+            int weightCount = neuralNet_.weights_.size();
+
+            BatchResult totals;
+
+            // Only the first stage reads inputs and only the last reads labels.
+            Matrix inputBuffer;
+            Matrix expectedBuffer;
+
+            for (int batch = 0; batch < data.batches(); ++batch)
+            {
+                int cols = data.items(batch);
+                Matrix *batchInput = first ? &data.input(batch, inputBuffer) : nullptr;
+                Matrix *batchExpected = last ? &data.expected(batch, expectedBuffer) : nullptr;
+                int microSize = std::ceil(double(cols) / std::min(microBatches_, cols));
+                int microBatches = std::ceil(double(cols) / microSize);
+
+                std::map<int, BatchResult> stash;
+                std::queue<int> pending;
+                std::vector<Matrix> weightGradients(weightCount);
+                std::vector<Matrix> biasGradients(weightCount);
+                int nextMicroBatch = 0;
+
+                for (char work : stageOrder(stageIndex, microBatches))
+                {
+                    if (work == 'F')
+                    {
+                        Message message;
+
+                        if (first)
+                        {
+                            message.microBatch = nextMicroBatch++;
+                        }
+                        else
+                        {
+                            message = take(*forwardQueues_[stageIndex]);
+                        }
+
+                        auto start = std::chrono::steady_clock::now();
+
+                        int microFirst = message.microBatch * microSize;
+                        int microCols = std::min(microSize, cols - microFirst);
+
+                        if (first)
+                        {
+                            message.data = batchInput->columns(microFirst, microCols);
+                        }
+
+                        auto compiled = neuralNet_.plan(microCols);
+                        const auto &plan = *compiled;
+
+                        BatchResult &result = stash[message.microBatch];
+                        result.io.resize(plan.buffers);
+                        result.training = true;
+                        result.epoch = neuralNet_.currentEpoch_;
+                        result.batch = batch * microBatches_ + message.microBatch;
+                        result.io[plan.operations[stage.firstLayer].input] = message.data;
+
+                        for (int i = stage.firstLayer; i < stage.endLayer; ++i)
+                        {
+                            auto &operation = plan.operations[i];
+                            neuralNet_.forwardLayer(result, operation);
+                        }
+
+                        if (last)
+                        {
+                            Matrix expected = batchExpected->columns(microFirst, microCols);
+
+                            totals.numberItems += microCols;
+                            totals.numberCorrect += numberCorrect(result.io.back(), expected);
+                            totals.totalLoss += crossEntropy(result.io.back(), expected).rowSums().get(0);
+
+                            pending.push(message.microBatch);
+                        }
+
+                        std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+                        stage.busySeconds += busy.count();
+
+                        if (!last)
+                        {
+                            Matrix &output = result.io[plan.operations[stage.endLayer - 1].output];
+                            put(*forwardQueues_[stageIndex + 1], {message.microBatch, output});
+                        }
+                    }
+                    else
+                    {
+                        int microBatch = 0;
+                        Matrix error;
+
+                        if (last)
+                        {
+                            microBatch = pending.front();
+                            pending.pop();
+                        }
+                        else
+                        {
+                            Message message = take(*backwardQueues_[stageIndex]);
+                            microBatch = message.microBatch;
+                            error = message.data;
+                        }
+
+                        auto start = std::chrono::steady_clock::now();
+
+                        int microFirst = microBatch * microSize;
+                        int microCols = std::min(microSize, cols - microFirst);
+
+                        BatchResult &result = stash[microBatch];
+                        result.weightGradients.resize(weightCount);
+                        result.biasGradients.resize(weightCount);
+
+                        Matrix expected;
+
+                        if (last)
+                        {
+                            expected = batchExpected->columns(microFirst, microCols);
+                        }
+                        else
+                        {
+                            result.errors.push_front(error);
+                        }
+
+                        auto compiled = neuralNet_.plan(microCols);
+                        const auto &plan = *compiled;
+
+                        for (int i = stage.endLayer - 1; i >= stage.firstLayer; --i)
+                        {
+                            neuralNet_.backwardLayer(result, plan.operations[i], expected, !first);
+                        }
+
+                        double scale = double(microCols) / cols;
+
+                        for (int i = 0; i < weightCount; ++i)
+                        {
+                            if (result.weightGradients[i].rows() == 0)
+                            {
+                                continue;
+                            }
+
+                            if (weightGradients[i].rows() == 0)
+                            {
+                                weightGradients[i] = scale * result.weightGradients[i];
+                                biasGradients[i] = scale * result.biasGradients[i];
+                            }
+                            else
+                            {
+                                weightGradients[i] = weightGradients[i] + scale * result.weightGradients[i];
+                                biasGradients[i] = biasGradients[i] + scale * result.biasGradients[i];
+                            }
+                        }
+
+                        Matrix inputError = result.errors.front();
+                        stash.erase(microBatch);
+
+                        std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+                        stage.busySeconds += busy.count();
+
+                        if (!first)
+                        {
+                            put(*backwardQueues_[stageIndex - 1], {microBatch, inputError});
+                        }
+                    }
+                }
+
+                auto start = std::chrono::steady_clock::now();
+
+                for (int i = 0; i < weightCount; ++i)
+                {
+                    if (weightGradients[i].rows() == 0)
+                    {
+                        continue;
+                    }
+
+                    std::unique_lock<std::mutex> lock(neuralNet_.mtxWeights_);
+                    neuralNet_.biases_[i] -= neuralNet_.learningRate_ * biasGradients[i];
+                    neuralNet_.weights_[i] -= neuralNet_.learningRate_ * weightGradients[i];
+                    lock.unlock();
+                }
+
+                std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+                stage.busySeconds += busy.count();
+            }
+
+            return totals;
+        }
+        catch (...)
+        {
+            abort(std::current_exception());
+            throw;
+        }
+    }
+
+    BatchResult Pipeline::runEpoch(Dataset &data)
+    {
+        auto timing = gProfiler.start("pipeline epoch");
+        auto start = std::chrono::steady_clock::now();
+
+        for (Stage &stage : stages_)
+        {
+            stage.busySeconds = 0;
+        }
+
+        std::vector<std::future<BatchResult>> futures;
+
+        for (std::size_t i = 0; i < stages_.size(); ++i)
+        {
+            futures.push_back(std::async(std::launch::async, &Pipeline::runStage, this, i, std::ref(data)));
+        }
+
+        BatchResult totals;
+
+        // Every stage is waited for before the first error is rethrown.
+        for (auto &future : futures)
+        {
+            try
+            {
+                BatchResult result = future.get();
+
+                totals.numberItems += result.numberItems;
+                totals.numberCorrect += result.numberCorrect;
+                totals.totalLoss += result.totalLoss;
+            }
+            catch (...)
+            {
+            }
+        }
+
+        if (error_)
+        {
+            gProfiler.end(timing);
+            std::rethrow_exception(error_);
+        }
+
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+        wallSeconds_ = wall.count();
+
+        gProfiler.end(timing);
+
+        return totals;
+    }
+
+    std::vector<double> Pipeline::utilization()
+    {
+        std::vector<double> result;
+
+        for (Stage &stage : stages_)
+        {
+            result.push_back(wallSeconds_ > 0 ? stage.busySeconds / wallSeconds_ : 0);
+        }
+
+        return result;
+    }
+
+    std::ostream &operator<<(std::ostream &out, Pipeline &pipeline)
+    {
+        std::vector<double> utilization = pipeline.utilization();
+
+        for (std::size_t i = 0; i < pipeline.stages_.size(); ++i)
+        {
+            Pipeline::Stage &stage = pipeline.stages_[i];
+
+            out << "Stage " << i << " (layers " << stage.firstLayer << "-" << (stage.endLayer - 1) << "): ";
+            out << std::fixed << std::setprecision(1) << 100.0 * utilization[i] << "% busy" << std::endl;
+        }
+
+        return out;
+    }
+}
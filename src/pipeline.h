@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <iostream>
+#include <mutex>
+#include <exception>
+
+#include "neuralnet.h"
+#include "blockingqueue.h"
+
+namespace cave
+{
+    /*
+     * Pipeline-parallel training: the transforms of a NeuralNet are split into
+     * contiguous stages, each run by its own thread. Every batch is cut into
+     * micro-batches which flow forwards and backwards between neighbouring
+     * stages through blocking queues. Gradients are accumulated over the
+     * micro-batches and applied by the owning stage at the end of the batch.
+     * An error in any stage closes every queue, so the others stop rather
+     * than wait forever, and runEpoch() rethrows it.
+     */
+    class Pipeline
+    {
+    private:
+        struct Stage
+        {
+            int firstLayer{0};
+            int endLayer{0};
+            double busySeconds{0};
+        };
+
+        struct Message
+        {
+            int microBatch{0};
+            Matrix data;
+        };
+
+        NeuralNet &neuralNet_;
+        int microBatches_{4};
+        NeuralNet::PipelineSchedule schedule_;
+
+        std::vector<Stage> stages_;
+        std::vector<std::unique_ptr<BlockingQueue<Message>>> forwardQueues_;
+        std::vector<std::unique_ptr<BlockingQueue<Message>>> backwardQueues_;
+
+        double wallSeconds_{0};
+
+        std::mutex mtxError_;
+        std::exception_ptr error_;
+
+    private:
+        Message take(BlockingQueue<Message> &queue);
+        void put(BlockingQueue<Message> &queue, Message message);
+        void abort(std::exception_ptr error);
+        std::string stageOrder(int stage, int microBatches);
+        BatchResult runStage(int stage, Dataset &data);
+
+    public:
+        Pipeline(NeuralNet &neuralNet, std::vector<int> stageLayers, int microBatches, NeuralNet::PipelineSchedule schedule);
+
+        static std::vector<int> balance(NeuralNet &neuralNet, int stages);
+
+        BatchResult runEpoch(Dataset &data);
+        std::vector<double> utilization();
+
+        friend std::ostream &operator<<(std::ostream &out, Pipeline &pipeline);
+    };
+}
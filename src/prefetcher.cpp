@@ -0,0 +1,259 @@
+#include "prefetcher.h"
+
+#include <stdexcept>
+#include <utility>
+
+namespace cave
+{
+    Prefetcher::Prefetcher(Dataset &source, int threads, int depth) : source_(source), threads_(threads), depth_(depth)
+    {
+        if (threads < 1 || depth < 1)
+        {
+            throw std::invalid_argument("Prefetcher needs at least one thread and a depth of at least one.");
+        }
+    }
+
+    Prefetcher::~Prefetcher()
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stop();
+    }
+
+    void Prefetcher::produce()
+    {
+        while (true)
+        {
+            int index = next_++;
+
+            if (index >= source_.batches())
+            {
+                break;
+            }
+
+            Batch batch;
+            batch.index = index;
+            batch.input = spare();
+            batch.expected = spare();
+
+            // Datasets that hold their batches return them instead of
+            // filling the buffer.
+            Matrix &input = source_.input(index, batch.input);
+
+            if (&input != &batch.input)
+            {
+                batch.input = input;
+            }
+
+            Matrix &expected = source_.expected(index, batch.expected);
+
+            if (&expected != &batch.expected)
+            {
+                batch.expected = expected;
+            }
+
+            if (!queue_->push(std::move(batch)))
+            {
+                break;
+            }
+        }
+    }
+
+    /*
+     * Called with mtx_ held. Abandons any run in progress and starts
+     * producing from batch first to the end of the dataset.
+     */
+    void Prefetcher::start(int first)
+    {
+        stop();
+
+        int batches = source_.batches();
+
+        first_ = first;
+        remaining_ = batches - first;
+        delivered_.assign(batches, false);
+        next_ = first;
+
+        queue_ = std::make_unique<BlockingQueue<Batch>>(depth_);
+        running_ = true;
+
+        for (int i = 0; i < threads_; ++i)
+        {
+            producers_.emplace_back(&Prefetcher::produce, this);
+        }
+    }
+
+    void Prefetcher::stop()
+    {
+        if (!running_)
+        {
+            return;
+        }
+
+        queue_->close();
+
+        for (std::thread &producer : producers_)
+        {
+            producer.join();
+        }
+
+        producers_.clear();
+        ready_.clear();
+        running_ = false;
+    }
+
+    /*
+     * Called with mtx_ held. Takes batches off the queue until the one
+     * wanted arrives, keeping the others for the threads that want them.
+     */
+    Prefetcher::Entry &Prefetcher::entry(int batch)
+    {
+        auto found = ready_.find(batch);
+
+        if (found != ready_.end())
+        {
+            return found->second;
+        }
+
+        if (!running_ || batch < first_ || delivered_[batch])
+        {
+            start(batch);
+        }
+
+        while (true)
+        {
+            Batch next;
+
+            if (!queue_->take(next))
+            {
+                throw std::logic_error("Prefetching stopped before the batch was produced.");
+            }
+
+            int index = next.index;
+
+            delivered_[index] = true;
+            --remaining_;
+
+            Entry &entry = ready_[index];
+            entry.batch = std::move(next);
+
+            if (index == batch)
+            {
+                return entry;
+            }
+        }
+    }
+
+    void Prefetcher::release(int batch)
+    {
+        auto found = ready_.find(batch);
+        Entry &entry = found->second;
+
+        if (entry.inputTaken && entry.expectedTaken)
+        {
+            recycle(entry.batch.input);
+            recycle(entry.batch.expected);
+            ready_.erase(found);
+        }
+    }
+
+    void Prefetcher::recycle(Matrix &matrix)
+    {
+        std::lock_guard<std::mutex> lock(mtxSpare_);
+
+        if (matrix.rows() > 0 && int(spare_.size()) < 2 * (depth_ + threads_))
+        {
+            spare_.push_back(std::move(matrix));
+        }
+    }
+
+    Matrix Prefetcher::spare()
+    {
+        std::lock_guard<std::mutex> lock(mtxSpare_);
+
+        if (spare_.empty())
+        {
+            return Matrix();
+        }
+
+        Matrix matrix = std::move(spare_.back());
+        spare_.pop_back();
+
+        return matrix;
+    }
+
+    Matrix &Prefetcher::input(int batch, Matrix &buffer)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+
+        Entry &entry = this->entry(batch);
+
+        std::swap(buffer, entry.batch.input);
+        entry.inputTaken = true;
+        release(batch);
+
+        return buffer;
+    }
+
+    Matrix &Prefetcher::expected(int batch, Matrix &buffer)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+
+        Entry &entry = this->entry(batch);
+
+        std::swap(buffer, entry.batch.expected);
+        entry.expectedTaken = true;
+        release(batch);
+
+        return buffer;
+    }
+
+    /*
+     * Batches decoded ahead belong to the old epoch, so they are dropped.
+     */
+    void Prefetcher::beginEpoch(int epoch)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+
+        stop();
+        source_.beginEpoch(epoch);
+    }
+
+    /*
+     * Hands over the next batch in the order the producers finish them,
+     * starting a run from the first batch if none is in progress. Returns
+     * false once every batch of the run has been handed over; the next
+     * call starts another run. The batch's previous matrices are recycled.
+     */
+    bool Prefetcher::nextBatch(Batch &batch)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+
+        if (!running_)
+        {
+            start(0);
+        }
+
+        recycle(batch.input);
+        recycle(batch.expected);
+
+        if (!ready_.empty())
+        {
+            auto found = ready_.begin();
+            batch = std::move(found->second.batch);
+            ready_.erase(found);
+
+            return true;
+        }
+
+        if (remaining_ == 0 || !queue_->take(batch))
+        {
+            stop();
+            return false;
+        }
+
+        delivered_[batch.index] = true;
+        --remaining_;
+
+        return true;
+    }
+}
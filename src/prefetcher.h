@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+
+#include "dataset.h"
+#include "blockingqueue.h"
+
+namespace cave
+{
+    struct Batch
+    {
+        int index{0};
+        Matrix input;
+        Matrix expected;
+    };
+
+    /*
+     * Streams the batches of another dataset, decoding them on producer
+     * threads ahead of the trainer through a bounded queue, so decoding
+     * overlaps with compute and at most depth batches wait decoded.
+     *
+     * A run of batches starts at the first batch asked for and continues
+     * to the end of the dataset; asking for a batch already delivered, or
+     * one before the run, starts a new run there, as a new epoch does.
+     * Batches should therefore be asked for in roughly ascending order.
+     * input() and expected() hand over the decoded matrices by swapping
+     * them with the caller's buffers, which are recycled by the producers.
+     */
+    class Prefetcher : public Dataset
+    {
+    private:
+        struct Entry
+        {
+            Batch batch;
+            bool inputTaken{false};
+            bool expectedTaken{false};
+        };
+
+        Dataset &source_;
+        int threads_{1};
+        int depth_{4};
+
+        std::unique_ptr<BlockingQueue<Batch>> queue_;
+        std::vector<std::thread> producers_;
+        std::atomic<int> next_{0};
+
+        std::mutex mtx_;
+        std::map<int, Entry> ready_;
+        std::vector<bool> delivered_;
+        int first_{0};
+        int remaining_{0};
+        bool running_{false};
+
+        std::mutex mtxSpare_;
+        std::vector<Matrix> spare_;
+
+    private:
+        void produce();
+        void start(int first);
+        void stop();
+        Entry &entry(int batch);
+        void release(int batch);
+        void recycle(Matrix &matrix);
+        Matrix spare();
+
+    public:
+        Prefetcher(Dataset &source, int threads = 1, int depth = 4);
+        ~Prefetcher();
+
+        Prefetcher(const Prefetcher &) = delete;
+        Prefetcher &operator=(const Prefetcher &) = delete;
+
+        bool nextBatch(Batch &batch);
+
+        int batches() { return source_.batches(); }
+        int inputSize() { return source_.inputSize(); }
+        int items(int batch) { return source_.items(batch); }
+
+        Matrix &input(int batch, Matrix &buffer);
+        Matrix &expected(int batch, Matrix &buffer);
+
+        void firstTouch(const Topology &topology) { source_.firstTouch(topology); }
+        void beginEpoch(int epoch);
+    };
+}
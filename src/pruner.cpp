@@ -0,0 +1,274 @@
+#include "pruner.h"
+
+#include <cmath>
+#include <iomanip>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+
+namespace cave
+{
+    Pruner::Pruner(NeuralNet &neuralNet, Criterion criterion) : neuralNet_(neuralNet), criterion_(criterion)
+    {
+    }
+
+    int Pruner::weightIndex(int layer)
+    {
+        auto &indices = neuralNet_.weightIndices_;
+
+        return std::find(indices.begin(), indices.end(), layer) - indices.begin();
+    }
+
+    /*
+     * The DENSE layer that consumes layer's neurons. Only element-wise
+     * transforms may sit in between, since their rows can be compacted too.
+     */
+    int Pruner::nextDense(int layer)
+    {
+        auto &transforms = neuralNet_.transforms_;
+
+        if (layer < 0 || layer >= int(transforms.size()) || transforms[layer] != NeuralNet::DENSE)
+        {
+            std::stringstream ss;
+            ss << "Layer " << layer << " is not a DENSE layer.";
+            throw std::invalid_argument(ss.str());
+        }
+
+        for (std::size_t i = layer + 1; i < transforms.size(); ++i)
+        {
+            switch (transforms[i])
+            {
+            case NeuralNet::DENSE:
+                return i;
+            case NeuralNet::RELU:
+            case NeuralNet::DROPOUT:
+            case NeuralNet::BATCHNORM:
+                continue;
+            default:
+            {
+                std::stringstream ss;
+                ss << "Layer " << layer << " feeds " << neuralNet_.transformNames_[transforms[i]] << ", not a DENSE layer.";
+                throw std::logic_error(ss.str());
+            }
+            }
+        }
+
+        throw std::logic_error("Only DENSE layers followed by another DENSE layer can be pruned.");
+    }
+
+    std::vector<double> Pruner::rank(int layer, Dataset &data)
+    {
+        int next = nextDense(layer);
+
+        Matrix &weight = neuralNet_.weights_[weightIndex(layer)];
+        Matrix &nextWeight = neuralNet_.weights_[weightIndex(next)];
+
+        int neurons = weight.rows();
+        std::vector<double> scores(neurons, 0);
+
+        for (int row = 0; row < nextWeight.rows(); ++row)
+        {
+            for (int neuron = 0; neuron < neurons; ++neuron)
+            {
+                double value = nextWeight.data()[row * neurons + neuron];
+                scores[neuron] += value * value;
+            }
+        }
+
+        Matrix activations;
+
+        if (criterion_ == ACTIVATION)
+        {
+            neuralNet_.setCollectActivations(true);
+            neuralNet_.evaluate(data);
+            neuralNet_.setCollectActivations(false);
+
+            // The input of the next DENSE layer, after any ReLU or dropout.
+            activations = neuralNet_.getActivationMeans()[next];
+
+            if (activations.rows() != neurons)
+            {
+                throw std::logic_error("No activation statistics for the pruned layer; disable checkpointing to rank by activation.");
+            }
+        }
+
+        for (int neuron = 0; neuron < neurons; ++neuron)
+        {
+            double strength = 0;
+
+            if (criterion_ == ACTIVATION)
+            {
+                strength = activations[neuron];
+            }
+            else
+            {
+                const double *row = weight.data() + neuron * weight.cols();
+                strength = std::sqrt(std::inner_product(row, row + weight.cols(), row, 0.0));
+            }
+
+            scores[neuron] = std::sqrt(scores[neuron]) * strength;
+        }
+
+        return scores;
+    }
+
+    /*
+     * Reduces layer to its highest-ranked neurons, kept in their original
+     * order, then fine-tunes on data if fine-tuning epochs were set.
+     */
+    void Pruner::prune(int layer, int neurons, Dataset &data)
+    {
+        int next = nextDense(layer);
+        int index = weightIndex(layer);
+        int nextIndex = weightIndex(next);
+
+        int current = neuralNet_.weights_[index].rows();
+
+        if (neurons < 1 || neurons > current)
+        {
+            std::stringstream ss;
+            ss << "Cannot prune layer " << layer << " from " << current << " to " << neurons << " neurons.";
+            throw std::invalid_argument(ss.str());
+        }
+
+        std::vector<double> scores = rank(layer, data);
+
+        std::vector<int> keep(current);
+        std::iota(keep.begin(), keep.end(), 0);
+        std::stable_sort(keep.begin(), keep.end(), [&](int a, int b)
+                         { return scores[a] > scores[b]; });
+        keep.resize(neurons);
+        std::sort(keep.begin(), keep.end());
+
+        auto keepRows = [&](Matrix &matrix)
+        {
+            if (matrix.rows() == 0)
+            {
+                return;
+            }
+
+            int cols = matrix.cols();
+            Matrix compacted(neurons, cols);
+
+            for (int row = 0; row < neurons; ++row)
+            {
+                std::copy_n(matrix.data() + keep[row] * cols, cols, compacted.data() + row * cols);
+            }
+
+            matrix = compacted;
+        };
+
+        {
+            std::lock_guard<std::mutex> lock(neuralNet_.mtxWeights_);
+
+            for (int i = index; i < nextIndex; ++i)
+            {
+                // The layer itself and any BATCHNORM before the next layer.
+                keepRows(neuralNet_.weights_[i]);
+                keepRows(neuralNet_.biases_[i]);
+                keepRows(neuralNet_.runningMeans_[i]);
+                keepRows(neuralNet_.runningVariances_[i]);
+            }
+
+            for (int i = layer + 1; i < next; ++i)
+            {
+                if (neuralNet_.transforms_[i] == NeuralNet::BATCHNORM)
+                {
+                    neuralNet_.configs_[i].channels = neurons;
+                }
+            }
+
+            Matrix &nextWeight = neuralNet_.weights_[nextIndex];
+            Matrix compacted(nextWeight.rows(), neurons);
+
+            for (int row = 0; row < nextWeight.rows(); ++row)
+            {
+                for (int col = 0; col < neurons; ++col)
+                {
+                    compacted.data()[row * neurons + col] = nextWeight.data()[row * current + keep[col]];
+                }
+            }
+
+            nextWeight = compacted;
+            neuralNet_.invalidate();
+        }
+
+        if (fineTuneEpochs_ > 0)
+        {
+            int epochs = neuralNet_.epochs_;
+
+            neuralNet_.setEpochs(fineTuneEpochs_);
+            neuralNet_.fit(data);
+            neuralNet_.setEpochs(epochs);
+        }
+    }
+
+    Pruner::Step Pruner::measure(int layer, Dataset &evalData)
+    {
+        Step step;
+        step.neurons = neuralNet_.weights_[weightIndex(layer)].rows();
+        step.parameters = neuralNet_.parameterCount();
+        step.flops = neuralNet_.flops();
+        step.accuracy = neuralNet_.evaluate(evalData);
+
+        return step;
+    }
+
+    /*
+     * Prunes layer to each of sizes in turn, largest first, fine-tuning
+     * after every step, and measures accuracy on the evaluation data. The
+     * first step is the unpruned network; the network is left at the
+     * smallest size.
+     */
+    std::vector<Pruner::Step> Pruner::sweep(int layer, std::vector<int> sizes, Dataset &data, Dataset &evalData)
+    {
+        std::vector<Step> steps;
+        steps.push_back(measure(layer, evalData));
+
+        std::sort(sizes.rbegin(), sizes.rend());
+
+        for (int neurons : sizes)
+        {
+            if (neurons >= steps.back().neurons)
+            {
+                continue;
+            }
+
+            prune(layer, neurons, data);
+            steps.push_back(measure(layer, evalData));
+        }
+
+        return steps;
+    }
+
+    std::ostream &operator<<(std::ostream &out, const std::vector<Pruner::Step> &steps)
+    {
+        if (steps.empty())
+        {
+            return out;
+        }
+
+        const Pruner::Step &full = steps.front();
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+
+        out << std::setw(8) << "Neurons" << std::setw(12) << "Parameters" << std::setw(10) << "Size"
+            << std::setw(14) << "FLOPs/item" << std::setw(10) << "Accuracy" << std::endl;
+
+        out << std::fixed;
+
+        for (const Pruner::Step &step : steps)
+        {
+            out << std::setw(8) << step.neurons << std::setw(12) << step.parameters
+                << std::setprecision(2) << std::setw(9) << 100.0 * step.parameters / full.parameters << "%"
+                << std::setprecision(0) << std::setw(14) << step.flops
+                << std::setprecision(2) << std::setw(9) << 100.0 * step.accuracy << "%" << std::endl;
+        }
+
+        out.flags(flags);
+        out.precision(precision);
+
+        return out;
+    }
+}
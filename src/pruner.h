@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <iostream>
+
+#include "neuralnet.h"
+
+namespace cave
+{
+    /*
+     * Structured pruning of DENSE layers: whole hidden neurons are ranked,
+     * and the weakest are removed along with their rows in the layer's
+     * weights and biases and their columns in the next DENSE layer, so the
+     * result is a genuinely smaller network rather than a masked one.
+     *
+     * A neuron's rank is the norm of its outgoing weights times either the
+     * norm of its incoming weights (WEIGHT_NORM) or its mean absolute
+     * activation over a dataset (ACTIVATION), as recorded by evaluate().
+     */
+    class Pruner
+    {
+    public:
+        enum Criterion
+        {
+            WEIGHT_NORM = 0,
+            ACTIVATION = 1,
+        };
+
+        /*
+         * One point on an accuracy-versus-size curve.
+         */
+        struct Step
+        {
+            int neurons{0};
+            int parameters{0};
+            double flops{0};
+            double accuracy{0};
+        };
+
+    private:
+        NeuralNet &neuralNet_;
+        Criterion criterion_{WEIGHT_NORM};
+        int fineTuneEpochs_{0};
+
+    private:
+        int weightIndex(int layer);
+        int nextDense(int layer);
+        Step measure(int layer, Dataset &evalData);
+
+    public:
+        Pruner(NeuralNet &neuralNet, Criterion criterion = WEIGHT_NORM);
+
+        void setFineTuneEpochs(int epochs) { fineTuneEpochs_ = epochs; }
+
+        std::vector<double> rank(int layer, Dataset &data);
+        void prune(int layer, int neurons, Dataset &data);
+        std::vector<Step> sweep(int layer, std::vector<int> sizes, Dataset &data, Dataset &evalData);
+    };
+
+    std::ostream &operator<<(std::ostream &out, const std::vector<Pruner::Step> &steps);
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <random>
+#include <utility>
+
+namespace cave
+{
+    /*
+     * Philox4x32-10 counter-based generator (Salmon et al., "Parallel Random
+     * Numbers: As Easy as 1, 2, 3"). Each value is a pure function of the
+     * seed, a stream id and its index within the stream, so any thread can
+     * produce any part of a sequence without shared state, and results do not
+     * depend on how work was scheduled.
+     */
+    class Philox
+    {
+    private:
+        std::uint32_t key_[2];
+
+        static void round(std::uint32_t counter[4], const std::uint32_t key[2])
+        {
+            std::uint64_t product0 = std::uint64_t(0xD2511F53) * counter[0];
+            std::uint64_t product1 = std::uint64_t(0xCD9E8D57) * counter[2];
+
+            std::uint32_t hi0 = product0 >> 32;
+            std::uint32_t lo0 = std::uint32_t(product0);
+            std::uint32_t hi1 = product1 >> 32;
+            std::uint32_t lo1 = std::uint32_t(product1);
+
+            counter[0] = hi1 ^ counter[1] ^ key[0];
+            counter[1] = lo1;
+            counter[2] = hi0 ^ counter[3] ^ key[1];
+            counter[3] = lo0;
+        }
+
+    public:
+        explicit Philox(std::uint64_t seed)
+        {
+            key_[0] = std::uint32_t(seed);
+            key_[1] = std::uint32_t(seed >> 32);
+        }
+
+        static std::uint64_t randomSeed()
+        {
+            std::random_device rd;
+
+            return (std::uint64_t(rd()) << 32) ^ rd();
+        }
+
+        /*
+         * Combines ids such as epoch, batch and layer into one stream id.
+         */
+        static std::uint64_t stream(std::uint64_t a, std::uint64_t b = 0, std::uint64_t c = 0)
+        {
+            std::uint64_t result = 0;
+
+            for (std::uint64_t value : {a, b, c})
+            {
+                // splitmix64 finalizer
+                result += value + 0x9E3779B97F4A7C15ULL;
+                result = (result ^ (result >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                result = (result ^ (result >> 27)) * 0x94D049BB133111EBULL;
+                result ^= result >> 31;
+            }
+
+            return result;
+        }
+
+        /*
+         * The four 32-bit words at position counter of stream.
+         */
+        void block(std::uint64_t stream, std::uint64_t counter, std::uint32_t out[4]) const
+        {
+            out[0] = std::uint32_t(counter);
+            out[1] = std::uint32_t(counter >> 32);
+            out[2] = std::uint32_t(stream);
+            out[3] = std::uint32_t(stream >> 32);
+
+            std::uint32_t key[2] = {key_[0], key_[1]};
+
+            for (int i = 0; i < 10; ++i)
+            {
+                round(out, key);
+                key[0] += 0x9E3779B9;
+                key[1] += 0xBB67AE85;
+            }
+        }
+
+        static double toUniform(std::uint32_t word)
+        {
+            // (0, 1], so the result can safely go into a logarithm.
+            return (word + 1.0) * (1.0 / 4294967296.0);
+        }
+
+        /*
+         * Element index of stream as a uniform double in (0, 1].
+         */
+        double uniform(std::uint64_t stream, std::uint64_t index) const
+        {
+            std::uint32_t words[4];
+            block(stream, index / 4, words);
+
+            return toUniform(words[index % 4]);
+        }
+
+        void fillUniform(double *values, std::size_t count, std::uint64_t stream) const
+        {
+            std::uint32_t words[4];
+
+            for (std::size_t i = 0; i < count; i += 4)
+            {
+                block(stream, i / 4, words);
+
+                for (std::size_t lane = 0; lane < 4 && i + lane < count; ++lane)
+                {
+                    values[i + lane] = toUniform(words[lane]);
+                }
+            }
+        }
+
+        /*
+         * Fisher-Yates shuffle drawing from stream, so the same seed and
+         * stream always give the same permutation.
+         */
+        template <typename E>
+        void shuffle(E *values, std::size_t count, std::uint64_t stream) const
+        {
+            std::uint32_t words[4];
+
+            for (std::size_t i = count; i > 1; --i)
+            {
+                std::size_t index = count - i;
+
+                if (index % 4 == 0)
+                {
+                    block(stream, index / 4, words);
+                }
+
+                // Multiply-shift maps the word onto [0, i) without division.
+                std::size_t j = (std::uint64_t(words[index % 4]) * i) >> 32;
+
+                std::swap(values[i - 1], values[j]);
+            }
+        }
+
+        /*
+         * Standard normal values by Box-Muller, two per pair of words.
+         */
+        void fillNormal(double *values, std::size_t count, std::uint64_t stream) const
+        {
+            const double twoPi = 6.283185307179586;
+
+            std::uint32_t words[4];
+
+            for (std::size_t i = 0; i < count; i += 4)
+            {
+                block(stream, i / 4, words);
+
+                for (std::size_t pair = 0; pair < 4; pair += 2)
+                {
+                    double radius = std::sqrt(-2.0 * std::log(toUniform(words[pair])));
+                    double angle = twoPi * toUniform(words[pair + 1]);
+
+                    if (i + pair < count)
+                    {
+                        values[i + pair] = radius * std::cos(angle);
+                    }
+
+                    if (i + pair + 1 < count)
+                    {
+                        values[i + pair + 1] = radius * std::sin(angle);
+                    }
+                }
+            }
+        }
+    };
+}
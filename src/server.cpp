@@ -0,0 +1,469 @@
+#include "server.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <iomanip>
+#include <stdexcept>
+#include <sstream>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace cave
+{
+    namespace
+    {
+        // Latencies kept for the percentiles; older ones are overwritten.
+        const std::size_t latencyWindow = 100000;
+
+        std::string systemError(std::string message)
+        {
+            return message + ": " + std::strerror(errno);
+        }
+
+        bool readFully(int fd, void *buffer, std::size_t bytes)
+        {
+            char *target = static_cast<char *>(buffer);
+
+            while (bytes > 0)
+            {
+                ssize_t count = read(fd, target, bytes);
+
+                if (count <= 0)
+                {
+                    return false;
+                }
+
+                target += count;
+                bytes -= count;
+            }
+
+            return true;
+        }
+
+        bool writeFully(int fd, const void *buffer, std::size_t bytes)
+        {
+            const char *source = static_cast<const char *>(buffer);
+
+            while (bytes > 0)
+            {
+                ssize_t count = send(fd, source, bytes, MSG_NOSIGNAL);
+
+                if (count <= 0)
+                {
+                    return false;
+                }
+
+                source += count;
+                bytes -= count;
+            }
+
+            return true;
+        }
+
+        bool writeValues(int fd, const double *values, std::int32_t count)
+        {
+            return writeFully(fd, &count, sizeof(count)) && writeFully(fd, values, sizeof(double) * count);
+        }
+    }
+
+    InferenceServer::InferenceServer(std::string modelFile, std::string socketPath) : model_(modelFile), socketPath_(socketPath)
+    {
+        inputSize_ = model_.acquire()->inputSize();
+
+        if (inputSize_ == 0)
+        {
+            throw std::logic_error("Model '" + modelFile + "' does not define its input size.");
+        }
+    }
+
+    /*
+     * Loads the new model fully before publishing it; clients never see a
+     * partly loaded one. The input size cannot change, since clients were
+     * told it by the protocol.
+     */
+    void InferenceServer::reload(std::string modelFile)
+    {
+        auto model = std::make_shared<NeuralNet>();
+        model->load(modelFile);
+
+        if (model->inputSize() != inputSize_)
+        {
+            std::stringstream ss;
+            ss << "Model '" << modelFile << "' takes " << model->inputSize() << " inputs, not " << inputSize_ << ".";
+            throw std::logic_error(ss.str());
+        }
+
+        model_.publish(model);
+    }
+
+    InferenceServer::~InferenceServer()
+    {
+        stop();
+    }
+
+    void InferenceServer::start()
+    {
+        if (running_)
+        {
+            return;
+        }
+
+        listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (listener_ < 0)
+        {
+            throw std::runtime_error(systemError("Unable to create server socket"));
+        }
+
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socketPath_.c_str(), sizeof(address.sun_path) - 1);
+
+        unlink(socketPath_.c_str());
+
+        if (bind(listener_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener_, SOMAXCONN) != 0)
+        {
+            close(listener_);
+            listener_ = -1;
+            throw std::runtime_error(systemError("Unable to listen on " + socketPath_));
+        }
+
+        started_ = std::chrono::steady_clock::now();
+        running_ = true;
+
+        for (int i = 0; i < threads_; ++i)
+        {
+            workers_.emplace_back(&InferenceServer::work, this);
+        }
+
+        acceptor_ = std::thread(&InferenceServer::accept, this);
+    }
+
+    /*
+     * Stops accepting, closes every connection and lets the workers finish
+     * the requests already queued.
+     */
+    void InferenceServer::stop()
+    {
+        if (!running_.exchange(false))
+        {
+            return;
+        }
+
+        shutdown(listener_, SHUT_RDWR);
+        acceptor_.join();
+        close(listener_);
+        listener_ = -1;
+        unlink(socketPath_.c_str());
+
+        {
+            std::lock_guard<std::mutex> lock(mtxConnections_);
+
+            for (int connection : connections_)
+            {
+                shutdown(connection, SHUT_RDWR);
+            }
+        }
+
+        {
+            // Taking the lock orders the flag with a worker about to wait.
+            std::lock_guard<std::mutex> lock(mtxPending_);
+        }
+
+        pendingCond_.notify_all();
+
+        for (std::thread &worker : workers_)
+        {
+            worker.join();
+        }
+
+        workers_.clear();
+
+        std::unique_lock<std::mutex> lock(mtxConnections_);
+
+        handlersCond_.wait(lock, [this]()
+                           { return handlers_ == 0; });
+    }
+
+    void InferenceServer::accept()
+    {
+        while (running_)
+        {
+            int connection = ::accept(listener_, nullptr, nullptr);
+
+            if (connection < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                break;
+            }
+
+            std::lock_guard<std::mutex> lock(mtxConnections_);
+
+            if (!running_)
+            {
+                close(connection);
+                break;
+            }
+
+            connections_.push_back(connection);
+            ++handlers_;
+
+            std::thread(&InferenceServer::serve, this, connection).detach();
+        }
+    }
+
+    void InferenceServer::serve(int connection)
+    {
+        while (running_)
+        {
+            std::int32_t size = 0;
+
+            if (!readFully(connection, &size, sizeof(size)))
+            {
+                break;
+            }
+
+            if (size == 0)
+            {
+                ServerStatistics current = statistics();
+                double values[] = {double(current.requests), double(current.batches), current.throughput, current.p50, current.p99};
+
+                if (!writeValues(connection, values, 5))
+                {
+                    break;
+                }
+
+                continue;
+            }
+
+            if (size != inputSize_)
+            {
+                std::int32_t rejected = -1;
+                writeFully(connection, &rejected, sizeof(rejected));
+                break;
+            }
+
+            Matrix input(size, 1);
+
+            if (!readFully(connection, input.data(), sizeof(double) * size))
+            {
+                break;
+            }
+
+            Matrix output;
+
+            try
+            {
+                output = predict(input);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Prediction failed: " << e.what() << std::endl;
+                break;
+            }
+
+            if (!writeValues(connection, output.data(), output.rows()))
+            {
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mtxConnections_);
+
+        connections_.erase(std::remove(connections_.begin(), connections_.end(), connection), connections_.end());
+        close(connection);
+
+        // stop() may return, and the server be destroyed, once this lock is released.
+        --handlers_;
+        handlersCond_.notify_all();
+    }
+
+    /*
+     * Queues one item and waits for its batch to be run.
+     */
+    Matrix InferenceServer::predict(Matrix input)
+    {
+        auto request = std::make_shared<Request>();
+        request->input = input;
+        request->arrival = std::chrono::steady_clock::now();
+
+        std::future<Matrix> output = request->output.get_future();
+
+        {
+            std::lock_guard<std::mutex> lock(mtxPending_);
+
+            if (!running_)
+            {
+                throw std::logic_error("The server is not running.");
+            }
+
+            pending_.push_back(request);
+        }
+
+        pendingCond_.notify_all();
+
+        return output.get();
+    }
+
+    void InferenceServer::work()
+    {
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(mtxPending_);
+
+            pendingCond_.wait(lock, [this]()
+                              { return !running_ || !pending_.empty(); });
+
+            if (pending_.empty())
+            {
+                break;
+            }
+
+            auto deadline = pending_.front()->arrival + maxDelay_;
+
+            pendingCond_.wait_until(lock, deadline, [this]()
+                                    { return !running_ || int(pending_.size()) >= maxBatch_; });
+
+            // Another worker may have taken the queued requests meanwhile.
+            int items = std::min(int(pending_.size()), maxBatch_);
+
+            if (items == 0)
+            {
+                continue;
+            }
+
+            std::vector<std::shared_ptr<Request>> batch(pending_.begin(), pending_.begin() + items);
+            pending_.erase(pending_.begin(), pending_.begin() + items);
+
+            lock.unlock();
+
+            runBatch(batch);
+        }
+    }
+
+    void InferenceServer::runBatch(std::vector<std::shared_ptr<Request>> &batch)
+    {
+        int items = batch.size();
+        Matrix input(inputSize_, items);
+
+        for (int col = 0; col < items; ++col)
+        {
+            const Matrix &item = batch[col]->input;
+
+            for (int row = 0; row < inputSize_; ++row)
+            {
+                input.data()[row * items + col] = item[row];
+            }
+        }
+
+        Matrix output;
+        std::exception_ptr error;
+
+        try
+        {
+            std::shared_ptr<NeuralNet> model = model_.acquire();
+            output = model->predict(input);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        // Counted before replying, so a client sees its own request in the statistics.
+        {
+            auto now = std::chrono::steady_clock::now();
+
+            std::lock_guard<std::mutex> lock(mtxStatistics_);
+
+            latencies_.resize(std::min(latencyWindow, latencyCount_ + items));
+
+            for (auto &request : batch)
+            {
+                std::chrono::duration<double, std::milli> latency = now - request->arrival;
+                latencies_[latencyCount_++ % latencyWindow] = latency.count();
+            }
+
+            requests_ += items;
+            ++batches_;
+        }
+
+        for (int col = 0; col < items; ++col)
+        {
+            if (error)
+            {
+                batch[col]->output.set_exception(error);
+            }
+            else
+            {
+                batch[col]->output.set_value(output.columns(col, 1));
+            }
+        }
+    }
+
+    /*
+     * Percentiles are over the most recent requests; throughput is averaged
+     * since start().
+     */
+    ServerStatistics InferenceServer::statistics()
+    {
+        std::vector<double> latencies;
+        ServerStatistics result;
+
+        {
+            std::lock_guard<std::mutex> lock(mtxStatistics_);
+
+            latencies = latencies_;
+            result.requests = requests_;
+            result.batches = batches_;
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started_;
+
+        if (elapsed.count() > 0)
+        {
+            result.throughput = result.requests / elapsed.count();
+        }
+
+        if (latencies.empty())
+        {
+            return result;
+        }
+
+        auto percentile = [&](double fraction)
+        {
+            auto position = latencies.begin() + std::size_t(fraction * (latencies.size() - 1));
+            std::nth_element(latencies.begin(), position, latencies.end());
+            return *position;
+        };
+
+        result.p50 = percentile(0.5);
+        result.p99 = percentile(0.99);
+
+        return result;
+    }
+
+    std::ostream &operator<<(std::ostream &out, const ServerStatistics &statistics)
+    {
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+
+        double batchSize = statistics.batches > 0 ? double(statistics.requests) / statistics.batches : 0;
+
+        out << std::fixed << std::setprecision(2);
+        out << "Requests: " << statistics.requests << ", batches: " << statistics.batches;
+        out << " (mean " << batchSize << " items), " << statistics.throughput << " requests/s";
+        out << ", latency p50 " << statistics.p50 << " ms, p99 " << statistics.p99 << " ms";
+
+        out.flags(flags);
+        out.precision(precision);
+
+        return out;
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "neuralnet.h"
+#include "modelhandle.h"
+
+namespace cave
+{
+    struct ServerStatistics
+    {
+        long requests{0};
+        long batches{0};
+        double throughput{0};
+        double p50{0};
+        double p99{0};
+    };
+
+    /*
+     * Serves predictions from a saved model over a Unix domain socket.
+     *
+     * Requests that arrive close together are coalesced into one batch, so
+     * the network runs one matrix-matrix product instead of many
+     * matrix-vector ones. A batch is dispatched once it holds maxBatch items
+     * or its oldest request has waited maxDelay; each worker thread forms
+     * and runs its own batches, so one batch can fill while another runs.
+     *
+     * Protocol, in native byte order: a request is an int32 item size n
+     * followed by n doubles; the reply is an int32 m followed by m doubles.
+     * A request with n = 0 asks for statistics: requests, batches,
+     * throughput per second, and p50 and p99 latency in milliseconds. A
+     * wrong size is answered with m = -1 and the connection is closed. Each
+     * connection has one request in flight; clients open several
+     * connections for concurrency.
+     *
+     * reload() swaps in a new model while serving: batches already running
+     * finish on the old one.
+     */
+    class InferenceServer
+    {
+    private:
+        struct Request
+        {
+            Matrix input;
+            std::promise<Matrix> output;
+            std::chrono::steady_clock::time_point arrival;
+        };
+
+    private:
+        ModelHandle model_;
+        int inputSize_{0};
+
+        std::string socketPath_;
+        int threads_{4};
+        int maxBatch_{32};
+        std::chrono::microseconds maxDelay_{2000};
+
+        std::atomic<bool> running_{false};
+        int listener_{-1};
+        std::thread acceptor_;
+        std::vector<std::thread> workers_;
+
+        // Handlers are detached and counted, so finished ones need no joining.
+        std::mutex mtxConnections_;
+        std::condition_variable handlersCond_;
+        std::vector<int> connections_;
+        int handlers_{0};
+
+        std::mutex mtxPending_;
+        std::condition_variable pendingCond_;
+        std::deque<std::shared_ptr<Request>> pending_;
+
+        std::mutex mtxStatistics_;
+        std::vector<double> latencies_;
+        std::size_t latencyCount_{0};
+        long requests_{0};
+        long batches_{0};
+        std::chrono::steady_clock::time_point started_;
+
+    private:
+        void accept();
+        void serve(int connection);
+        void work();
+        void runBatch(std::vector<std::shared_ptr<Request>> &batch);
+
+    public:
+        InferenceServer(std::string modelFile, std::string socketPath);
+        ~InferenceServer();
+
+        void setThreads(int threads) { threads_ = threads; }
+        void setMaxBatch(int items) { maxBatch_ = items; }
+        void setMaxDelay(int microseconds) { maxDelay_ = std::chrono::microseconds(microseconds); }
+
+        void start();
+        void stop();
+        void reload(std::string modelFile);
+        long modelVersion() const { return model_.version(); }
+
+        Matrix predict(Matrix input);
+        ServerStatistics statistics();
+    };
+
+    std::ostream &operator<<(std::ostream &out, const ServerStatistics &statistics);
+}
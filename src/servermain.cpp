@@ -0,0 +1,99 @@
+#include <iostream>
+#include <string>
+#include <csignal>
+#include <ctime>
+
+#include "server.h"
+#include "fileutil.h"
+
+using namespace cave;
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3 || argc > 6)
+    {
+        std::cout << "usage: " << argv[0] << " <model file> <socket path> [threads] [max batch] [max delay us]" << std::endl;
+        return 0;
+    }
+
+    std::string modelFile = argv[1];
+    std::string socketPath = argv[2];
+
+    // Handled by sigtimedwait below; blocked before any thread starts so
+    // every thread inherits the mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    try
+    {
+        InferenceServer server(modelFile, socketPath);
+
+        if (argc > 3)
+        {
+            server.setThreads(std::stoi(argv[3]));
+        }
+
+        if (argc > 4)
+        {
+            server.setMaxBatch(std::stoi(argv[4]));
+        }
+
+        if (argc > 5)
+        {
+            server.setMaxDelay(std::stoi(argv[5]));
+        }
+
+        server.start();
+
+        std::cout << "Serving '" << modelFile << "' on " << socketPath << std::endl;
+
+        timespec interval{10, 0};
+
+        while (true)
+        {
+            int signal = sigtimedwait(&signals, nullptr, &interval);
+
+            if (signal < 0)
+            {
+                std::cout << server.statistics() << std::endl;
+            }
+            else if (signal == SIGHUP)
+            {
+                // Retrained models are picked up without dropping requests.
+                try
+                {
+                    server.reload(modelFile);
+                    std::cout << "Reloaded '" << modelFile << "' as version " << server.modelVersion() << std::endl;
+                }
+                catch (const std::exception &e)
+                {
+                    std::cerr << "Reload of '" << modelFile << "' failed: " << e.what() << std::endl;
+                }
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        server.stop();
+
+        std::cout << server.statistics() << std::endl;
+    }
+    catch (const FileException &e)
+    {
+        std::cerr << "'" << modelFile << "': " << e.what() << std::endl;
+        return 1;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,401 @@
+#include "tensor.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <numeric>
+
+#include "matrixfunctions.h"
+
+namespace cave
+{
+    std::vector<std::size_t> Tensor::contiguousStrides(const std::vector<int> &shape)
+    {
+        std::vector<std::size_t> strides(shape.size());
+        std::size_t stride = 1;
+
+        for (int axis = int(shape.size()) - 1; axis >= 0; --axis)
+        {
+            strides[axis] = stride;
+            stride *= shape[axis];
+        }
+
+        return strides;
+    }
+
+    Tensor::Tensor(std::vector<int> shape, Layout layout) : shape_(shape), layout_(layout)
+    {
+        for (int extent : shape_)
+        {
+            if (extent < 0)
+            {
+                throw std::invalid_argument("Tensor dimensions cannot be negative.");
+            }
+        }
+
+        strides_ = contiguousStrides(shape_);
+        buffer_ = std::make_shared<std::vector<double>>(size());
+        base_ = buffer_->data();
+    }
+
+    /*
+     * Takes over the matrix's storage rather than copying it. A named
+     * factory rather than a constructor, since Tensor({rows, cols}) would
+     * otherwise be ambiguous with Matrix(rows, cols).
+     */
+    Tensor Tensor::fromMatrix(Matrix matrix)
+    {
+        Tensor result;
+        result.shape_ = {matrix.rows_, matrix.cols_};
+        result.strides_ = contiguousStrides(result.shape_);
+        result.buffer_ = std::make_shared<std::vector<double>>(std::move(matrix.v_));
+        result.base_ = result.buffer_->data();
+
+        return result;
+    }
+
+    /*
+     * A contiguous view of the matrix's data in the given shape, which must
+     * hold as many elements. Nothing is copied, so the view is only valid
+     * while the matrix lives and keeps its size.
+     */
+    Tensor Tensor::view(Matrix &matrix, std::vector<int> shape)
+    {
+        Tensor result;
+        result.shape_ = shape;
+        result.strides_ = contiguousStrides(shape);
+        result.base_ = matrix.data();
+
+        if (result.size() != std::size_t(matrix.rows()) * matrix.cols())
+        {
+            std::stringstream ss;
+            ss << "Cannot view a " << matrix.rows() << " x " << matrix.cols() << " matrix as " << result.size() << " elements.";
+            throw std::invalid_argument(ss.str());
+        }
+
+        return result;
+    }
+
+    const Tensor Tensor::view(const Matrix &matrix, std::vector<int> shape)
+    {
+        return view(const_cast<Matrix &>(matrix), shape);
+    }
+
+    /*
+     * Views a NeuralNet batch, one channels x height x width sample per
+     * column, as an NCHW tensor without moving any data.
+     */
+    Tensor Tensor::fromColumns(Matrix matrix, int channels, int height, int width)
+    {
+        if (matrix.rows() != channels * height * width)
+        {
+            std::stringstream ss;
+            ss << "Cannot view " << matrix.rows() << " rows as " << channels << " x " << height << " x " << width << ".";
+            throw std::invalid_argument(ss.str());
+        }
+
+        int items = matrix.cols();
+
+        return fromMatrix(std::move(matrix)).reshape({channels, height, width, items}).permute({3, 0, 1, 2});
+    }
+
+    std::size_t Tensor::size() const
+    {
+        std::size_t count = 1;
+
+        for (int extent : shape_)
+        {
+            count *= extent;
+        }
+
+        return count;
+    }
+
+    bool Tensor::isContiguous() const
+    {
+        return strides_ == contiguousStrides(shape_);
+    }
+
+    std::size_t Tensor::position(const std::vector<int> &index) const
+    {
+        if (index.size() != shape_.size())
+        {
+            throw std::invalid_argument("Index rank does not match tensor rank.");
+        }
+
+        std::size_t result = offset_;
+
+        for (std::size_t axis = 0; axis < index.size(); ++axis)
+        {
+            result += index[axis] * strides_[axis];
+        }
+
+        return result;
+    }
+
+    /*
+     * A view when the tensor is contiguous, otherwise a reshaped copy. One
+     * dimension may be -1, in which case it is inferred.
+     */
+    Tensor Tensor::reshape(std::vector<int> shape) const
+    {
+        std::size_t known = 1;
+        int inferred = -1;
+
+        for (std::size_t axis = 0; axis < shape.size(); ++axis)
+        {
+            if (shape[axis] == -1 && inferred < 0)
+            {
+                inferred = axis;
+            }
+            else
+            {
+                known *= shape[axis];
+            }
+        }
+
+        if (inferred >= 0 && known != 0)
+        {
+            shape[inferred] = size() / known;
+            known *= shape[inferred];
+        }
+
+        if (known != size())
+        {
+            throw std::invalid_argument("Reshape must keep the number of elements.");
+        }
+
+        if (!isContiguous())
+        {
+            return contiguous().reshape(shape);
+        }
+
+        Tensor view(*this);
+        view.shape_ = shape;
+        view.strides_ = contiguousStrides(shape);
+
+        return view;
+    }
+
+    /*
+     * Reorders the axes; axis i of the result is axis order[i] of this tensor.
+     */
+    Tensor Tensor::permute(const std::vector<int> &order) const
+    {
+        std::vector<int> sorted(order);
+        std::sort(sorted.begin(), sorted.end());
+
+        std::vector<int> expected(shape_.size());
+        std::iota(expected.begin(), expected.end(), 0);
+
+        if (sorted != expected)
+        {
+            throw std::invalid_argument("Permutation must name every axis exactly once.");
+        }
+
+        Tensor view(*this);
+
+        for (std::size_t axis = 0; axis < order.size(); ++axis)
+        {
+            view.shape_[axis] = shape_[order[axis]];
+            view.strides_[axis] = strides_[order[axis]];
+        }
+
+        return view;
+    }
+
+    Tensor Tensor::slice(int axis, int first, int count) const
+    {
+        if (axis < 0 || axis >= rank() || first < 0 || count < 0 || first + count > shape_[axis])
+        {
+            throw std::invalid_argument("Slice out of range.");
+        }
+
+        Tensor view(*this);
+        view.shape_[axis] = count;
+        view.offset_ += first * strides_[axis];
+
+        return view;
+    }
+
+    /*
+     * Returns this tensor if it is already contiguous, otherwise copies it
+     * into fresh row-major storage.
+     */
+    Tensor Tensor::contiguous() const
+    {
+        if (isContiguous())
+        {
+            return *this;
+        }
+
+        Tensor result(shape_, layout_);
+        result.copy(*this);
+
+        return result;
+    }
+
+    /*
+     * Copies the elements of source, which must have the same shape, into
+     * this tensor's storage; either may be a strided view. Walks the last
+     * axis innermost.
+     */
+    void Tensor::copy(const Tensor &source)
+    {
+        if (source.shape_ != shape_)
+        {
+            throw std::invalid_argument("Tensor copy needs matching shapes.");
+        }
+
+        if (size() == 0)
+        {
+            return;
+        }
+
+        int last = rank() - 1;
+        int extent = shape_[last];
+        std::size_t from = source.strides_[last];
+        std::size_t to = strides_[last];
+
+        std::vector<int> index(rank(), 0);
+
+        for (std::size_t done = 0; done < size(); done += extent)
+        {
+            const double *input = source.base_ + source.position(index);
+            double *output = base_ + position(index);
+
+            for (int i = 0; i < extent; ++i)
+            {
+                output[i * to] = input[i * from];
+            }
+
+            for (int axis = last - 1; axis >= 0; --axis)
+            {
+                if (++index[axis] < shape_[axis])
+                {
+                    break;
+                }
+
+                index[axis] = 0;
+            }
+        }
+    }
+
+    /*
+     * Converts a rank-4 image tensor between NCHW and NHWC memory order.
+     */
+    Tensor Tensor::toLayout(Layout layout) const
+    {
+        if (layout == layout_)
+        {
+            return *this;
+        }
+
+        if (rank() != 4)
+        {
+            throw std::logic_error("Only rank-4 tensors have an image layout.");
+        }
+
+        Tensor result = permute(layout == NHWC ? std::vector<int>{0, 2, 3, 1} : std::vector<int>{0, 3, 1, 2}).contiguous();
+        result.layout_ = layout;
+
+        return result;
+    }
+
+    Matrix Tensor::toMatrix() const
+    {
+        if (rank() != 2)
+        {
+            throw std::logic_error("Only rank-2 tensors convert to a Matrix.");
+        }
+
+        Tensor source = contiguous();
+        Matrix result(shape_[0], shape_[1]);
+
+        std::copy(source.data(), source.data() + source.size(), result.data());
+
+        return result;
+    }
+
+    /*
+     * The inverse of fromColumns: one sample per column, as NeuralNet expects.
+     */
+    Matrix Tensor::toColumns() const
+    {
+        if (rank() != 4)
+        {
+            throw std::logic_error("Only rank-4 image tensors convert to columns.");
+        }
+
+        Tensor nchw = toLayout(NCHW);
+        int items = nchw.dim(0);
+
+        return nchw.permute({1, 2, 3, 0}).reshape({-1, items}).toMatrix();
+    }
+
+    /*
+     * result = a * b for rank-2 tensors, using the Matrix kernels directly
+     * on the tensors' storage. Each operand may be contiguous or the
+     * transpose of a contiguous tensor, as permute({1, 0}) gives; other
+     * views are copied first. result must be a contiguous view of the
+     * right shape, and is overwritten.
+     */
+    void matmul(const Tensor &a, const Tensor &b, Tensor &result)
+    {
+        if (a.rank() != 2 || b.rank() != 2 || a.dim(1) != b.dim(0))
+        {
+            throw std::logic_error("matmul needs rank-2 tensors with matching inner dimensions.");
+        }
+
+        int rows = a.dim(0);
+        int inner = a.dim(1);
+        int cols = b.dim(1);
+
+        if (result.shape() != std::vector<int>{rows, cols} || !result.isContiguous())
+        {
+            throw std::invalid_argument("matmul result must be a contiguous tensor of the product's shape.");
+        }
+
+        auto transposed = [](const Tensor &tensor)
+        {
+            return tensor.permute({1, 0}).isContiguous();
+        };
+
+        if (!a.isContiguous() && !transposed(a))
+        {
+            matmul(a.contiguous(), b, result);
+            return;
+        }
+
+        if (!b.isContiguous() && !transposed(b))
+        {
+            matmul(a, b.contiguous(), result);
+            return;
+        }
+
+        if (a.isContiguous() && b.isContiguous())
+        {
+            multiply(a.data(), b.data(), result.data(), rows, inner, cols);
+        }
+        else if (a.isContiguous())
+        {
+            multiplyTransposed(a.data(), b.data(), result.data(), rows, inner, cols);
+        }
+        else if (b.isContiguous())
+        {
+            transposeMultiply(a.data(), b.data(), result.data(), rows, inner, cols);
+        }
+        else
+        {
+            matmul(a.contiguous(), b, result);
+        }
+    }
+
+    Tensor matmul(const Tensor &a, const Tensor &b)
+    {
+        Tensor result({a.dim(0), b.dim(1)});
+        matmul(a, b, result);
+
+        return result;
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cassert>
+
+#include "matrix.h"
+
+namespace cave
+{
+    /*
+     * An n-dimensional array: storage plus shape, strides and an offset, so
+     * reshape, permute and slice return views of the same data instead of
+     * copies. Matrix is the 2-D, always-contiguous special case; tensors
+     * convert to and from it, view a Matrix's data in place, and multiply
+     * through the same kernels.
+     *
+     * Layout records how a rank-4 image tensor is ordered in memory, NCHW or
+     * NHWC; shape is always given in that order.
+     */
+    class Tensor
+    {
+    public:
+        enum Layout
+        {
+            NCHW = 0,
+            NHWC = 1,
+        };
+
+    private:
+        // Null for views of a Matrix, which owns the data instead.
+        std::shared_ptr<std::vector<double>> buffer_;
+        double *base_{nullptr};
+        std::vector<int> shape_;
+        std::vector<std::size_t> strides_;
+        std::size_t offset_{0};
+        Layout layout_{NCHW};
+
+    private:
+        static std::vector<std::size_t> contiguousStrides(const std::vector<int> &shape);
+        std::size_t position(const std::vector<int> &index) const;
+
+    public:
+        Tensor() {}
+        Tensor(std::vector<int> shape, Layout layout = NCHW);
+
+        static Tensor fromMatrix(Matrix matrix);
+        static Tensor view(Matrix &matrix) { return view(matrix, {matrix.rows(), matrix.cols()}); }
+        static Tensor view(Matrix &matrix, std::vector<int> shape);
+        static const Tensor view(const Matrix &matrix) { return view(matrix, {matrix.rows(), matrix.cols()}); }
+        static const Tensor view(const Matrix &matrix, std::vector<int> shape);
+        static Tensor fromColumns(Matrix matrix, int channels, int height, int width);
+
+        int rank() const { return shape_.size(); }
+        int dim(int axis) const { return shape_[axis]; }
+        std::size_t size() const;
+        const std::vector<int> &shape() const { return shape_; }
+        const std::vector<std::size_t> &strides() const { return strides_; }
+        Layout layout() const { return layout_; }
+
+        bool isContiguous() const;
+        bool sharesStorage(const Tensor &other) const { return base_ && base_ == other.base_; }
+
+        double *data() { return base_ + offset_; }
+        const double *data() const { return base_ + offset_; }
+
+        double &at(const std::vector<int> &index) { return base_[position(index)]; }
+        double at(const std::vector<int> &index) const { return base_[position(index)]; }
+
+        /*
+         * The address of one element, for kernels that walk a view with
+         * their own loops; unlike at() it builds no index vector.
+         */
+        template <typename... Index>
+        double *address(Index... index)
+        {
+            return base_ + offsetOf(index...);
+        }
+
+        template <typename... Index>
+        const double *address(Index... index) const
+        {
+            return base_ + offsetOf(index...);
+        }
+
+        Tensor reshape(std::vector<int> shape) const;
+        Tensor permute(const std::vector<int> &order) const;
+        Tensor slice(int axis, int first, int count) const;
+        Tensor contiguous() const;
+        Tensor toLayout(Layout layout) const;
+
+        void copy(const Tensor &source);
+
+        Matrix toMatrix() const;
+        Matrix toColumns() const;
+
+    private:
+        template <typename... Index>
+        std::size_t offsetOf(Index... index) const
+        {
+            assert(sizeof...(Index) == shape_.size());
+
+            std::size_t result = offset_;
+            std::size_t axis = 0;
+
+            ((result += std::size_t(index) * strides_[axis++]), ...);
+
+            return result;
+        }
+    };
+
+    void matmul(const Tensor &a, const Tensor &b, Tensor &result);
+    Tensor matmul(const Tensor &a, const Tensor &b);
+}
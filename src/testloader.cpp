@@ -1,5 +1,6 @@
 #include "testloader.h"
 #include "matrixfunctions.h"
+#include "threadpool.h"
 #include <iostream>
 
 #include <cmath>
@@ -10,20 +11,38 @@ namespace cave
     {
         TrainingData trainingData;
 
-        int totalItems = 0;
-
         int numberBatches = std::ceil(double(items_)/batchSize_);
 
+        trainingData.input.resize(numberBatches);
+        trainingData.expected.resize(numberBatches);
+
+        ThreadPool<int> threadPool(threads_);
+
         for(int batch = 0; batch < numberBatches; ++batch)
         {
-            int itemsToRead = std::min(batchSize_, items_ - totalItems);
+            // clang-format off
+            threadPool.submit([&, batch]()
+            {
+                int itemsToRead = std::min(batchSize_, items_ - batch * batchSize_);
 
-            auto testData = generateTestData(itemsToRead, inputSize_, outputSize_);
+                Matrix &input = trainingData.input[batch];
+                Matrix &expected = trainingData.expected[batch];
 
-            trainingData.input.push_back(testData.input);
-            trainingData.expected.push_back(testData.output);
+                input = Matrix(inputSize_, itemsToRead);
+                expected = Matrix(outputSize_, itemsToRead);
 
-            totalItems += itemsToRead;
+                generateTestData(input, expected, seed_, batch);
+
+                return itemsToRead;
+            });
+            // clang-format on
+        }
+
+        threadPool.start();
+
+        for(int batch = 0; batch < numberBatches; ++batch)
+        {
+            threadPool.get();
         }
 
         return trainingData;
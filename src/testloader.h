@@ -1,10 +1,19 @@
 #pragma once
 
 #include <mutex>
+#include <thread>
+#include <algorithm>
 #include "loader.h"
+#include "random.h"
 
 namespace cave
 {
+    /*
+     * Synthetic data from generateTestData. Each batch is drawn from its
+     * own Philox stream keyed by the seed and the batch index, so batches
+     * are generated in parallel straight into their preallocated matrices
+     * and the same seed gives the same data whatever the thread count.
+     */
     class TestLoader : public Loader
     {
     private:
@@ -12,13 +21,17 @@ namespace cave
         int inputSize_;
         int outputSize_;
         int batchSize_;
+        std::uint64_t seed_;
+        int threads_{int(std::max(1u, std::thread::hardware_concurrency()))};
 
     public:
-        TestLoader(int items, int inputSize, int outputSize, int batchSize)
-            : items_(items), inputSize_(inputSize), outputSize_{outputSize}, batchSize_{batchSize}
+        TestLoader(int items, int inputSize, int outputSize, int batchSize, std::uint64_t seed = Philox::randomSeed())
+            : items_(items), inputSize_(inputSize), outputSize_{outputSize}, batchSize_{batchSize}, seed_{seed}
         {
         }
-        
+
+        void setThreads(int threads) { threads_ = threads; }
+
         TrainingData load();
     };
 }
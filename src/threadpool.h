@@ -6,8 +6,11 @@
 #include <atomic>
 #include <sstream>
 #include <queue>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 
-#include "threadpool.h"
+#include "topology.h"
 
 namespace cave
 {
@@ -18,7 +21,8 @@ namespace cave
         int threads_{0};
         int submissions_{0};
         std::queue<E> results_;
-        std::queue<std::function<E()> > work_;
+        std::vector<std::queue<std::function<E()> > > work_;
+        const Topology *topology_{nullptr};
 
 
         std::mutex mtxWork_;
@@ -27,19 +31,38 @@ namespace cave
         std::vector<std::shared_future<void>> futures_;
 
     private:
-        void produce()
+        void produce(int worker)
         {
+            int node = 0;
+
+            if (topology_ != nullptr)
+            {
+                node = topology_->nodeForWorker(worker);
+                topology_->pin(node);
+            }
+
             while (true)
             {
                 std::unique_lock<std::mutex> workLock(mtxWork_);
 
-                if (work_.size() == 0)
+                // Take work queued for this worker's node first, then steal.
+                std::function<E()> func;
+
+                for (std::size_t i = 0; i < work_.size() && !func; ++i)
                 {
-                    break;
+                    auto &queue = work_[(node + i) % work_.size()];
+
+                    if (queue.size() > 0)
+                    {
+                        func = queue.front();
+                        queue.pop();
+                    }
                 }
 
-                auto func = work_.front();
-                work_.pop();
+                if (!func)
+                {
+                    break;
+                }
 
                 workLock.unlock();
 
@@ -53,8 +76,14 @@ namespace cave
         }
 
     public:
-        ThreadPool(int threads) : threads_(threads)
+        ThreadPool(int threads) : threads_(threads), work_(1)
+        {
+        }
+
+        void setTopology(const Topology &topology)
         {
+            topology_ = &topology;
+            work_.resize(topology.nodes());
         }
 
         int size()
@@ -66,15 +95,15 @@ namespace cave
         {
             for (int i = 0; i < threads_; ++i)
             {
-                std::shared_future<void> future = std::async(std::launch::async, &ThreadPool::produce, this);
+                std::shared_future<void> future = std::async(std::launch::async, &ThreadPool::produce, this, i);
                 futures_.push_back(future);
             }
         }
 
-        void submit(std::function<E()> func)
+        void submit(std::function<E()> func, int node = 0)
         {
             ++submissions_;
-            work_.push(func);
+            work_[node % work_.size()].push(func);
         }
 
         E get()
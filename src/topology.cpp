@@ -0,0 +1,189 @@
+#include "topology.h"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <thread>
+#include <future>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace cave
+{
+    thread_local int Topology::currentNode_{0};
+
+    std::vector<int> Topology::parseCpuList(std::string list)
+    {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+
+        while (std::getline(ss, range, ','))
+        {
+            if (range.empty() || range == "\n")
+            {
+                continue;
+            }
+
+            std::size_t dash = range.find('-');
+
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+
+        return cpus;
+    }
+
+    Topology::Topology(std::string root)
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+
+        std::vector<std::pair<int, std::vector<int>>> found;
+        std::error_code error;
+
+        for (auto &entry : std::filesystem::directory_iterator(root, error))
+        {
+            std::string name = entry.path().filename().string();
+
+            if (name.rfind("node", 0) != 0 || name.size() == 4 || !std::isdigit(name[4]))
+            {
+                continue;
+            }
+
+            std::ifstream in(entry.path() / "cpulist");
+            std::string list;
+            std::getline(in, list);
+
+            std::vector<int> cpus;
+
+            // Keep only CPUs this process may use, e.g. inside a cpuset.
+            for (int cpu : parseCpuList(list))
+            {
+                if (CPU_ISSET(cpu, &allowed))
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+
+            if (!cpus.empty())
+            {
+                found.push_back({std::stoi(name.substr(4)), cpus});
+            }
+        }
+
+        std::sort(found.begin(), found.end());
+
+        for (auto &node : found)
+        {
+            cpus_.push_back(node.second);
+        }
+
+        if (cpus_.empty())
+        {
+            std::vector<int> cpus;
+
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &allowed))
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+
+            cpus_.push_back(cpus);
+        }
+    }
+
+    /*
+     * Restricts the calling thread to the CPUs of a node. Memory it touches
+     * first is then allocated on that node by the kernel's default policy.
+     */
+    bool Topology::pin(int node) const
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        for (int cpu : cpus_[node])
+        {
+            CPU_SET(cpu, &set);
+        }
+
+        currentNode_ = node;
+
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    /*
+     * Restricts the calling process to the CPUs of a node. Threads it starts
+     * afterwards inherit the mask, so call it before starting any.
+     */
+    bool Topology::bind(int node) const
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+
+        for (int cpu : cpus_[node])
+        {
+            CPU_SET(cpu, &set);
+        }
+
+        currentNode_ = node;
+
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+
+    /*
+     * Re-allocates batch i from a thread pinned to node i % nodes(), matching
+     * the node hint ThreadPool gets for that batch.
+     */
+    void Topology::firstTouch(std::vector<Matrix> &batches) const
+    {
+        if (nodes() < 2)
+        {
+            return;
+        }
+
+        std::vector<std::future<void>> futures;
+
+        for (int node = 0; node < nodes(); ++node)
+        {
+            // clang-format off
+            futures.push_back(std::async(std::launch::async, [this, node, &batches]()
+            {
+                pin(node);
+
+                for (std::size_t i = node; i < batches.size(); i += nodes())
+                {
+                    Matrix local(batches[i]);
+                    batches[i] = std::move(local);
+                }
+            }));
+            // clang-format on
+        }
+
+        for (auto &future : futures)
+        {
+            future.get();
+        }
+    }
+
+    std::ostream &operator<<(std::ostream &out, const Topology &topology)
+    {
+        for (int node = 0; node < topology.nodes(); ++node)
+        {
+            out << "Node " << node << ": " << topology.cpus(node).size() << " CPUs" << std::endl;
+        }
+
+        return out;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "matrix.h"
+
+namespace cave
+{
+    /*
+     * NUMA layout of the host, read from /sys/devices/system/node or another
+     * directory laid out the same way. Hosts without that directory are
+     * treated as a single node holding every CPU the process may run on.
+     */
+    class Topology
+    {
+    private:
+        std::vector<std::vector<int>> cpus_;
+
+        static thread_local int currentNode_;
+
+        static std::vector<int> parseCpuList(std::string list);
+
+        explicit Topology(std::vector<std::vector<int>> cpus) : cpus_(std::move(cpus)) {}
+
+    public:
+        explicit Topology(std::string root = "/sys/devices/system/node");
+
+        int nodes() const { return cpus_.size(); }
+        const std::vector<int> &cpus(int node) const { return cpus_[node]; }
+        int nodeForWorker(int worker) const { return worker % nodes(); }
+
+        bool pin(int node) const;
+        bool bind(int node) const;
+        Topology only(int node) const { return Topology(std::vector<std::vector<int>>{cpus_[node]}); }
+        static int currentNode() { return currentNode_; }
+
+        void firstTouch(std::vector<Matrix> &batches) const;
+
+        friend std::ostream &operator<<(std::ostream &out, const Topology &topology);
+    };
+}